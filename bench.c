@@ -0,0 +1,121 @@
+// Drives libjplayer as fast as it goes over each input and prints what it
+// got through as JSON, one object per input.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "jplayer.h"
+
+#define AUDIO_FRAMES 1024
+#define AUDIO_WAIT_MS 2
+#define WARMUP_SECONDS 2.0 // of media, until the queues and pools should be full
+
+double clock_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+double cpu_time_ms(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+bool run_input(const char *input, int output_height)
+{
+    double start = clock_ms(), cpu_start = cpu_time_ms();
+    JPlayer *player;
+    JPOptions options = {.quiet = true, .output_height = output_height};
+    if (jp_open(input, &options, &player) != JP_OK) {
+        fprintf(stderr, "ERROR: %s: %s\n", input, jp_error(NULL));
+        return false;
+    }
+    const JPInfo *info = jp_info(player);
+    double opened = clock_ms();
+    float *samples = malloc(sizeof(float) * AUDIO_FRAMES * info->channels);
+    if (samples == NULL || jp_start(player) != JP_OK) {
+        fprintf(stderr, "ERROR: %s: %s\n", input, samples == NULL ? "out of memory" : jp_error(player));
+        jp_close(player);
+        free(samples);
+        return false;
+    }
+
+    long video_frames = 0, audio_samples = 0;
+    double first_frame = 0.0;
+    // pool buffers allocated after the first seconds of the input, 0 once the pools are warm
+    JPAllocStats allocs, warm = {0};
+    bool warmed = false;
+    bool video_done = false, audio_done = false, failed = false;
+    while (!failed && (!video_done || !audio_done)) {
+        // audio doesn't block, so wait on video only once audio has caught up
+        int n = audio_done ? JP_EOF : jp_pull_audio(player, samples, AUDIO_FRAMES);
+        if (n > 0) audio_samples += n;
+        else if (n == JP_EOF) audio_done = true;
+        else if (n == JP_ERROR) failed = true;
+
+        if (video_done) {
+            // nothing to block on for audio, don't spin a core while the pipeline catches up
+            if (n == JP_AGAIN) nanosleep(&(struct timespec){0, AUDIO_WAIT_MS * 1000000L}, NULL);
+            continue;
+        }
+        JPVideoFrame frame;
+        int ret = jp_pull_video(player, &frame, n > 0 ? 0 : 10);
+        if (ret == JP_OK && !warmed && frame.pts >= WARMUP_SECONDS) {
+            jp_alloc_stats(player, &warm);
+            warmed = true;
+        }
+        if (ret == JP_OK) {
+            if (video_frames++ == 0) first_frame = clock_ms() - start;
+        } else if (ret == JP_EOF) {
+            video_done = true;
+        } else if (ret == JP_ERROR) {
+            failed = true;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "ERROR: %s: %s\n", input, jp_error(player));
+        jp_close(player);
+        free(samples);
+        return false;
+    }
+    double seconds = (clock_ms() - start) / 1000.0;
+    double cpu = cpu_time_ms() - cpu_start;
+    jp_alloc_stats(player, &allocs);
+
+    printf("{\"input\": \"%s\", \"width\": %d, \"height\": %d, \"open_ms\": %.3f, "
+           "\"first_frame_ms\": %.3f, \"seconds\": %.3f, \"video_frames\": %ld, \"fps\": %.2f, "
+           "\"audio_samples\": %ld, \"realtime_factor\": %.2f, \"cpu_ms\": %.1f, "
+           "\"frame_buffers_after_warmup\": %ld, \"packet_buffers_after_warmup\": %ld}\n",
+           input, info->width, info->height, opened - start, first_frame, seconds,
+           video_frames, seconds > 0.0 ? video_frames / seconds : 0.0, audio_samples,
+           seconds > 0.0 ? audio_samples / (double)info->sample_rate / seconds : 0.0, cpu,
+           warmed ? (long)(allocs.frame_buffers - warm.frame_buffers) : 0L,
+           warmed ? (long)(allocs.packet_buffers - warm.packet_buffers) : 0L);
+    jp_close(player);
+    free(samples);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "USAGE: %s [-height <px>] <input>...\n", argv[0]);
+        return 1;
+    }
+    int output_height = 0;
+    bool ok = true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-height") == 0 && i + 1 < argc) {
+            output_height = atoi(argv[++i]);
+            continue;
+        }
+        ok = run_input(argv[i], output_height) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,4206 @@
+// The pipeline: inputs, demuxing, decoding, conversion and the audio ring,
+// with the jp_ api of libjplayer on top. The jplay frontend is in player.c.
+#include "jplayer_internal.h"
+
+// A/V sync, in seconds
+#define SYNC_THRESHOLD 0.02 // drift the audio is corrected beyond
+#define SYNC_NOSYNC 10.0 // past this the clocks are too far apart to correct
+#define SYNC_RESET 0.1 // a video master this late restarts from the current frame
+#define SYNC_MAX_CORRECTION 0.05 // fraction of a frame the resampler may stretch
+// Late frames
+#define LATE_THRESHOLD 0.05 // frames this far behind the master are never converted
+#define SKIP_ESCALATE_DROPS 5 // drops within SKIP_HOLD of each other that raise the skip level
+#define SKIP_HOLD 0.5 // minimum time at a skip level before raising it again
+#define SKIP_RECOVER 2.0 // time without drops before lowering the skip level
+
+_Thread_local jmp_buf *error_jmp = NULL;
+_Thread_local char error_message[256];
+_Thread_local atomic_bool *open_cancel = NULL;
+
+// Globals
+VideoWall video_wall = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+TaskPool task_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .released = PTHREAD_COND_INITIALIZER,
+    .users_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+// flags
+_Thread_local bool quiet = false;
+int codec_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+int convert_threads = 0;
+QueueLimits packet_limits = {16*MB, 10*AV_TIME_BASE};
+QueueLimits video_limits = {256*MB, 1*AV_TIME_BASE};
+QueueLimits audio_limits = {16*MB, 2*AV_TIME_BASE};
+int64_t memory_limit = 512*MB;
+int64_t net_cache_size = 64*MB;
+int64_t net_disk_limit = 1024*MB;
+const char *resolver = "yt-dlp";
+int64_t probesize = 0;
+int64_t analyzeduration = 0;
+int audio_buffer_ms = 200;
+int audio_latency_ms = 0;
+SyncMaster sync_master = SYNC_AUDIO;
+double normalize_lufs = 0.0;
+bool wall_mode = false;
+bool use_mmap = true;
+bool windowed = false;
+bool render_yuv = false;
+const char *audio_input = NULL;
+int dts_window_ms = 500;
+const char *sync_names[] = {"audio", "video", "external"};
+atomic_llong queued_bytes = 0;
+bool bench_mode = false;
+_Thread_local const char *_Atomic *open_status = NULL;
+
+const char *stage_names[STAGE_COUNT] = {
+    "demux", "video_decode", "audio_decode", "convert", "resample"
+};
+const char *phase_names[PHASE_COUNT] = {
+    "open", "probe", "codec_open", "first_packet", "first_decoded", "first_presented"
+};
+double startup_origin;
+
+// Decoder settings per skip level, each one drops more frames than the last
+const struct {
+    enum AVDiscard frame;
+    enum AVDiscard loop_filter;
+} skip_levels[] = {
+    {AVDISCARD_DEFAULT, AVDISCARD_DEFAULT},
+    {AVDISCARD_NONREF, AVDISCARD_NONREF},
+    {AVDISCARD_BIDIR, AVDISCARD_BIDIR},
+    {AVDISCARD_NONKEY, AVDISCARD_ALL},
+};
+#define SKIP_LEVELS (int)(sizeof(skip_levels)/sizeof(*skip_levels))
+
+const char *trace_path = NULL;
+TraceBuffer *_Atomic trace_buffers = NULL;
+atomic_int trace_threads = 0;
+_Thread_local TraceBuffer *trace_buf = NULL;
+
+long frames_skipped(JPlayer *p)
+{
+    long skipped = atomic_load(&p->late_stats.packets) - atomic_load(&p->late_stats.frames);
+    return skipped > 0 ? skipped : 0;
+}
+
+double now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+void samples_push(Samples *s, double value)
+{
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->items = av_realloc_array(s->items, s->cap, sizeof(double));
+        if (s->items == NULL) ERROR("out of memory");
+    }
+    s->items[s->count++] = value;
+}
+
+// record the time since start for a pipeline stage
+void record_stage(JPlayer *p, Stage stage, double start)
+{
+    if (!bench_mode) return;
+    samples_push(&p->bench.stages[stage], now_ms() - start);
+}
+
+// the calling thread's buffer, created and linked in on first use
+TraceBuffer *trace_buffer(void)
+{
+    if (trace_buf != NULL) return trace_buf;
+    TraceBuffer *buf = av_mallocz(sizeof(TraceBuffer));
+    if (buf == NULL) ERROR("out of memory");
+    buf->tid = atomic_fetch_add(&trace_threads, 1) + 1;
+    buf->next = atomic_load(&trace_buffers);
+    while (!atomic_compare_exchange_weak(&trace_buffers, &buf->next, buf));
+    trace_buf = buf;
+    return buf;
+}
+
+// name the calling thread in the trace
+void trace_thread(const char *name)
+{
+    if (trace_path != NULL) trace_buffer()->thread = name;
+}
+
+// a thread starting work for p logs like p
+void player_thread(JPlayer *p, const char *name)
+{
+    quiet = p->quiet;
+    trace_thread(name);
+}
+
+// start time of a span, only read when tracing
+double trace_now(void)
+{
+    return trace_path != NULL ? now_ms() : 0.0;
+}
+
+void trace_event(const char *name, double start, double dur, double value)
+{
+    TraceBuffer *buf = trace_buffer();
+    int i = atomic_load_explicit(&buf->count, memory_order_relaxed);
+    int chunk = i / TRACE_CHUNK;
+    if (chunk >= TRACE_MAX_CHUNKS) {
+        buf->dropped++;
+        return;
+    }
+    if (buf->chunks[chunk] == NULL) {
+        buf->chunks[chunk] = av_malloc_array(TRACE_CHUNK, sizeof(TraceEvent));
+        if (buf->chunks[chunk] == NULL) ERROR("out of memory");
+    }
+    buf->chunks[chunk][i % TRACE_CHUNK] = (TraceEvent){name, start, dur, value};
+    atomic_store_explicit(&buf->count, i + 1, memory_order_release);
+}
+
+// a call that began at start just returned
+void trace_span(const char *name, double start)
+{
+    if (trace_path != NULL) trace_event(name, start, now_ms() - start, 0.0);
+}
+
+void trace_counter(const char *name, double value)
+{
+    if (trace_path != NULL) trace_event(name, now_ms(), -1.0, value);
+}
+
+// Write every buffer as trace events, in us since startup. Threads that are
+// still running only have what they published so far written.
+void trace_write(void)
+{
+    FILE *f = fopen(trace_path, "w");
+    if (f == NULL) {
+        WARN("could not write trace %s", trace_path);
+        return;
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"jplay\"}}");
+    long events = 0, dropped = 0;
+    for (TraceBuffer *buf = atomic_load(&trace_buffers); buf != NULL; buf = buf->next) {
+        fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                "\"args\": {\"name\": \"%s\"}}", buf->tid, buf->thread ? buf->thread : "other");
+        int count = atomic_load_explicit(&buf->count, memory_order_acquire);
+        for (int i = 0; i < count; i++) {
+            TraceEvent *e = &buf->chunks[i / TRACE_CHUNK][i % TRACE_CHUNK];
+            double ts = (e->start - startup_origin) * 1000.0;
+            if (e->dur >= 0.0) {
+                fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                        "\"ts\": %.3f, \"dur\": %.3f}", e->name, buf->tid, ts, e->dur * 1000.0);
+            } else {
+                fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, "
+                        "\"args\": {\"value\": %.0f}}", e->name, ts, e->value);
+            }
+        }
+        events += count;
+        dropped += buf->dropped;
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    LOG("trace: %ld events written to %s%s", events, trace_path, dropped ? ", some dropped" : "");
+    if (dropped) WARN("trace: %ld events dropped, the buffers were full", dropped);
+}
+
+double clock_get(Clock *c, double now)
+{
+    return c->paused ? c->pts : c->pts + now - c->updated;
+}
+
+void clock_set(Clock *c, double pts, double now)
+{
+    c->pts = pts;
+    c->updated = now;
+}
+
+void clock_pause(Clock *c, bool paused, double now)
+{
+    if (paused && !c->paused) c->pts = clock_get(c, now);
+    else if (!paused && c->paused) c->updated = now;
+    c->paused = paused;
+}
+
+void drift_push(DriftStats *d, double drift)
+{
+    d->count++;
+    d->sum += drift;
+    d->sum_sq += drift * drift;
+    if (fabs(drift) > fabs(d->max)) d->max = drift;
+}
+
+double drift_mean(DriftStats *d)
+{
+    return d->count ? d->sum / d->count : 0.0;
+}
+
+double drift_stddev(DriftStats *d)
+{
+    if (d->count == 0) return 0.0;
+    double mean = drift_mean(d);
+    double var = d->sum_sq / d->count - mean * mean;
+    return var > 0.0 ? sqrt(var) : 0.0;
+}
+
+// only the first time a phase completes counts
+bool startup_mark(JPlayer *p, StartupPhase phase)
+{
+    double unset = 0.0;
+    double t = now_ms() - startup_origin;
+    return atomic_compare_exchange_strong(&p->startup[phase], &unset, t > 0.0 ? t : 1e-3);
+}
+
+void startup_log(JPlayer *p)
+{
+    char buf[256];
+    int len = 0;
+    for (int i = 0; i < PHASE_COUNT; i++)
+        len += snprintf(buf + len, sizeof(buf) - len, " %s %.1fms", phase_names[i], p->startup[i]);
+    LOG("startup:%s", buf);
+}
+
+// probe limits for avformat_open_input, NULL when left at the defaults
+AVDictionary *probe_options(void)
+{
+    AVDictionary *opts = NULL;
+    if (probesize > 0) av_dict_set_int(&opts, "probesize", probesize, 0);
+    if (analyzeduration > 0) av_dict_set_int(&opts, "analyzeduration", analyzeduration, 0);
+    return opts;
+}
+
+// index of the last keyframe at or before pts, -1 if there is none
+int index_find(KeyframeIndex *index, int64_t pts)
+{
+    int lo = 0, hi = index->count - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (index->items[mid].pts <= pts) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+void index_add(KeyframeIndex *index, int64_t pts, int64_t pos)
+{
+    // a mapped index is complete and read only
+    if (index->map != NULL) return;
+    int i = index_find(index, pts);
+    if (i >= 0 && index->items[i].pts == pts) return;
+    if (index->count == index->cap) {
+        index->cap = index->cap ? index->cap * 2 : 256;
+        index->items = av_realloc_array(index->items, index->cap, sizeof(Keyframe));
+        if (index->items == NULL) ERROR("out of memory");
+    }
+    // packets mostly arrive in order so this is usually an append
+    i++;
+    memmove(&index->items[i + 1], &index->items[i], (index->count - i) * sizeof(Keyframe));
+    index->items[i] = (Keyframe){pts, pos, AV_NOPTS_VALUE};
+    index->count++;
+}
+
+void index_free(KeyframeIndex *index)
+{
+    if (index->map != NULL) munmap(index->map, index->map_size);
+    else av_free(index->items);
+    *index = (KeyframeIndex){0};
+}
+
+uint64_t hash_string(const char *str)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *str; str++) hash = (hash ^ (unsigned char)*str) * 0x100000001b3ULL;
+    return hash;
+}
+
+// create the cache directory and everything above it
+bool make_dirs(char *path)
+{
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        bool ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+        *p = '/';
+        if (!ok) return false;
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+// $XDG_CACHE_HOME/jplay or ~/.cache/jplay, not created
+bool cache_dir(char *dir)
+{
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache != NULL && cache[0] != '\0') snprintf(dir, PATH_MAX, "%s/jplay", cache);
+    else if (home != NULL) snprintf(dir, PATH_MAX, "%s/.cache/jplay", home);
+    else return false;
+    return true;
+}
+
+// figure out where the index of a local file lives, false for anything that
+// isn't a regular file
+bool index_cache_init(JPlayer *p, const char *video_file)
+{
+    struct stat st;
+    p->index_cache.enabled = false;
+    if (realpath(video_file, p->index_cache.file) == NULL) return false;
+    if (stat(p->index_cache.file, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+
+    char dir[PATH_MAX];
+    if (!cache_dir(dir)) return false;
+
+    snprintf(p->index_cache.path, PATH_MAX, "%s/%016llx.idx", dir,
+             (unsigned long long)hash_string(p->index_cache.file));
+    p->index_cache.file_size = st.st_size;
+    p->index_cache.mtime = st.st_mtim;
+    p->index_cache.enabled = true;
+    return true;
+}
+
+size_t index_entries_offset(uint32_t path_len)
+{
+    return sizeof(IndexHeader) + ((path_len + 7) & ~7u);
+}
+
+// map the cached index if it matches the input, the entries are used in place
+bool index_cache_load(VideoContext *ctx, KeyframeIndex *index)
+{
+    JPlayer *p = ctx->player;
+    int fd = open(p->index_cache.path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    IndexHeader *header = map;
+    size_t offset = index_entries_offset(header->path_len);
+    bool valid = header->magic == INDEX_MAGIC && header->version == INDEX_VERSION &&
+        header->file_size == p->index_cache.file_size &&
+        header->mtime_sec == p->index_cache.mtime.tv_sec &&
+        header->mtime_nsec == p->index_cache.mtime.tv_nsec &&
+        header->v_index == ctx->v_index && header->a_index == ctx->a_index &&
+        header->path_len == strlen(p->index_cache.file) &&
+        // bound count before multiplying, it comes from the file
+        offset <= (size_t)st.st_size && header->count >= 0 && header->count <= INT_MAX &&
+        (size_t)header->count <= ((size_t)st.st_size - offset) / sizeof(Keyframe) &&
+        offset + header->count * sizeof(Keyframe) == (size_t)st.st_size &&
+        memcmp((char *)map + sizeof(IndexHeader), p->index_cache.file, header->path_len) == 0;
+    if (!valid) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    *index = (KeyframeIndex){
+        .items = (Keyframe *)((char *)map + offset),
+        .count = header->count,
+        .cap = header->count,
+        .complete = true,
+        .map = map,
+        .map_size = st.st_size,
+        .duration = header->duration,
+    };
+    return true;
+}
+
+// write to a temporary file first so a reader never maps a partial index
+bool index_cache_save(VideoContext *ctx, KeyframeIndex *index)
+{
+    JPlayer *p = ctx->player;
+    char dir[PATH_MAX], tmp[PATH_MAX];
+    snprintf(dir, PATH_MAX, "%s", p->index_cache.path);
+    *strrchr(dir, '/') = '\0';
+    if (!make_dirs(dir)) return false;
+    snprintf(tmp, PATH_MAX, "%s.%d.tmp", p->index_cache.path, getpid());
+
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) return false;
+    IndexHeader header = {
+        .magic = INDEX_MAGIC,
+        .version = INDEX_VERSION,
+        .file_size = p->index_cache.file_size,
+        .mtime_sec = p->index_cache.mtime.tv_sec,
+        .mtime_nsec = p->index_cache.mtime.tv_nsec,
+        .duration = index->duration,
+        .v_index = ctx->v_index,
+        .a_index = ctx->a_index,
+        .count = index->count,
+        .path_len = strlen(p->index_cache.file),
+    };
+    char pad[8] = {0};
+    size_t path_pad = index_entries_offset(header.path_len) - sizeof(header) - header.path_len;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(p->index_cache.file, 1, header.path_len, f) == header.path_len &&
+        fwrite(pad, 1, path_pad, f) == path_pad &&
+        fwrite(index->items, sizeof(Keyframe), index->count, f) == (size_t)index->count;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, p->index_cache.path) != 0) {
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+int compare_keyframe(const void *a, const void *b)
+{
+    int64_t x = ((const Keyframe *)a)->pts, y = ((const Keyframe *)b)->pts;
+    return (x > y) - (x < y);
+}
+
+// Scan the whole input on a second demuxer, recording every video keyframe
+// and the first audio pts after it, then save and map the result.
+void *index_thread_func(void *arg)
+{
+    VideoContext *ctx = (VideoContext *)arg;
+    JPlayer *p = ctx->player;
+    player_thread(p, "index");
+    // lowest priority so the scan never competes with playback
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    AVFormatContext *format_ctx = NULL;
+    if (avformat_open_input(&format_ctx, p->index_cache.file, NULL, NULL) != 0) {
+        WARN("index: could not open %s", p->index_cache.file);
+        return NULL;
+    }
+    for (unsigned i = 0; i < format_ctx->nb_streams; i++) {
+        if ((int)i != ctx->v_index && (ctx->is_split || (int)i != ctx->a_index))
+            format_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    KeyframeIndex index = {0};
+    AVRational time_base = ctx->format_ctx->streams[ctx->v_index]->time_base;
+    int64_t end = 0;
+    bool want_audio = false;
+    AVPacket *packet = av_packet_alloc();
+    int ret;
+    while (!ctx->quit && (ret = av_read_frame(format_ctx, packet)) != AVERROR_EOF) {
+        if (ret < 0) continue;
+        int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+        if (packet->stream_index == ctx->v_index && pts != AV_NOPTS_VALUE) {
+            if (pts + packet->duration > end) end = pts + packet->duration;
+            if (packet->flags & AV_PKT_FLAG_KEY) {
+                if (index.count == index.cap) {
+                    // playback goes on without the scan, it seeks by the index it has
+                    Keyframe *items = av_realloc_array(index.items, index.cap ? index.cap * 2 : 1024,
+                                                       sizeof(Keyframe));
+                    if (items == NULL) {
+                        WARN("index: out of memory");
+                        break;
+                    }
+                    index.items = items;
+                    index.cap = index.cap ? index.cap * 2 : 1024;
+                }
+                index.items[index.count++] = (Keyframe){pts, packet->pos, AV_NOPTS_VALUE};
+                want_audio = true;
+            }
+        } else if (packet->stream_index == ctx->a_index && want_audio && index.count > 0) {
+            index.items[index.count - 1].audio_pts = pts;
+            want_audio = false;
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    avformat_close_input(&format_ctx);
+
+    if (!ctx->quit && index.count > 0) {
+        qsort(index.items, index.count, sizeof(Keyframe), compare_keyframe);
+        index.duration = end * av_q2d(time_base) - ctx->start_time;
+        if (index_cache_save(ctx, &index)) {
+            KeyframeIndex *mapped = av_mallocz(sizeof(KeyframeIndex));
+            if (mapped != NULL && index_cache_load(ctx, mapped)) {
+                LOG("index: saved %d keyframes to %s", mapped->count, p->index_cache.path);
+                // the renderer reads it meanwhile, only an unknown duration is filled in
+                double unknown = ctx->duration;
+                if (unknown <= 0.0)
+                    atomic_compare_exchange_strong(&ctx->duration, &unknown, mapped->duration);
+                atomic_store(&p->index_cache.ready, mapped);
+            } else {
+                av_free(mapped);
+            }
+        } else {
+            WARN("index: could not write %s", p->index_cache.path);
+        }
+    }
+    av_free(index.items);
+    return NULL;
+}
+
+// start from the keyframes the demuxer already knows, e.g. from an mp4 moov
+void index_init(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    AVStream *stream = ctx->format_ctx->streams[ctx->v_index];
+    int n = avformat_index_get_entries_count(stream);
+    for (int i = 0; i < n; i++) {
+        const AVIndexEntry *entry = avformat_index_get_entry(stream, i);
+        if (entry->flags & AVINDEX_KEYFRAME)
+            index_add(&p->kf_index, entry->timestamp, entry->pos);
+    }
+    p->kf_index.complete = p->kf_index.count > 0;
+    LOG("Keyframe index %d entries%s", p->kf_index.count, p->kf_index.complete ? " (complete)" : "");
+}
+
+// use the cached index of a local file or schedule a scan to build it
+void index_open(VideoContext *ctx, const char *video_file)
+{
+    JPlayer *p = ctx->player;
+    if (!index_cache_init(p, video_file)) {
+        index_init(ctx);
+        return;
+    }
+    KeyframeIndex cached;
+    if (index_cache_load(ctx, &cached)) {
+        p->kf_index = cached;
+        if (ctx->duration <= 0.0) ctx->duration = p->kf_index.duration;
+        LOG("Keyframe index %d entries from %s", p->kf_index.count, p->index_cache.path);
+        return;
+    }
+    index_init(ctx);
+    // the container already has a full index so a scan wouldn't add anything
+    if (!p->kf_index.complete) p->index_cache.building = true;
+}
+
+// the atlas cache sits beside the index cache of the same file
+void thumbs_cache_path(JPlayer *p, char *path)
+{
+    snprintf(path, PATH_MAX, "%.*s.thumbs", (int)strlen(p->index_cache.path) - 4, p->index_cache.path);
+}
+
+bool thumbs_cache_load(JPlayer *p)
+{
+    char path[PATH_MAX];
+    thumbs_cache_path(p, path);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return false;
+    ThumbHeader header;
+    size_t size = (size_t)p->thumbs.count * p->thumbs.width * p->thumbs.height * 3;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == THUMB_MAGIC &&
+        header.version == THUMB_VERSION && header.file_size == p->index_cache.file_size &&
+        header.mtime_sec == p->index_cache.mtime.tv_sec &&
+        header.mtime_nsec == p->index_cache.mtime.tv_nsec && header.interval == p->thumbs.interval &&
+        header.count == p->thumbs.count && header.width == p->thumbs.width &&
+        header.height == p->thumbs.height && fread(p->thumbs.pixels, 1, size, f) == size;
+    fclose(f);
+    if (ok) atomic_store(&p->thumbs.filled, p->thumbs.count);
+    return ok;
+}
+
+void thumbs_cache_save(JPlayer *p)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    thumbs_cache_path(p, path);
+    snprintf(tmp, PATH_MAX, "%s.%d.tmp", path, getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) return;
+    ThumbHeader header = {
+        .magic = THUMB_MAGIC,
+        .version = THUMB_VERSION,
+        .file_size = p->index_cache.file_size,
+        .mtime_sec = p->index_cache.mtime.tv_sec,
+        .mtime_nsec = p->index_cache.mtime.tv_nsec,
+        .interval = p->thumbs.interval,
+        .count = p->thumbs.count,
+        .width = p->thumbs.width,
+        .height = p->thumbs.height,
+    };
+    size_t size = (size_t)p->thumbs.count * p->thumbs.width * p->thumbs.height * 3;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(p->thumbs.pixels, 1, size, f) == size;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        WARN("thumbnails: could not write %s", path);
+    }
+}
+
+// Only work while playback has headroom, never while the decoder is skipping
+// frames and not while the video queue is still filling or running dry.
+void thumbs_throttle(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    struct timespec t = {0, THUMB_PAUSE_MS * 1000000L};
+    nanosleep(&t, NULL);
+    while (!ctx->quit && (atomic_load(&ctx->skip_level) > 0 ||
+           (QUEUE_LOW(p->v_queue) && !atomic_load(&ctx->paused) &&
+            atomic_load(&ctx->io_eof_serial) != atomic_load(&ctx->serial)))) {
+        t.tv_nsec = QUEUE_PARK_MS * 1000000L;
+        nanosleep(&t, NULL);
+    }
+}
+
+// first keyframe decoded after seeking to the cell, false at the end
+bool thumbs_decode(AVFormatContext *format_ctx, AVCodecContext *codec_ctx, int v_index,
+                   AVPacket *packet, AVFrame *frame)
+{
+    while (true) {
+        int ret = avcodec_receive_frame(codec_ctx, frame);
+        if (ret == 0) return true;
+        if (ret == AVERROR_EOF) return false;
+        ret = av_read_frame(format_ctx, packet);
+        if (ret < 0) {
+            // drain what the decoder holds
+            avcodec_send_packet(codec_ctx, NULL);
+            continue;
+        }
+        if (packet->stream_index == v_index && (packet->flags & AV_PKT_FLAG_KEY))
+            avcodec_send_packet(codec_ctx, packet);
+        av_packet_unref(packet);
+    }
+}
+
+void *thumb_thread_func(void *arg)
+{
+    VideoContext *ctx = (VideoContext *)arg;
+    JPlayer *p = ctx->player;
+    player_thread(p, "thumbnails");
+    // lowest priority so the thumbnails never compete with playback
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    if (p->index_cache.enabled && thumbs_cache_load(p)) {
+        LOG("thumbnails: %d from cache", p->thumbs.count);
+        return NULL;
+    }
+
+    AVFormatContext *format_ctx = NULL;
+    if (avformat_open_input(&format_ctx, ctx->index_file, NULL, NULL) != 0) {
+        WARN("thumbnails: could not open %s", ctx->index_file);
+        return NULL;
+    }
+    // the streams are the same as the player's, the demuxer only has to
+    // hand over video keyframes where it can tell them apart
+    for (unsigned i = 0; i < format_ctx->nb_streams; i++)
+        format_ctx->streams[i]->discard = (int)i == ctx->v_index ? AVDISCARD_NONKEY : AVDISCARD_ALL;
+
+    AVCodecParameters *par = ctx->format_ctx->streams[ctx->v_index]->codecpar;
+    const AVCodec *codec = avcodec_find_decoder(par->codec_id);
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (codec_ctx == NULL || avcodec_parameters_to_context(codec_ctx, par) < 0) {
+        WARN("thumbnails: could not create codec context");
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&format_ctx);
+        return NULL;
+    }
+    codec_ctx->thread_count = 1;
+    codec_ctx->skip_frame = AVDISCARD_NONKEY;
+    codec_ctx->skip_loop_filter = AVDISCARD_ALL;
+    // decoders that can decode at a fraction of the size do, down to the cell size
+    while (codec_ctx->lowres < codec->max_lowres &&
+           (par->height >> (codec_ctx->lowres + 1)) >= p->thumbs.height)
+        codec_ctx->lowres++;
+    if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
+        WARN("thumbnails: could not open codec");
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&format_ctx);
+        return NULL;
+    }
+
+    AVRational time_base = format_ctx->streams[ctx->v_index]->time_base;
+    struct SwsContext *sws_ctx = NULL;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int cell_size = p->thumbs.width * p->thumbs.height * 3;
+    int i = 0;
+    for (; i < p->thumbs.count && !ctx->quit; i++) {
+        thumbs_throttle(ctx);
+        int64_t ts = (i * p->thumbs.interval + ctx->start_time) / av_q2d(time_base);
+        if (av_seek_frame(format_ctx, ctx->v_index, ts, AVSEEK_FLAG_BACKWARD) < 0) break;
+        avcodec_flush_buffers(codec_ctx);
+        if (!thumbs_decode(format_ctx, codec_ctx, ctx->v_index, packet, frame)) break;
+
+        sws_ctx = sws_getCachedContext(sws_ctx, frame->width, frame->height, frame->format,
+                                       p->thumbs.width, p->thumbs.height, AV_PIX_FMT_RGB24,
+                                       SWS_AREA, NULL, NULL, NULL);
+        if (sws_ctx == NULL) break;
+        uint8_t *dst[1] = {p->thumbs.pixels + (size_t)i * cell_size};
+        int stride[1] = {p->thumbs.width * 3};
+        sws_scale(sws_ctx, (const uint8_t **)frame->data, frame->linesize, 0, frame->height,
+                  dst, stride);
+        av_frame_unref(frame);
+        atomic_store_explicit(&p->thumbs.filled, i + 1, memory_order_release);
+    }
+
+    if (i == p->thumbs.count) {
+        LOG("thumbnails: %d done", p->thumbs.count);
+        if (p->index_cache.enabled) thumbs_cache_save(p);
+    }
+    sws_freeContext(sws_ctx);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&codec_ctx);
+    avformat_close_input(&format_ctx);
+    return NULL;
+}
+
+// lay out the atlas for the item and start filling it
+void thumbs_start(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    // nothing to show them in without the window
+    if (!windowed || ctx->index_file == NULL || ctx->duration <= 0.0) return;
+    p->thumbs.interval = ctx->duration / THUMB_MAX;
+    if (p->thumbs.interval < THUMB_MIN_INTERVAL) p->thumbs.interval = THUMB_MIN_INTERVAL;
+    p->thumbs.count = (int)ceil(ctx->duration / p->thumbs.interval);
+    p->thumbs.height = ctx->v_ctx->height < THUMB_HEIGHT ? ctx->v_ctx->height & ~1 : THUMB_HEIGHT;
+    p->thumbs.width = ((int64_t)ctx->v_ctx->width * p->thumbs.height / ctx->v_ctx->height + 1) & ~1;
+    if (p->thumbs.width < 2 || p->thumbs.height < 2) return;
+    p->thumbs.pixels = av_mallocz((size_t)p->thumbs.count * p->thumbs.width * p->thumbs.height * 3);
+    if (p->thumbs.pixels == NULL) return;
+    atomic_store(&p->thumbs.filled, 0);
+    p->thumbs.generation++;
+    p->thumbs.running = true;
+    pthread_create(&p->thumbs.thread, NULL, thumb_thread_func, ctx);
+}
+
+void thumbs_stop(JPlayer *p)
+{
+    if (!p->thumbs.running) return;
+    pthread_join(p->thumbs.thread, NULL);
+    p->thumbs.running = false;
+    av_freep(&p->thumbs.pixels);
+    atomic_store(&p->thumbs.filled, 0);
+}
+
+// remember that [start, end) is in the spill file, merging with neighbours
+void net_add_range(NetCache *c, int64_t start, int64_t end)
+{
+    int i = 0;
+    while (i < c->range_count && c->ranges[i].end < start) i++;
+    int j = i;
+    while (j < c->range_count && c->ranges[j].start <= end) {
+        if (c->ranges[j].start < start) start = c->ranges[j].start;
+        if (c->ranges[j].end > end) end = c->ranges[j].end;
+        c->disk_bytes -= c->ranges[j].end - c->ranges[j].start;
+        j++;
+    }
+    // i..j-1 collapse into one range
+    if (i == j) {
+        if (c->range_count == c->range_cap) {
+            // left unrecorded the range is fetched again if it is needed
+            ByteRange *ranges = av_realloc_array(c->ranges, c->range_cap ? c->range_cap * 2 : 16,
+                                                 sizeof(ByteRange));
+            if (ranges == NULL) return;
+            c->ranges = ranges;
+            c->range_cap = c->range_cap ? c->range_cap * 2 : 16;
+        }
+        memmove(&c->ranges[i + 1], &c->ranges[i], (c->range_count - i) * sizeof(ByteRange));
+        c->range_count++;
+    } else {
+        memmove(&c->ranges[i + 1], &c->ranges[j], (c->range_count - j) * sizeof(ByteRange));
+        c->range_count -= j - i - 1;
+    }
+    c->ranges[i] = (ByteRange){start, end};
+    c->disk_bytes += end - start;
+}
+
+// spilled range containing pos or NULL
+ByteRange *net_find_range(NetCache *c, int64_t pos)
+{
+    for (int i = 0; i < c->range_count && c->ranges[i].start <= pos; i++) {
+        if (pos < c->ranges[i].end) return &c->ranges[i];
+    }
+    return NULL;
+}
+
+// stop spilling and forget what was spilled, the fetch thread refetches it
+void net_drop_spill(NetCache *c, const char *what)
+{
+    WARN("network cache %s failed, %s", what, strerror(errno));
+    close(c->disk_fd);
+    c->disk_fd = -1;
+    c->range_count = 0;
+    c->disk_bytes = 0;
+    pthread_cond_broadcast(&c->cond);
+}
+
+// write part of the ring to the spill file, called with the lock held
+void net_spill(NetCache *c, int64_t start, int64_t end)
+{
+    if (c->disk_fd < 0 || start >= end || c->disk_bytes + (end - start) > net_disk_limit)
+        return;
+    for (int64_t pos = start; pos < end;) {
+        int64_t i = pos % c->cap;
+        int64_t n = end - pos < c->cap - i ? end - pos : c->cap - i;
+        if (pwrite(c->disk_fd, c->data + i, n, pos) != n) {
+            net_drop_spill(c, "spill");
+            return;
+        }
+        pos += n;
+    }
+    net_add_range(c, start, end);
+}
+
+// first byte the reader will need that isn't cached yet
+int64_t net_wanted(NetCache *c)
+{
+    int64_t want = c->read_pos;
+    for (bool moved = true; moved;) {
+        moved = false;
+        if (want >= c->mem_start && want < c->mem_end) {
+            want = c->mem_end;
+            moved = true;
+        }
+        ByteRange *r = net_find_range(c, want);
+        if (r != NULL) {
+            want = r->end;
+            moved = true;
+        }
+    }
+    return want;
+}
+
+// wait for the other side with the lock held, timed so quit is never missed
+void net_wait(NetCache *c)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_nsec += QUEUE_PARK_MS * 1000000L;
+    if (t.tv_nsec >= 1000000000L) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&c->cond, &c->mutex, &t);
+}
+
+int net_interrupt(void *opaque)
+{
+    NetCache *c = opaque;
+    return c->quit || (c->cancel != NULL && atomic_load(c->cancel));
+}
+
+// Keeps readahead bytes cached past the reader. When the reader jumps past
+// what is cached the ring is spilled and the upstream reopened at the new
+// position with a range request.
+void *net_fetch_thread_func(void *arg)
+{
+    NetCache *c = arg;
+    quiet = c->quiet;
+    trace_thread("net fetch");
+    uint8_t *chunk = av_malloc(NET_CHUNK);
+    if (chunk == NULL) {
+        // the reader gets it like a network error and gives up on the input
+        pthread_mutex_lock(&c->mutex);
+        c->error = AVERROR(ENOMEM);
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    while (!c->quit) {
+        int64_t want = net_wanted(c);
+        bool done = c->size >= 0 && want >= c->size;
+        if (want - c->read_pos >= c->readahead || done || (c->eof && want == c->mem_end) || c->error) {
+            net_wait(c);
+            continue;
+        }
+
+        if (want != c->mem_end) {
+            // the reader moved away from the ring, keep what we have on disk
+            net_spill(c, c->mem_start, c->mem_end);
+            c->mem_start = c->mem_end = want;
+            c->eof = false;
+            c->refetches++;
+            pthread_mutex_unlock(&c->mutex);
+            int64_t ret = avio_seek(c->upstream, want, SEEK_SET);
+            pthread_mutex_lock(&c->mutex);
+            if (ret < 0) {
+                WARN("network seek to %ld, %s", (long)want, av_err2str((int)ret));
+                c->error = (int)ret;
+                pthread_cond_broadcast(&c->cond);
+            }
+            continue;
+        }
+
+        // read without the lock, only this thread moves the ring
+        pthread_mutex_unlock(&c->mutex);
+        int n = avio_read_partial(c->upstream, chunk, NET_CHUNK);
+        pthread_mutex_lock(&c->mutex);
+        if (n == AVERROR_EOF || n == 0) {
+            c->eof = true;
+            if (c->size < 0) c->size = c->mem_end;
+        } else if (n < 0) {
+            if (!c->quit) WARN("network read, %s", av_err2str(n));
+            c->error = n;
+        } else {
+            // make room by dropping the oldest bytes, the reader is always past them
+            int64_t overflow = c->mem_end + n - c->mem_start - c->cap;
+            if (overflow > 0) {
+                net_spill(c, c->mem_start, c->mem_start + overflow);
+                c->mem_start += overflow;
+            }
+            for (int done = 0; done < n;) {
+                int64_t i = (c->mem_end + done) % c->cap;
+                int64_t count = n - done < c->cap - i ? n - done : c->cap - i;
+                memcpy(c->data + i, chunk + done, count);
+                done += count;
+            }
+            c->mem_end += n;
+            c->fetched += n;
+        }
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    av_free(chunk);
+    return NULL;
+}
+
+// AVIOContext read callback, blocks until the fetch thread has the data
+int net_read(void *opaque, uint8_t *buf, int size)
+{
+    NetCache *c = opaque;
+    int n = 0;
+    bool stalled = false;
+
+    pthread_mutex_lock(&c->mutex);
+    while (true) {
+        int64_t pos = c->read_pos;
+        ByteRange *r;
+        if (net_interrupt(c)) {
+            n = AVERROR_EXIT;
+        } else if (pos >= c->mem_start && pos < c->mem_end) {
+            int64_t i = pos % c->cap;
+            n = size;
+            if (n > c->mem_end - pos) n = c->mem_end - pos;
+            if (n > c->cap - i) n = c->cap - i;
+            memcpy(buf, c->data + i, n);
+        } else if ((r = net_find_range(c, pos)) != NULL) {
+            n = size < r->end - pos ? size : r->end - pos;
+            if (pread(c->disk_fd, buf, n, pos) != n) {
+                net_drop_spill(c, "spill read");
+                continue;
+            }
+        } else if (c->size >= 0 && pos >= c->size) {
+            n = AVERROR_EOF;
+        } else if (c->error) {
+            n = c->error;
+        } else {
+            // cache miss, wake the fetch thread and wait for it
+            if (!stalled) c->stalls++;
+            stalled = true;
+            pthread_cond_broadcast(&c->cond);
+            net_wait(c);
+            continue;
+        }
+        break;
+    }
+    if (n > 0) {
+        c->read_pos += n;
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return n;
+}
+
+// AVIOContext seek callback, only moves the read position, the fetch thread
+// notices when it left the cached data
+int64_t net_seek(void *opaque, int64_t offset, int whence)
+{
+    NetCache *c = opaque;
+    pthread_mutex_lock(&c->mutex);
+    int64_t pos = -1;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: pos = c->size >= 0 ? c->size : AVERROR(ENOSYS); break;
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = c->read_pos + offset; break;
+    case SEEK_END: pos = c->size >= 0 ? c->size + offset : AVERROR(ENOSYS); break;
+    }
+    if ((whence & ~AVSEEK_FORCE) != AVSEEK_SIZE && pos >= 0) {
+        c->read_pos = pos;
+        // a new position gets a new try, unless the fetch thread is gone
+        if (c->error != AVERROR(ENOMEM)) c->error = 0;
+        pthread_cond_broadcast(&c->cond);
+    } else if (pos < 0 && (whence & ~AVSEEK_FORCE) != AVSEEK_SIZE) {
+        pos = AVERROR(EINVAL);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return pos;
+}
+
+// open url through a read-ahead cache, NULL if the url can't be opened
+NetCache *net_cache_open(const char *url)
+{
+    NetCache *c = av_mallocz(sizeof(NetCache));
+    if (c == NULL) ERROR("out of memory");
+    c->cancel = open_cancel;
+    c->quiet = quiet;
+    AVIOInterruptCB interrupt = {net_interrupt, c};
+    AVDictionary *opts = NULL;
+    // ride out dropped connections instead of ending the stream
+    av_dict_set(&opts, "reconnect", "1", 0);
+    av_dict_set(&opts, "reconnect_streamed", "1", 0);
+    av_dict_set(&opts, "reconnect_delay_max", "10", 0);
+    int ret = avio_open2(&c->upstream, url, AVIO_FLAG_READ, &interrupt, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        WARN("opening %s, %s", url, av_err2str(ret));
+        av_free(c);
+        return NULL;
+    }
+
+    c->cap = net_cache_size;
+    // keep a quarter of the ring behind the reader for short seeks back
+    c->readahead = c->cap - c->cap / 4;
+    c->data = av_malloc(c->cap);
+    if (c->data == NULL) ERROR("out of memory");
+    c->size = avio_size(c->upstream);
+    if (c->size <= 0) c->size = -1;
+    c->disk_fd = -1;
+    char path[PATH_MAX];
+    if (net_disk_limit > 0 && cache_dir(path) && make_dirs(path)) {
+        strncat(path, "/net-XXXXXX", PATH_MAX - strlen(path) - 1);
+        c->disk_fd = mkstemp(path);
+        // only the descriptor keeps it alive
+        if (c->disk_fd >= 0) unlink(path);
+    }
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->cond, NULL);
+
+    uint8_t *buffer = av_malloc(NET_AVIO_BUFFER);
+    c->avio = avio_alloc_context(buffer, NET_AVIO_BUFFER, 0, c, net_read, NULL, net_seek);
+    if (buffer == NULL || c->avio == NULL) ERROR("out of memory");
+    c->avio->seekable = c->upstream->seekable;
+    pthread_create(&c->thread, NULL, net_fetch_thread_func, c);
+    return c;
+}
+
+// wake up anyone blocked on the network so the threads can be joined
+void net_cache_abort(NetCache *c)
+{
+    if (c == NULL) return;
+    pthread_mutex_lock(&c->mutex);
+    c->quit = true;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void net_cache_close(NetCache **cache)
+{
+    NetCache *c = *cache;
+    if (c == NULL) return;
+    net_cache_abort(c);
+    pthread_join(c->thread, NULL);
+    LOG("network cache: fetched %.1fMB, %ld stalls, %ld refetches, %.1fMB on disk",
+        (double)c->fetched / MB, (long)c->stalls, (long)c->refetches, (double)c->disk_bytes / MB);
+    avio_closep(&c->upstream);
+    av_freep(&c->avio->buffer);
+    avio_context_free(&c->avio);
+    if (c->disk_fd >= 0) close(c->disk_fd);
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->cond);
+    av_free(c->ranges);
+    av_free(c->data);
+    av_freep(cache);
+}
+
+// how far the contiguous cached data reaches past the reader, as a fraction
+// of the input, -1 while the size is unknown
+double net_cache_fill(NetCache *c)
+{
+    pthread_mutex_lock(&c->mutex);
+    double fill = c->size > 0 ? (double)net_wanted(c) / c->size : -1.0;
+    pthread_mutex_unlock(&c->mutex);
+    return fill > 1.0 ? 1.0 : fill;
+}
+
+MapSlot map_slots[MAP_SLOTS];
+pthread_mutex_t map_slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t map_sigbus_once = PTHREAD_ONCE_INIT;
+struct sigaction map_prev_sigbus; // whoever handled SIGBUS before, for faults that aren't ours
+uintptr_t map_page_size;
+
+// Runs on the thread that touched a page past the end of a truncated file.
+// The pages from there to the end of the mapping are replaced with zeros and
+// the access retried, the reader sees the flag and rereads with pread().
+// Anything else goes back to the previous handler, which the retried access
+// then raises to.
+void map_sigbus(int sig, siginfo_t *info, void *context)
+{
+    (void)sig;
+    (void)context;
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    for (int i = 0; i < MAP_SLOTS; i++) {
+        MapSlot *slot = &map_slots[i];
+        unsigned seq;
+        uintptr_t start, end;
+        do {
+            seq = atomic_load(&slot->seq);
+            start = atomic_load(&slot->start);
+            end = atomic_load(&slot->end);
+        } while ((seq & 1) || seq != atomic_load(&slot->seq));
+        if (addr < start || addr >= end) continue;
+        uintptr_t from = addr & ~(map_page_size - 1);
+        if (mmap((void *)from, end - from, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+            == MAP_FAILED)
+            break;
+        atomic_store(&slot->truncated, true);
+        return;
+    }
+    sigaction(SIGBUS, &map_prev_sigbus, NULL);
+}
+
+void map_sigbus_install(void)
+{
+    map_page_size = sysconf(_SC_PAGESIZE);
+    struct sigaction sa = {.sa_sigaction = map_sigbus, .sa_flags = SA_SIGINFO};
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, &map_prev_sigbus) != 0)
+        WARN("could not catch SIGBUS, a truncated input will crash");
+}
+
+void map_slot_set(int i, uintptr_t start, uintptr_t end)
+{
+    MapSlot *slot = &map_slots[i];
+    unsigned seq = atomic_load(&slot->seq);
+    atomic_store(&slot->seq, seq + 1);
+    atomic_store(&slot->start, start);
+    atomic_store(&slot->end, end);
+    atomic_store(&slot->truncated, false);
+    atomic_store(&slot->seq, seq + 2);
+}
+
+// a free slot for the mapping, -1 if there is none
+int map_register(uint8_t *data, int64_t size)
+{
+    pthread_once(&map_sigbus_once, map_sigbus_install);
+    pthread_mutex_lock(&map_slots_mutex);
+    int i = 0;
+    while (i < MAP_SLOTS && atomic_load(&map_slots[i].end) != 0) i++;
+    if (i < MAP_SLOTS) map_slot_set(i, (uintptr_t)data, (uintptr_t)data + size);
+    pthread_mutex_unlock(&map_slots_mutex);
+    return i < MAP_SLOTS ? i : -1;
+}
+
+// true if part of the file was cut off under the mapping
+bool map_truncated(MappedFile *m)
+{
+    return atomic_load(&map_slots[m->slot].truncated);
+}
+
+// fault in the window ahead of the reader before it gets there
+void map_advise(MappedFile *m, int size)
+{
+    if (m->pos + size + MAP_READAHEAD / 2 <= m->advised) return;
+    long page = sysconf(_SC_PAGESIZE);
+    int64_t start = (m->advised > m->pos ? m->advised : m->pos) & ~(int64_t)(page - 1);
+    int64_t end = m->pos + size + MAP_READAHEAD;
+    if (end > m->size) end = m->size;
+    if (end <= start) return;
+    madvise(m->data + start, end - start, MADV_WILLNEED);
+    m->advised = end;
+    m->advises++;
+}
+
+// from now on the file is read with pread()
+void map_unmap(MappedFile *m, const char *why)
+{
+    WARN("input %s, reading it without the mapping", why);
+    m->unmapped = true;
+}
+
+// AVIOContext read callback
+int map_read(void *opaque, uint8_t *buf, int size)
+{
+    MappedFile *m = opaque;
+    if (!m->unmapped && m->pos + size > m->size) {
+        // only a read reaching the end of the mapping can tell the file grew or shrank
+        struct stat st;
+        if (fstat(m->fd, &st) == 0 && st.st_size != m->size) map_unmap(m, "changed size");
+    }
+    if (!m->unmapped && map_truncated(m)) map_unmap(m, "was truncated");
+    if (m->unmapped) {
+        ssize_t n = pread(m->fd, buf, size, m->pos);
+        if (n < 0) return AVERROR(errno);
+        if (n == 0) return AVERROR_EOF;
+        m->pos += n;
+        m->reads++;
+        return n;
+    }
+    if (m->pos >= m->size) return AVERROR_EOF;
+    if (size > m->size - m->pos) size = m->size - m->pos;
+    map_advise(m, size);
+    // payload the reader may take from the mapping as it is, reads into the
+    // avio buffer are headers the demuxer parses right away
+    bool own_buffer = buf >= m->avio->buffer && buf < m->avio->buffer + m->avio->buffer_size;
+    if (m->defer && !own_buffer && size > MAP_AVIO_BUFFER && m->deferred_count < MAP_DEFERRED) {
+        m->deferred[m->deferred_count++] = (MapRead){buf, m->pos, size};
+    } else {
+        memcpy(buf, m->data + m->pos, size);
+        // zeros from the SIGBUS handler, read it again from the file
+        if (map_truncated(m)) {
+            map_unmap(m, "was truncated");
+            return map_read(opaque, buf, size);
+        }
+    }
+    m->pos += size;
+    m->reads++;
+    return size;
+}
+
+// AVIOContext seek callback, a seek is only a new position
+int64_t map_seek(void *opaque, int64_t offset, int whence)
+{
+    MappedFile *m = opaque;
+    int64_t pos = -1;
+    struct stat st;
+    // asked for rarely, so the size is checked every time
+    int64_t size = fstat(m->fd, &st) == 0 ? st.st_size : m->size;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: return size;
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = m->pos + offset; break;
+    case SEEK_END: pos = size + offset; break;
+    }
+    if (pos < 0) return AVERROR(EINVAL);
+    // the window starts over wherever the reader went
+    if (pos < m->pos || pos > m->advised) m->advised = pos;
+    m->pos = pos;
+    return pos;
+}
+
+// map a regular local file, NULL for anything else
+MappedFile *map_file_open(const char *path)
+{
+    if (strncmp(path, "file:", 5) == 0) path += 5;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    // the fd stays open to notice size changes and read past them
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        WARN("mapping %s, %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    // without the handler a truncation would crash, such files go through the file protocol
+    int slot = map_register(data, st.st_size);
+    if (slot < 0) {
+        WARN("too many mapped inputs, reading %s without a mapping", path);
+        munmap(data, st.st_size);
+        close(fd);
+        return NULL;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    MappedFile *m = av_mallocz(sizeof(MappedFile));
+    uint8_t *buffer = av_malloc(MAP_AVIO_BUFFER);
+    if (m == NULL || buffer == NULL) ERROR("out of memory");
+    m->fd = fd;
+    m->data = data;
+    m->size = st.st_size;
+    m->slot = slot;
+    atomic_init(&m->refs, 1);
+    m->avio = avio_alloc_context(buffer, MAP_AVIO_BUFFER, 0, m, map_read, NULL, map_seek);
+    if (m->avio == NULL) ERROR("out of memory");
+    // reads bypass the buffer and seeks are free
+    m->avio->direct = 1;
+    m->avio->seekable = AVIO_SEEKABLE_NORMAL;
+    return m;
+}
+
+// the last reference unmaps, after the input and every packet pointing into it are gone
+void map_file_unref(MappedFile *m)
+{
+    if (atomic_fetch_sub(&m->refs, 1) != 1) return;
+    pthread_mutex_lock(&map_slots_mutex);
+    map_slot_set(m->slot, 0, 0);
+    pthread_mutex_unlock(&map_slots_mutex);
+    munmap(m->data, m->size);
+    close(m->fd);
+    av_free(m);
+}
+
+void map_file_close(MappedFile **mapped)
+{
+    MappedFile *m = *mapped;
+    if (m == NULL) return;
+    av_freep(&m->avio->buffer);
+    avio_context_free(&m->avio);
+    *mapped = NULL;
+    map_file_unref(m);
+}
+
+void map_buffer_free(void *opaque, uint8_t *data)
+{
+    (void)data;
+    map_file_unref(opaque);
+}
+
+// Zero-copy packets
+// Intra-only and uncompressed codecs in mp4/mov take a packet's payload as it
+// is stored in the file, so the packet can point into the mapping instead of
+// holding a copy. The demuxer still asks for the copy, but while the reader
+// demuxes with defer set map_read only notes where each large read would have
+// gone. The packet then references the mapping if it is exactly the bytes at
+// its pos, else the noted copies are done after all. The decoders of these
+// codecs don't depend on the padding past a packet being zero, which the
+// mapping has file data in.
+bool map_zero_copy_input(AVFormatContext *input)
+{
+    if (strstr(input->iformat->name, "mov") == NULL) return false;
+    bool any = false;
+    for (unsigned i = 0; i < input->nb_streams; i++) {
+        AVStream *stream = input->streams[i];
+        if (stream->discard == AVDISCARD_ALL) continue;
+        enum AVCodecID id = stream->codecpar->codec_id;
+        const AVCodecDescriptor *desc = avcodec_descriptor_get(id);
+        bool raw = id == AV_CODEC_ID_PRORES || id == AV_CODEC_ID_DNXHD || id == AV_CODEC_ID_V210 ||
+            id == AV_CODEC_ID_RAWVIDEO || (desc != NULL && strncmp(desc->name, "pcm_", 4) == 0);
+        if (!raw) return false;
+        any = true;
+    }
+    return any;
+}
+
+// true if the packet now points into the mapping
+bool map_zero_copy(MappedFile *m, AVPacket *packet, bool read)
+{
+    int count = m->deferred_count;
+    m->defer = false;
+    m->deferred_count = 0;
+    if (!read) count = 0;
+    MapRead *d = m->deferred;
+    bool whole = count == 1 && packet->buf != NULL && d->dest == packet->data &&
+        d->size == packet->size && d->pos == packet->pos &&
+        d->pos + d->size + AV_INPUT_BUFFER_PADDING_SIZE <= m->size;
+    if (whole) {
+        AVBufferRef *buf = av_buffer_create(m->data + d->pos, d->size, map_buffer_free, m,
+                                            AV_BUFFER_FLAG_READONLY);
+        if (buf != NULL) {
+            atomic_fetch_add(&m->refs, 1);
+            av_buffer_unref(&packet->buf);
+            packet->buf = buf;
+            packet->data = buf->data;
+            atomic_fetch_add(&m->zero_copies, 1);
+            return true;
+        }
+    }
+    for (int i = 0; i < count; i++) memcpy(d[i].dest, m->data + d[i].pos, d[i].size);
+    return false;
+}
+
+// open a network input through its cache, the demuxer only sees the cache
+bool open_net_input(JPlayer *p, AVFormatContext **format_ctx, NetCache **cache, const char *url)
+{
+    *cache = net_cache_open(url);
+    if (*cache == NULL) return false;
+    *format_ctx = avformat_alloc_context();
+    (*format_ctx)->pb = (*cache)->avio;
+    (*format_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    AVDictionary *opts = probe_options();
+    bool ok = avformat_open_input(format_ctx, url, NULL, &opts) == 0;
+    av_dict_free(&opts);
+    if (ok) startup_mark(p, PHASE_OPEN);
+    return ok;
+}
+
+// a local file, read from a mapping unless -no-mmap or it can't be mapped
+bool open_local_input(JPlayer *p, AVFormatContext **format_ctx, MappedFile **mapped, const char *file)
+{
+    // anything that can't be mapped goes through the file protocol
+    if (use_mmap) *mapped = map_file_open(file);
+    *format_ctx = avformat_alloc_context();
+    if (*mapped != NULL) {
+        (*format_ctx)->pb = (*mapped)->avio;
+        (*format_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    AVDictionary *opts = probe_options();
+    bool ok = avformat_open_input(format_ctx, file, NULL, &opts) == 0;
+    av_dict_free(&opts);
+    if (ok) startup_mark(p, PHASE_OPEN);
+    return ok;
+}
+
+// urls other than file: go through the network cache
+bool is_net_url(const char *input)
+{
+    return strstr(input, "://") != NULL && strncmp(input, "file:", 5) != 0;
+}
+
+// only called from av_buffer_pool_get, under the pool's mutex
+AVBufferRef *frame_pool_alloc(void *opaque, size_t size)
+{
+    FramePool *pool = opaque;
+    pool->allocs++;
+    atomic_fetch_add(&pool->stats->frame_buffers, 1);
+    return av_buffer_alloc(size);
+}
+
+FramePool *frame_pool_create(AllocStats *stats)
+{
+    FramePool *pool = av_mallocz(sizeof(FramePool));
+    if (pool == NULL) ERROR("out of memory");
+    pool->stats = stats;
+    pthread_mutex_init(&pool->mutex, NULL);
+    return pool;
+}
+
+void frame_pool_reset(FramePool *pool)
+{
+    for (int i = 0; i < 4; i++) av_buffer_pool_uninit(&pool->pools[i]);
+    pool->planes = 0;
+}
+
+void frame_pool_free(FramePool **pool)
+{
+    if (*pool == NULL) return;
+    frame_pool_reset(*pool);
+    pthread_mutex_destroy(&(*pool)->mutex);
+    av_freep(pool);
+}
+
+// Plane layout the way the default allocator lays it out, aligned and padded
+// so the decoder can write past the edges
+bool frame_pool_video_init(FramePool *pool, AVCodecContext *codec_ctx, AVFrame *frame)
+{
+    int width = frame->width, height = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(codec_ctx, &width, &height, linesize_align);
+    int linesize[4];
+    bool unaligned;
+    do {
+        if (av_image_fill_linesizes(linesize, frame->format, width) < 0) return false;
+        // widen until every plane's rows are aligned
+        width += width & ~(width - 1);
+        unaligned = false;
+        for (int i = 0; i < 4; i++) unaligned |= linesize[i] % linesize_align[i] != 0;
+    } while (unaligned);
+
+    ptrdiff_t strides[4] = {linesize[0], linesize[1], linesize[2], linesize[3]};
+    size_t sizes[4];
+    if (av_image_fill_plane_sizes(sizes, frame->format, height, strides) < 0) return false;
+    frame_pool_reset(pool);
+    for (int i = 0; i < 4 && sizes[i] > 0; i++) {
+        pool->pools[i] = av_buffer_pool_init2(sizes[i] + 16 + 64 - 1, pool, frame_pool_alloc, NULL);
+        if (pool->pools[i] == NULL) return false;
+        pool->planes = i + 1;
+    }
+    memcpy(pool->linesize, linesize, sizeof(linesize));
+    pool->width = frame->width;
+    pool->height = frame->height;
+    pool->format = frame->format;
+    return true;
+}
+
+bool frame_pool_video(FramePool *pool, AVCodecContext *codec_ctx, AVFrame *frame)
+{
+    if ((pool->width != frame->width || pool->height != frame->height ||
+         pool->format != frame->format || pool->planes == 0) &&
+        !frame_pool_video_init(pool, codec_ctx, frame))
+        return false;
+    for (int i = 0; i < pool->planes; i++) {
+        frame->buf[i] = av_buffer_pool_get(pool->pools[i]);
+        if (frame->buf[i] == NULL) return false;
+        frame->data[i] = frame->buf[i]->data;
+        frame->linesize[i] = pool->linesize[i];
+    }
+    frame->extended_data = frame->data;
+    return true;
+}
+
+bool frame_pool_audio(FramePool *pool, AVFrame *frame)
+{
+    int channels = frame->ch_layout.nb_channels;
+    int planes = av_sample_fmt_is_planar(frame->format) ? channels : 1;
+    if (planes > AV_NUM_DATA_POINTERS) return false;
+    int linesize;
+    if (av_samples_get_buffer_size(&linesize, channels, frame->nb_samples, frame->format, 0) < 0)
+        return false;
+    if (linesize > pool->plane_size || pool->format != frame->format) {
+        frame_pool_reset(pool);
+        pool->pools[0] = av_buffer_pool_init2(linesize, pool, frame_pool_alloc, NULL);
+        if (pool->pools[0] == NULL) return false;
+        pool->plane_size = linesize;
+        pool->format = frame->format;
+        pool->planes = 1;
+    }
+    for (int i = 0; i < planes; i++) {
+        frame->buf[i] = av_buffer_pool_get(pool->pools[0]);
+        if (frame->buf[i] == NULL) return false;
+        frame->data[i] = frame->buf[i]->data;
+    }
+    frame->extended_data = frame->data;
+    frame->linesize[0] = linesize;
+    return true;
+}
+
+// get_buffer2 of the decoders, whatever the pool can't lay out goes to the default
+int frame_pool_get_buffer(AVCodecContext *codec_ctx, AVFrame *frame, int flags)
+{
+    FramePool *pool = codec_ctx->opaque;
+    if (frame->hw_frames_ctx != NULL || !(codec_ctx->codec->capabilities & AV_CODEC_CAP_DR1))
+        return avcodec_default_get_buffer2(codec_ctx, frame, flags);
+
+    pthread_mutex_lock(&pool->mutex);
+    int64_t allocs = pool->allocs;
+    bool ok = codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO ?
+        frame_pool_video(pool, codec_ctx, frame) : frame_pool_audio(pool, frame);
+    bool reused = pool->allocs == allocs;
+    pthread_mutex_unlock(&pool->mutex);
+    if (!ok) {
+        for (int i = 0; i < AV_NUM_DATA_POINTERS; i++) av_buffer_unref(&frame->buf[i]);
+        return avcodec_default_get_buffer2(codec_ctx, frame, flags);
+    }
+    if (reused) atomic_fetch_add(&pool->stats->frame_reuses, 1);
+    return 0;
+}
+
+// initialize format context from youtube url
+#define DEFAULT_ARGS "-f 'b*[height<=1080]+ba'"
+// words of resolver_args passed on, more is an error
+#define RESOLVER_MAX_ARGS 64
+// resolved urls are reused until shortly before they expire
+#define YT_CACHE_TTL (60*60)
+#define YT_CACHE_MARGIN (5*60)
+
+// Resolved stream urls
+// yt-dlp takes seconds so its output is kept in the cache directory, keyed by
+// the video id and the arguments. The first line is the unix time the urls
+// expire at, followed by one or two urls.
+typedef struct {
+    char urls[2][BUF_MAX_LEN];
+    int count;
+    int64_t expires;
+} ResolvedUrls;
+
+// the v= parameter or the last path component of youtu.be and shorts links
+void yt_video_id(const char *url, char *id, size_t size)
+{
+    const char *start = strstr(url, "v=");
+    if (start != NULL && (start == url || start[-1] == '?' || start[-1] == '&')) {
+        start += 2;
+    } else {
+        start = strrchr(url, '/');
+        start = start != NULL ? start + 1 : url;
+    }
+    size_t len = strspn(start, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-");
+    if (len == 0 || len >= size) {
+        // not a url we understand, the whole thing is the key
+        snprintf(id, size, "%016llx", (unsigned long long)hash_string(url));
+        return;
+    }
+    memcpy(id, start, len);
+    id[len] = '\0';
+}
+
+bool yt_cache_path(char *path, const char *video_file, const char *args)
+{
+    char dir[PATH_MAX], id[64];
+    if (!cache_dir(dir) || !make_dirs(dir)) return false;
+    yt_video_id(video_file, id, sizeof(id));
+    snprintf(path, PATH_MAX, "%s/yt-%s-%016llx.urls", dir, id,
+             (unsigned long long)hash_string(args));
+    return true;
+}
+
+bool yt_cache_load(const char *path, ResolvedUrls *resolved)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return false;
+    long long expires = 0;
+    bool ok = fscanf(f, "%lld\n", &expires) == 1;
+    resolved->count = 0;
+    while (ok && resolved->count < 2 &&
+           fgets(resolved->urls[resolved->count], BUF_MAX_LEN, f) != NULL) {
+        char *url = resolved->urls[resolved->count];
+        url[strcspn(url, "\n")] = '\0';
+        if (url[0] != '\0') resolved->count++;
+    }
+    fclose(f);
+    resolved->expires = expires;
+    return ok && resolved->count > 0 && expires > time(NULL) + YT_CACHE_MARGIN;
+}
+
+void yt_cache_save(const char *path, ResolvedUrls *resolved)
+{
+    // named after the process so two of them resolving the same video don't share it
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) return;
+    fprintf(f, "%lld\n", (long long)resolved->expires);
+    for (int i = 0; i < resolved->count; i++) fprintf(f, "%s\n", resolved->urls[i]);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) unlink(tmp);
+}
+
+// Split the resolver arguments into words like a shell would, without one
+// ever seeing them: blanks separate words, single quotes keep everything
+// literal, and double quotes and backslashes escape the next character. The
+// words point into buf, which is as large as args. False if a quote is left
+// open or there are more than max words.
+bool split_words(const char *args, char *buf, char **words, int max, int *count)
+{
+    *count = 0;
+    const char *p = args;
+    while (true) {
+        while (*p == ' ' || *p == '\t' || *p == '\n') p++;
+        if (*p == '\0') return true;
+        if (*count == max) return false;
+        words[(*count)++] = buf;
+        char quote = '\0';
+        for (; *p != '\0' && (quote || (*p != ' ' && *p != '\t' && *p != '\n')); p++) {
+            if (quote == '\'' && *p == '\'') {
+                quote = '\0';
+            } else if (quote == '\'') {
+                *buf++ = *p;
+            } else if (*p == '\\' && p[1] != '\0' && (!quote || strchr("\"\\$`", p[1]))) {
+                *buf++ = *++p;
+            } else if (*p == '"') {
+                quote = quote ? '\0' : '"';
+            } else if (*p == '\'' && !quote) {
+                quote = '\'';
+            } else {
+                *buf++ = *p;
+            }
+        }
+        *buf++ = '\0';
+        if (quote) return false;
+    }
+}
+
+// Run the resolver, yt-dlp unless -resolver says otherwise. It's called as
+// <resolver> <args> --get-url <url> and prints one url per line. It's spawned
+// with an argument vector, the url and the arguments never go through a shell.
+bool yt_resolve(const char *video_file, const char *args, ResolvedUrls *resolved)
+{
+    extern char **environ;
+    char buf[BUF_MAX_LEN];
+    char *argv[RESOLVER_MAX_ARGS + 4];
+    int words;
+    if (strlen(args) >= sizeof(buf) || !split_words(args, buf, argv + 1, RESOLVER_MAX_ARGS, &words))
+        ERROR("could not parse the %s arguments: %s", resolver, args);
+    argv[0] = (char *)resolver;
+    argv[words + 1] = "--get-url";
+    argv[words + 2] = (char *)video_file;
+    argv[words + 3] = NULL;
+
+    // its stdout is a pipe, close on exec so other children don't hold it open
+    int fds[2];
+    if (pipe(fds) != 0) ERROR("pipe: %s", strerror(errno));
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    pid_t pid;
+    int err = posix_spawnp(&pid, resolver, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (err != 0) {
+        close(fds[0]);
+        WARN("could not run %s: %s", resolver, strerror(err));
+        return false;
+    }
+    FILE *yt_stdout = fdopen(fds[0], "r");
+    if (yt_stdout == NULL) close(fds[0]);
+
+    // Read the urls from yt-dlp stdout
+    resolved->count = 0;
+    while (yt_stdout != NULL && resolved->count < 2 &&
+           fgets(resolved->urls[resolved->count], BUF_MAX_LEN, yt_stdout) != NULL) {
+        char *url = resolved->urls[resolved->count];
+        url[strcspn(url, "\n")] = '\0';
+        if (url[0] != '\0') resolved->count++;
+    }
+    // the rest is drained, a resolver writing to a closed pipe would fail
+    char rest[256];
+    while (yt_stdout != NULL && fgets(rest, sizeof(rest), yt_stdout) != NULL) {}
+    if (yt_stdout != NULL) fclose(yt_stdout);
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return false;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || resolved->count == 0) return false;
+
+    // googlevideo urls say when they stop working, the earliest one counts
+    resolved->expires = time(NULL) + YT_CACHE_TTL;
+    for (int i = 0; i < resolved->count; i++) {
+        char *expire = strstr(resolved->urls[i], "expire=");
+        if (expire == NULL) expire = strstr(resolved->urls[i], "/expire/");
+        if (expire == NULL) continue;
+        long long t = strtoll(strpbrk(expire, "=/") + 1, NULL, 10);
+        if (t > 0 && t < resolved->expires) resolved->expires = t;
+    }
+    return true;
+}
+
+typedef struct {
+    JPlayer *player;
+    atomic_bool *cancel; // of the thread opening the player
+    AVFormatContext **format_ctx;
+    struct NetCache **cache;
+    const char *url;
+    bool ok;
+} ProbeJob;
+
+void *probe_thread_func(void *arg)
+{
+    ProbeJob *job = arg;
+    player_thread(job->player, "probe");
+    open_cancel = job->cancel;
+    // an error only fails this input, the opening thread reports it
+    jmp_buf env, *outer = error_jmp;
+    if (setjmp(env)) {
+        error_jmp = outer;
+        WARN("%s", error_message);
+        job->ok = false;
+        return NULL;
+    }
+    error_jmp = &env;
+    job->ok = open_net_input(job->player, job->format_ctx, job->cache, job->url) &&
+        avformat_find_stream_info(*job->format_ctx, NULL) >= 0;
+    error_jmp = outer;
+    return NULL;
+}
+
+// open and probe the resolved inputs, split streams in parallel
+bool open_resolved(VideoContext *ctx, ResolvedUrls *resolved)
+{
+    ProbeJob jobs[2] = {
+        {ctx->player, open_cancel, &ctx->format_ctx, &ctx->net_cache, resolved->urls[0], false},
+        {ctx->player, open_cancel, &ctx->format_ctx2, &ctx->net_cache2, resolved->urls[1], false},
+    };
+    pthread_t thread;
+    bool split = resolved->count > 1;
+    if (split) pthread_create(&thread, NULL, probe_thread_func, &jobs[1]);
+    probe_thread_func(&jobs[0]);
+    if (split) pthread_join(thread, NULL);
+
+    if (jobs[0].ok && (!split || jobs[1].ok)) {
+        ctx->is_split = split;
+        return true;
+    }
+    // leave nothing half open for a retry
+    for (int i = 0; i < 2; i++) {
+        if (*jobs[i].format_ctx != NULL) avformat_close_input(jobs[i].format_ctx);
+        net_cache_close(jobs[i].cache);
+    }
+    return false;
+}
+
+// what the loading screen shows, if the opening thread has one
+void open_status_set(const char *status)
+{
+    if (open_status != NULL) atomic_store(open_status, status);
+}
+
+void init_format_yt(VideoContext *ctx, char *video_file, char *yt_dlp_args)
+{
+    LOG("initializing youtube streaming...");
+    if (yt_dlp_args == NULL) yt_dlp_args = DEFAULT_ARGS;
+
+    char path[PATH_MAX];
+    bool cache = yt_cache_path(path, video_file, yt_dlp_args);
+    ResolvedUrls resolved = {0};
+    if (cache && yt_cache_load(path, &resolved)) {
+        LOG("using resolved urls from %s", path);
+        open_status_set("Opening...");
+        if (open_resolved(ctx, &resolved)) return;
+        // revoked before they expired
+        WARN("cached urls failed, resolving again");
+        unlink(path);
+    }
+
+    open_status_set("Resolving...");
+    if (!yt_resolve(video_file, yt_dlp_args, &resolved))
+        ERROR("failed to retrieve video with %s", resolver);
+    open_status_set("Opening...");
+    if (!open_resolved(ctx, &resolved))
+        ERROR("Could not open youtube video %s", video_file);
+    if (cache) yt_cache_save(path, &resolved);
+}
+
+// youtube also has the youtu.be domain
+#define YT_DOMAINS {"https://www.youtu", "https://youtu", "youtu"}
+// TODO: parse url for timestamp to seek to
+void init_av_streaming(VideoContext *ctx, char *video_file, char *yt_dlp_args)
+{
+    JPlayer *p = ctx->player;
+    av_log_set_level(AV_LOG_ERROR);
+    //---Format---
+    bool yt_url = false;
+    const char *domains[] = YT_DOMAINS;
+    for (int i = 0; i < 3; i++) {
+        if (strncmp(video_file, domains[i], strlen(domains[i])) == 0)
+            yt_url = true;
+    }
+    bool local = !(yt_url || yt_dlp_args != NULL);
+    // other protocols go through the network cache, file: is still local
+    bool url = local && is_net_url(video_file);
+    if (!local) {
+        init_format_yt(ctx, video_file, yt_dlp_args);
+    } else {
+        local = !url;
+        LOG("Loading Video");
+        bool opened = url ? open_net_input(p, &ctx->format_ctx, &ctx->net_cache, video_file)
+                          : open_local_input(p, &ctx->format_ctx, &ctx->mapped, video_file);
+        if (!opened) ERROR("Could not open video %s %s", url ? "url" : "file", video_file);
+        // find the streams in the format
+        if (avformat_find_stream_info(ctx->format_ctx, NULL) < 0)
+            ERROR("Could not find stream info");
+    }
+    // a separate audio input plays like the split streams yt-dlp resolves to,
+    // opened the same way as the video
+    if (audio_input != NULL && !ctx->is_split && !ctx->no_audio) {
+        bool opened = is_net_url(audio_input)
+            ? open_net_input(p, &ctx->format_ctx2, &ctx->net_cache2, audio_input)
+            : open_local_input(p, &ctx->format_ctx2, &ctx->mapped2, audio_input);
+        if (!opened || avformat_find_stream_info(ctx->format_ctx2, NULL) < 0)
+            ERROR("Could not open audio input %s", audio_input);
+        ctx->is_split = true;
+    }
+    startup_mark(p, PHASE_PROBE);
+    LOG("Format %s%s", ctx->format_ctx->iformat->long_name,
+        ctx->is_split ? " | split stream" : "");
+
+    //---Codecs---
+    int ret;
+    const AVCodec *codec;
+
+    // find video stream
+    ret = av_find_best_stream(ctx->format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (ret < 0 && ctx->is_split) {
+        ret = av_find_best_stream(ctx->format_ctx2, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+        if (ret < 0) ERROR("Could not find a video stream");
+        // swap so that video is in ctx 1
+        AVFormatContext *tmp = ctx->format_ctx;
+        ctx->format_ctx = ctx->format_ctx2;
+        ctx->format_ctx2 = tmp;
+        struct NetCache *tmp_cache = ctx->net_cache;
+        ctx->net_cache = ctx->net_cache2;
+        ctx->net_cache2 = tmp_cache;
+        struct MappedFile *tmp_mapped = ctx->mapped;
+        ctx->mapped = ctx->mapped2;
+        ctx->mapped2 = tmp_mapped;
+    }
+    ctx->v_index = ret;
+    ctx->v_ctx = avcodec_alloc_context3(codec);
+    // create vido codec ctx
+    if (avcodec_parameters_to_context(ctx->v_ctx, 
+        ctx->format_ctx->streams[ctx->v_index]->codecpar) < 0)
+        ERROR("could not create video codec context");
+
+    // setup fps and time_base for vido ctx
+    AVRational framerate = ctx->format_ctx->streams[ctx->v_index]->avg_frame_rate;
+    ctx->fps = framerate.num / framerate.den;
+    ctx->duration = (double)ctx->format_ctx->duration / AV_TIME_BASE;
+    if (ctx->format_ctx->start_time != AV_NOPTS_VALUE)
+        ctx->start_time = (double)ctx->format_ctx->start_time / AV_TIME_BASE;
+    ctx->v_ctx->time_base = ctx->format_ctx->streams[ctx->v_index]->time_base;
+    ctx->v_ctx->pkt_timebase = ctx->v_ctx->time_base;
+    LOG("Video %dx%d at %dfps", ctx->v_ctx->width, ctx->v_ctx->height, ctx->fps);
+    LOG("Codec %s ID %d", codec->long_name, codec->id);
+
+    // initialize audio codec
+    // if we are using seperated streams then audio must be in context 2
+    AVFormatContext *audio_ctx = ctx->is_split ? ctx->format_ctx2 : ctx->format_ctx;
+
+    // a video only player has no audio stream, every other is discarded
+    ctx->a_index = -1;
+    if (!ctx->no_audio) {
+        ctx->a_index = av_find_best_stream(audio_ctx, AVMEDIA_TYPE_AUDIO, -1, ctx->v_index, &codec, 0);
+        if (ctx->a_index < 0) ERROR("Could not find audio stream");
+        ctx->a_ctx = avcodec_alloc_context3(codec);
+        if (avcodec_parameters_to_context(ctx->a_ctx,
+            audio_ctx->streams[ctx->a_index]->codecpar) < 0)
+            ERROR("could not create audio codec context");
+        ctx->a_ctx->pkt_timebase = audio_ctx->streams[ctx->a_index]->time_base;
+
+        LOG("Audio %d chanels, sample rate %dHZ, sample fmt %s", 
+            ctx->a_ctx->ch_layout.nb_channels, ctx->a_ctx->sample_rate, 
+            av_get_sample_fmt_name(ctx->a_ctx->sample_fmt));
+        LOG("Codec %s ID %d", codec->long_name, codec->id);
+    }
+
+    // only demux the streams we decode
+    for (unsigned i = 0; i < ctx->format_ctx->nb_streams; i++) {
+        if ((int)i != ctx->v_index && (ctx->is_split || (int)i != ctx->a_index))
+            ctx->format_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+    if (ctx->is_split) {
+        for (unsigned i = 0; i < ctx->format_ctx2->nb_streams; i++) {
+            if ((int)i != ctx->a_index)
+                ctx->format_ctx2->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    if (ctx->mapped != NULL) ctx->mapped->zero_copy = map_zero_copy_input(ctx->format_ctx);
+    if (ctx->mapped2 != NULL) ctx->mapped2->zero_copy = map_zero_copy_input(ctx->format_ctx2);
+
+    // open the initialized codecs for use
+    ctx->v_pool = frame_pool_create(&p->alloc_stats);
+    ctx->v_ctx->opaque = ctx->v_pool;
+    ctx->v_ctx->get_buffer2 = frame_pool_get_buffer;
+    ctx->v_ctx->thread_count = ctx->decoder_threads;
+    ctx->v_ctx->thread_type = codec_thread_type;
+    if (avcodec_open2(ctx->v_ctx, ctx->v_ctx->codec, NULL) < 0)
+        ERROR("Could not open video codec");
+    LOG("Video decoding on %d threads", ctx->v_ctx->thread_count);
+
+    // a video only player seeks by the demuxer, its scan would compete with playback
+    ctx->index_file = local && !ctx->no_audio ? video_file : NULL;
+    if (!ctx->no_audio) {
+        ctx->a_pool = frame_pool_create(&p->alloc_stats);
+        ctx->a_ctx->opaque = ctx->a_pool;
+        ctx->a_ctx->get_buffer2 = frame_pool_get_buffer;
+        if (avcodec_open2(ctx->a_ctx, ctx->a_ctx->codec, NULL) < 0)
+            ERROR("Could not open audio codec");
+    }
+    startup_mark(p, PHASE_CODEC_OPEN);
+     
+    return;
+}
+
+// Multiply interleaved samples by a gain that moves by step every frame.
+void gain_scalar(float *data, int frames, int channels, float gain, float step)
+{
+    for (int i = 0; i < frames; i++, gain += step) {
+        for (int c = 0; c < channels; c++) *data++ *= gain;
+    }
+}
+
+#ifdef HAVE_X86
+// A vector only holds whole frames when the channel count divides its width,
+// anything else, like 5.1, takes the scalar path.
+__attribute__((target("sse2")))
+void gain_sse(float *data, int frames, int channels, float gain, float step)
+{
+    if (4 % channels != 0) {
+        gain_scalar(data, frames, channels, gain, step);
+        return;
+    }
+    float lanes[4];
+    for (int j = 0; j < 4; j++) lanes[j] = gain + (j / channels) * step;
+    __m128 g = _mm_loadu_ps(lanes);
+    __m128 inc = _mm_set1_ps(4 / channels * step);
+    int n = frames * channels, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(data + i, _mm_mul_ps(_mm_loadu_ps(data + i), g));
+        g = _mm_add_ps(g, inc);
+    }
+    gain_scalar(data + i, (n - i) / channels, channels, gain + i / channels * step, step);
+}
+
+__attribute__((target("avx")))
+void gain_avx(float *data, int frames, int channels, float gain, float step)
+{
+    if (8 % channels != 0) {
+        gain_scalar(data, frames, channels, gain, step);
+        return;
+    }
+    float lanes[8];
+    for (int j = 0; j < 8; j++) lanes[j] = gain + (j / channels) * step;
+    __m256 g = _mm256_loadu_ps(lanes);
+    __m256 inc = _mm256_set1_ps(8 / channels * step);
+    int n = frames * channels, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(data + i, _mm256_mul_ps(_mm256_loadu_ps(data + i), g));
+        g = _mm256_add_ps(g, inc);
+    }
+    gain_scalar(data + i, (n - i) / channels, channels, gain + i / channels * step, step);
+}
+#endif
+
+// the widest gain the cpu supports
+GainFunc gain_best(const char **name)
+{
+    *name = "scalar";
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")) {
+        *name = "avx";
+        return gain_avx;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "sse";
+        return gain_sse;
+    }
+#endif
+    return gain_scalar;
+}
+
+void dsp_init(AudioDsp *d, int channels, int sample_rate)
+{
+    atomic_init(&d->volume, 1.0f);
+    atomic_init(&d->norm_gain, 1.0f);
+    d->gain = d->ramp_target = 1.0f;
+    d->ramp_frames = GAIN_RAMP_MS * sample_rate / 1000;
+    d->delay_frames = LIMITER_LOOKAHEAD_MS * sample_rate / 1000;
+    if (d->delay_frames < 1) d->delay_frames = 1;
+    d->delay = av_calloc((size_t)d->delay_frames * channels, sizeof(float));
+    if (d->delay == NULL) ERROR("out of memory");
+    d->env = d->target = 1.0f;
+    d->release = 1.0f - expf(-1000.0f / (LIMITER_RELEASE_MS * sample_rate));
+    atomic_init(&d->limited, 0);
+}
+
+// Delay the audio by the look-ahead and ramp the gain down ahead of any peak
+// over the ceiling, so it has reached the peak's gain by the time the peak
+// comes out. The gain holds until the last loud frame is out, then recovers.
+void limiter_process(AudioDsp *d, float *data, int frames, int channels)
+{
+    bool limited = false;
+    for (int i = 0; i < frames; i++) {
+        float *in = data + i*channels;
+        float *delayed = d->delay + d->delay_pos*channels;
+        float peak = 0.0f;
+        for (int c = 0; c < channels; c++) {
+            float x = fabsf(in[c]);
+            if (x > peak) peak = x;
+        }
+        if (peak > LIMITER_CEILING) {
+            float need = LIMITER_CEILING / peak;
+            if (need < d->target) {
+                d->target = need;
+                d->attack = (d->env - need) / d->delay_frames;
+            }
+            d->hold = d->delay_frames;
+        } else if (d->hold > 0 && --d->hold == 0) {
+            d->target = 1.0f;
+        }
+
+        if (d->env > d->target) {
+            d->env -= d->attack;
+            if (d->env < d->target) d->env = d->target;
+        } else {
+            d->env += (d->target - d->env) * d->release;
+        }
+        limited |= d->env < 1.0f;
+        for (int c = 0; c < channels; c++) {
+            float x = delayed[c];
+            delayed[c] = in[c];
+            in[c] = x * d->env;
+        }
+        if (++d->delay_pos == d->delay_frames) d->delay_pos = 0;
+    }
+    if (limited) atomic_fetch_add(&d->limited, 1);
+}
+
+// gain then limiter, on the device thread
+void dsp_process(AudioDsp *d, float *data, int frames, int channels)
+{
+    float target = atomic_load(&d->volume) * atomic_load(&d->norm_gain);
+    if (target != d->ramp_target) {
+        d->ramp_target = target;
+        d->ramp_left = d->ramp_frames;
+        d->ramp_step = (target - d->gain) / d->ramp_frames;
+    }
+    int n = frames < d->ramp_left ? frames : d->ramp_left;
+    if (n > 0) {
+        d->gain_apply(data, n, channels, d->gain, d->ramp_step);
+        d->ramp_left -= n;
+        d->gain = d->ramp_left > 0 ? d->gain + n * d->ramp_step : target;
+    }
+    if (frames > n) d->gain_apply(data + n*channels, frames - n, channels, d->gain, 0.0f);
+    limiter_process(d, data, frames, channels);
+}
+
+// K-weighting for the sample rate, the filter design of ITU-R BS.1770
+void loudness_init(Loudness *l, AVChannelLayout *layout, int sample_rate)
+{
+    double f0 = 1681.974450955533, G = 3.999843853973347, Q = 0.7071752369554196;
+    double K = tan(M_PI * f0 / sample_rate);
+    double Vh = pow(10.0, G / 20.0), Vb = pow(Vh, 0.4996667741545416);
+    double a0 = 1.0 + K / Q + K * K;
+    l->b[0][0] = (Vh + Vb * K / Q + K * K) / a0;
+    l->b[0][1] = 2.0 * (K * K - Vh) / a0;
+    l->b[0][2] = (Vh - Vb * K / Q + K * K) / a0;
+    l->a[0][1] = 2.0 * (K * K - 1.0) / a0;
+    l->a[0][2] = (1.0 - K / Q + K * K) / a0;
+    f0 = 38.13547087602444;
+    Q = 0.5003270373238773;
+    K = tan(M_PI * f0 / sample_rate);
+    a0 = 1.0 + K / Q + K * K;
+    l->b[1][0] = 1.0;
+    l->b[1][1] = -2.0;
+    l->b[1][2] = 1.0;
+    l->a[1][1] = 2.0 * (K * K - 1.0) / a0;
+    l->a[1][2] = (1.0 - K / Q + K * K) / a0;
+
+    l->channels = layout->nb_channels;
+    l->z = av_calloc(l->channels, sizeof(*l->z));
+    l->weights = av_calloc(l->channels, sizeof(double));
+    if (l->z == NULL || l->weights == NULL) ERROR("out of memory");
+    // surrounds count a bit more, the LFE not at all
+    for (int c = 0; c < l->channels; c++) {
+        enum AVChannel ch = av_channel_layout_channel_from_index(layout, c);
+        l->weights[c] = ch == AV_CHAN_LOW_FREQUENCY ? 0.0 :
+            ch == AV_CHAN_SIDE_LEFT || ch == AV_CHAN_SIDE_RIGHT ||
+            ch == AV_CHAN_BACK_LEFT || ch == AV_CHAN_BACK_RIGHT ? 1.41 : 1.0;
+    }
+    l->step_frames = sample_rate / 10;
+    atomic_init(&l->integrated, -HUGE_VAL);
+}
+
+// start measuring from scratch, e.g. for the next item
+void loudness_reset(Loudness *l)
+{
+    memset(l->z, 0, l->channels * sizeof(*l->z));
+    l->sum = 0.0;
+    l->frames = 0;
+    l->step_count = 0;
+    memset(l->bin_energy, 0, sizeof(l->bin_energy));
+    memset(l->bin_count, 0, sizeof(l->bin_count));
+    atomic_store(&l->integrated, -HUGE_VAL);
+}
+
+void loudness_free(Loudness *l)
+{
+    av_freep(&l->z);
+    av_freep(&l->weights);
+}
+
+int loudness_bin(double lufs)
+{
+    int bin = (lufs + 70.0) * 10.0;
+    return bin < 0 ? 0 : bin >= LOUDNESS_BINS ? LOUDNESS_BINS - 1 : bin;
+}
+
+// a 400ms block is done, add it and gate again
+void loudness_block(Loudness *l)
+{
+    double energy = (l->steps[0] + l->steps[1] + l->steps[2] + l->steps[3]) / (4.0 * l->step_frames);
+    double lufs = -0.691 + 10.0 * log10(energy);
+    if (lufs <= -70.0) return;
+    int bin = loudness_bin(lufs);
+    l->bin_energy[bin] += energy;
+    l->bin_count[bin]++;
+
+    double total = 0.0;
+    long count = 0;
+    for (int i = 0; i < LOUDNESS_BINS; i++) {
+        total += l->bin_energy[i];
+        count += l->bin_count[i];
+    }
+    double relative = -0.691 + 10.0 * log10(total / count) - 10.0;
+    total = 0.0;
+    count = 0;
+    for (int i = loudness_bin(relative); i < LOUDNESS_BINS; i++) {
+        total += l->bin_energy[i];
+        count += l->bin_count[i];
+    }
+    if (count > 0) atomic_store(&l->integrated, -0.691 + 10.0 * log10(total / count));
+}
+
+void loudness_process(Loudness *l, const float *data, int frames)
+{
+    for (int i = 0; i < frames; i++) {
+        for (int c = 0; c < l->channels; c++) {
+            double *z = l->z[c];
+            double x = data[i*l->channels + c];
+            for (int f = 0; f < 2; f++) {
+                double y = l->b[f][0] * x + z[2*f];
+                z[2*f] = l->b[f][1] * x - l->a[f][1] * y + z[2*f + 1];
+                z[2*f + 1] = l->b[f][2] * x - l->a[f][2] * y;
+                x = y;
+            }
+            l->sum += l->weights[c] * x * x;
+        }
+        if (++l->frames == l->step_frames) {
+            l->steps[l->step_count++ % 4] = l->sum;
+            if (l->step_count >= 4) loudness_block(l);
+            l->sum = 0.0;
+            l->frames = 0;
+        }
+    }
+}
+
+// gain that brings the measured loudness to -normalize
+void normalize_update(JPlayer *p)
+{
+    double lufs = atomic_load(&p->loudness.integrated);
+    if (normalize_lufs == 0.0 || lufs == -HUGE_VAL) return;
+    double db = normalize_lufs - lufs;
+    if (db > NORMALIZE_MAX_BOOST) db = NORMALIZE_MAX_BOOST;
+    if (db < -NORMALIZE_MAX_CUT) db = -NORMALIZE_MAX_CUT;
+    atomic_store(&p->dsp.norm_gain, powf(10.0f, db / 20.0f));
+}
+
+// everything opened for one input, the queues and the ring outlive it
+void close_input(VideoContext *ctx)
+{
+    avcodec_free_context(&ctx->v_ctx);
+    avcodec_free_context(&ctx->a_ctx);
+    avformat_close_input(&ctx->format_ctx);
+    avformat_free_context(ctx->format_ctx);
+    // also called on inputs that failed halfway through opening, where the
+    // split input may be open before is_split is set
+    avformat_close_input(&ctx->format_ctx2);
+    avformat_free_context(ctx->format_ctx2);
+    // custom io outlives the demuxer
+    net_cache_close(&ctx->net_cache);
+    net_cache_close(&ctx->net_cache2);
+    map_file_close(&ctx->mapped);
+    map_file_close(&ctx->mapped2);
+    // buffers still referenced by queued frames outlive their pool
+    frame_pool_free(&ctx->v_pool);
+    frame_pool_free(&ctx->a_pool);
+    sws_freeContext(ctx->sws_ctx);
+    ctx->sws_ctx = NULL;
+    if (ctx->swr_ctx != NULL) swr_close(ctx->swr_ctx);
+    swr_free(&ctx->swr_ctx);
+}
+
+void deinit_av_streaming(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    // free queues
+    QUEUE_FREE(p->v_queue, av_frame_free);
+    QUEUE_FREE(p->rgb_queue, av_frame_free);
+    QUEUE_FREE(p->a_queue, av_frame_free);
+    QUEUE_FREE(p->v_packets, av_packet_free);
+    QUEUE_FREE(p->a_packets, av_packet_free);
+
+    close_input(ctx);
+    av_freep(&p->pcm.data);
+    av_freep(&p->dsp.delay);
+    loudness_free(&p->loudness);
+    av_channel_layout_uninit(&p->pcm.layout);
+    if (!ctx->no_audio) sem_destroy(&p->pcm.space);
+    index_free(&p->kf_index);
+}
+
+// Conversion heights snap to fractions of the source height so that resizing
+// the window only rebuilds the scaler when it crosses a bucket. We never
+// convert above the source size, the GPU does any upscaling.
+const float scale_buckets[] = {0.25f, 1.0f/3.0f, 0.5f, 2.0f/3.0f, 0.75f, 1.0f};
+
+int bucket_height(int src_height, int height)
+{
+    for (size_t i = 0; i < sizeof(scale_buckets)/sizeof(*scale_buckets); i++) {
+        int h = (int)(src_height * scale_buckets[i]) & ~1;
+        if (h >= height) return h;
+    }
+    return src_height;
+}
+
+// size of the converted frames for the requested height, keeping the aspect
+void output_size(VideoContext *ctx, int *width, int *height)
+{
+    *height = atomic_load(&ctx->out_height);
+    *width = ((int64_t)ctx->v_ctx->width * *height / ctx->v_ctx->height + 1) & ~1;
+    if (*width < 2) *width = 2;
+}
+
+// Rows are uploaded in one UpdateTexture call so they have to be tightly
+// packed, but when the row size allows it the buffers are 64 byte aligned so
+// swscale can use its SIMD paths.
+bool alloc_rgb_frame(AVFrame *frame, int width, int height)
+{
+    av_frame_unref(frame);
+    frame->width = width;
+    frame->height = height;
+    frame->format = AV_PIX_FMT_RGB24;
+    return av_frame_get_buffer(frame, (width * 3) % 64 == 0 ? 64 : 1) >= 0;
+}
+
+// 8 bit planar YUV and NV12 can go to the GPU as they are, everything else is
+// converted to RGB first
+bool yuv_frame_supported(const AVFrame *frame)
+{
+    switch (frame->format) {
+    case AV_PIX_FMT_YUV420P: case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_YUV422P: case AV_PIX_FMT_YUVJ422P:
+    case AV_PIX_FMT_YUV444P: case AV_PIX_FMT_YUVJ444P:
+    case AV_PIX_FMT_NV12:
+        break;
+    default:
+        return false;
+    }
+    // the planes are uploaded row for row, flipped frames would need a copy
+    for (int i = 0; i < 3 && frame->data[i] != NULL; i++)
+        if (frame->linesize[i] <= 0) return false;
+    return true;
+}
+
+// (re)create the scaler for a source frame and output size, swscale splits
+// every frame into slices across its own threads
+void update_sws_context(VideoContext *ctx, AVFrame *src, int width, int height)
+{
+    if (ctx->sws_ctx != NULL && ctx->sws_src_width == src->width &&
+        ctx->sws_src_height == src->height && ctx->sws_src_format == src->format &&
+        ctx->sws_dst_width == width && ctx->sws_dst_height == height)
+        return;
+
+    sws_freeContext(ctx->sws_ctx);
+    ctx->sws_ctx = sws_alloc_context();
+    if (ctx->sws_ctx == NULL)
+        ERROR("Failed to get sws context");
+    av_opt_set_int(ctx->sws_ctx, "srcw", src->width, 0);
+    av_opt_set_int(ctx->sws_ctx, "srch", src->height, 0);
+    av_opt_set_int(ctx->sws_ctx, "src_format", src->format, 0);
+    av_opt_set_int(ctx->sws_ctx, "dstw", width, 0);
+    av_opt_set_int(ctx->sws_ctx, "dsth", height, 0);
+    av_opt_set_int(ctx->sws_ctx, "dst_format", AV_PIX_FMT_RGB24, 0);
+    av_opt_set_int(ctx->sws_ctx, "sws_flags", SWS_BILINEAR, 0);
+    av_opt_set_int(ctx->sws_ctx, "threads", convert_threads, 0);
+    if (sws_init_context(ctx->sws_ctx, NULL, NULL) < 0)
+        ERROR("Failed to init sws context");
+
+    ctx->sws_src_width = src->width;
+    ctx->sws_src_height = src->height;
+    ctx->sws_src_format = src->format;
+    ctx->sws_dst_width = width;
+    ctx->sws_dst_height = height;
+    LOG("Converting %dx%d %s to %dx%d", src->width, src->height,
+        av_get_pix_fmt_name(src->format), width, height);
+}
+
+// Sample conversion to the format of the ring. Later items of a playlist are
+// converted to the first one's so the device never has to be reopened.
+void init_resampler(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    int ret = swr_alloc_set_opts2(&ctx->swr_ctx, &p->pcm.layout, AV_SAMPLE_FMT_FLT,
+                        p->pcm.sample_rate, &ctx->a_ctx->ch_layout,
+                        ctx->a_ctx->sample_fmt, ctx->a_ctx->sample_rate, 0, NULL);
+    if (ret < 0) ERROR("Could not alloc swresample");
+    if (swr_init(ctx->swr_ctx) < 0) ERROR("Could not init swresample");
+}
+
+void init_frame_conversion(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    // Pixel conversion, the scaler is created lazily by the conversion step
+    int vid_height = ctx->v_ctx->height;
+    int display_height = vid_height < DEFAULT_WINDOW_HEIGHT ? vid_height : DEFAULT_WINDOW_HEIGHT;
+    // the bench measures conversion at the native size
+    if (bench_mode) display_height = vid_height;
+    atomic_init(&ctx->out_height, bucket_height(vid_height, display_height));
+
+    int width, height;
+    output_size(ctx, &width, &height);
+    // fixed size ring, not counted against the memory limit
+    QUEUE_INIT(p->rgb_queue, RGB_QUEUE_CAP, av_frame_alloc, NO_LIMITS);
+    for (int i = 0; i < p->rgb_queue.cap; i++) {
+        if (!alloc_rgb_frame(p->rgb_queue.items[i], width, height))
+            ERROR("Failed to allocate image buffer");
+    }
+
+    if (ctx->no_audio) return;
+    // at least two device periods so the callback can always be served from one
+    if (av_channel_layout_copy(&p->pcm.layout, &ctx->a_ctx->ch_layout) < 0) ERROR("out of memory");
+    p->pcm.channels = p->pcm.layout.nb_channels;
+    p->pcm.sample_rate = ctx->a_ctx->sample_rate;
+    p->pcm.cap = (int64_t)audio_buffer_ms * p->pcm.sample_rate / 1000;
+    if (p->pcm.cap < 2*AUDIO_DEVICE_FRAMES) p->pcm.cap = 2*AUDIO_DEVICE_FRAMES;
+    p->pcm.data = av_malloc_array(p->pcm.cap, p->pcm.channels * sizeof(float));
+    if (p->pcm.data == NULL) ERROR("out of memory");
+    atomic_init(&p->pcm.write_pos, 0);
+    atomic_init(&p->pcm.read_pos, 0);
+    atomic_init(&p->pcm.discard_pos, 0);
+    atomic_init(&p->pcm.ended, false);
+    atomic_init(&p->pcm.underruns, 0);
+    atomic_init(&p->pcm.overruns, 0);
+    sem_init(&p->pcm.space, 0, 0);
+    atomic_init(&p->pcm.writer_waiting, false);
+    atomic_init(&p->pcm.anchor_seq, 0);
+    atomic_init(&p->pcm.anchor_start, 0);
+    atomic_init(&p->pcm.anchor_count, 0);
+    atomic_init(&p->pcm.anchor_serial, -1);
+    init_resampler(ctx);
+
+    const char *simd;
+    dsp_init(&p->dsp, p->pcm.channels, p->pcm.sample_rate);
+    p->dsp.gain_apply = gain_best(&simd);
+    loudness_init(&p->loudness, &p->pcm.layout, p->pcm.sample_rate);
+    LOG("Audio gain using %s", simd);
+}
+
+// Seek the video input to the keyframe nearest the target. Inside the indexed
+// range the keyframe timestamp is known exactly so the demuxer doesn't have to
+// search, past it we fall back to letting av_seek_frame probe. Returns where
+// it went in AV_TIME_BASE, for the audio input of a split stream.
+int64_t seek_inputs(VideoContext *ctx, double target, bool forward)
+{
+    JPlayer *p = ctx->player;
+    AVRational time_base = ctx->format_ctx->streams[ctx->v_index]->time_base;
+    int64_t ts = (target - ctx->offset + ctx->start_time) / av_q2d(time_base);
+    int flags = forward ? 0 : AVSEEK_FLAG_BACKWARD;
+
+    int i = index_find(&p->kf_index, ts);
+    if (forward && i + 1 < p->kf_index.count && (i < 0 || p->kf_index.items[i].pts < ts)) i++;
+    if (i >= 0 && (i + 1 < p->kf_index.count || p->kf_index.complete)) {
+        ts = p->kf_index.items[i].pts;
+        flags = AVSEEK_FLAG_BACKWARD;
+    }
+
+    int ret = av_seek_frame(ctx->format_ctx, ctx->v_index, ts, flags);
+    if (ret < 0) WARN("seeking, %s", av_err2str(ret));
+    return av_rescale_q(ts, time_base, AV_TIME_BASE_Q);
+}
+
+// only called from av_buffer_pool_get, opaque is the player's AllocStats
+AVBufferRef *packet_pool_alloc(void *opaque, size_t size)
+{
+    AllocStats *stats = opaque;
+    atomic_fetch_add(&stats->packet_buffers, 1);
+    return av_buffer_alloc(size);
+}
+
+// Move the payload of a demuxed packet into a buffer of the reader's pool for
+// its queue, the demuxer's own buffer is freed right away and the pooled one
+// recycled once the packet is decoded. A pool is rebuilt when a packet
+// outgrows it, its buffers still queued are freed as they come back.
+void packet_pool_move(InputReader *r, int pool, AVPacket *packet)
+{
+    size_t need = (size_t)packet->size + AV_INPUT_BUFFER_PADDING_SIZE;
+    if (r->packet_pools[pool] == NULL || r->packet_pool_size[pool] < need) {
+        size_t size = PACKET_POOL_MIN;
+        while (size < need) size *= 2;
+        av_buffer_pool_uninit(&r->packet_pools[pool]);
+        r->packet_pools[pool] = av_buffer_pool_init2(size, &r->ctx->player->alloc_stats,
+                                                     packet_pool_alloc, NULL);
+        r->packet_pool_size[pool] = r->packet_pools[pool] != NULL ? size : 0;
+    }
+    AVBufferRef *buf = r->packet_pools[pool] != NULL ? av_buffer_pool_get(r->packet_pools[pool]) : NULL;
+    // the demuxer's buffer does as well
+    if (buf == NULL) return;
+    memcpy(buf->data, packet->data, packet->size);
+    memset(buf->data + packet->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    av_buffer_unref(&packet->buf);
+    packet->buf = buf;
+    packet->data = buf->data;
+}
+
+// what a queued item costs, for the queue limits
+int64_t packet_bytes(AVPacket *packet)
+{
+    return packet->buf != NULL ? (int64_t)packet->buf->size : packet->size;
+}
+
+int64_t packet_duration(AVPacket *packet, AVRational time_base)
+{
+    return packet->duration > 0 ? av_rescale_q(packet->duration, time_base, AV_TIME_BASE_Q) : 0;
+}
+
+int64_t frame_bytes(AVFrame *frame)
+{
+    int64_t bytes = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i] != NULL; i++)
+        bytes += frame->buf[i]->size;
+    for (int i = 0; i < frame->nb_extended_buf; i++)
+        bytes += frame->extended_buf[i]->size;
+    return bytes;
+}
+
+int64_t frame_duration(AVFrame *frame, AVCodecContext *codec_ctx)
+{
+    if (frame->nb_samples > 0 && frame->sample_rate > 0)
+        return (int64_t)frame->nb_samples * AV_TIME_BASE / frame->sample_rate;
+    if (frame->duration > 0)
+        return av_rescale_q(frame->duration, codec_ctx->pkt_timebase, AV_TIME_BASE_Q);
+    if (codec_ctx->framerate.num > 0)
+        return (int64_t)AV_TIME_BASE * codec_ctx->framerate.den / codec_ctx->framerate.num;
+    return 0;
+}
+
+// unpark the writer, from the callback or when it has to notice a seek or quit
+void pcm_wake(PcmRing *r)
+{
+    if (atomic_load_explicit(&r->writer_waiting, memory_order_relaxed) &&
+        atomic_exchange(&r->writer_waiting, false))
+        sem_post(&r->space);
+}
+
+// wake every pipeline thread of the player wherever it is parked, network
+// waits included, so it sees quit and a step reading from the network returns
+void pipeline_abort(JPlayer *p)
+{
+    // a reader may be waiting on the network
+    net_cache_abort(p->ctx.net_cache);
+    net_cache_abort(p->ctx.net_cache2);
+    QUEUE_WAKE(p->v_packets);
+    QUEUE_WAKE(p->a_packets);
+    QUEUE_WAKE(p->v_queue);
+    QUEUE_WAKE(p->a_queue);
+    QUEUE_WAKE(p->rgb_queue);
+    QUEUE_WAKE(task_pool);
+    pcm_wake(&p->pcm);
+}
+
+// Stop the pipeline of p because of an error on one of its threads. The
+// first error is kept for jp_error, the player's calls return JP_ERROR from
+// then on and the threads are joined when it is stopped or closed.
+void player_fail(JPlayer *p, const char *message)
+{
+    pthread_mutex_lock(&p->error_mutex);
+    if (!atomic_load(&p->failed)) snprintf(p->error, sizeof(p->error), "%s", message);
+    atomic_store(&p->failed, true);
+    pthread_mutex_unlock(&p->error_mutex);
+    p->ctx.quit = true;
+    pipeline_abort(p);
+}
+
+// at the start of a pipeline thread, an ERROR on it fails player P and ends
+// the thread instead of the process
+#define PIPELINE_CATCH(P) \
+    jmp_buf __env; \
+    if (setjmp(__env)) { \
+        error_jmp = NULL; \
+        player_fail(P, error_message); \
+        return NULL; \
+    } \
+    error_jmp = &__env
+
+// queue a demuxed packet belongs in or NULL if we don't play its stream
+PacketQueue *route_packet(VideoContext *ctx, int input, AVPacket *packet)
+{
+    JPlayer *p = ctx->player;
+    // the second input of a split stream only carries audio
+    if (input == 1) return &p->a_packets;
+    if (packet->stream_index == ctx->v_index) return &p->v_packets;
+    if (!ctx->is_split && packet->stream_index == ctx->a_index) return &p->a_packets;
+    return NULL;
+}
+
+// A reader more than dts_window ahead of the other input waits for it, unless
+// the other can't move anyway because it is at its end or its queue is full.
+bool reader_ahead(InputReader *r, InputReader *other, int serial)
+{
+    int64_t mine = atomic_load(&r->dts), theirs = atomic_load(&other->dts);
+    if (mine == AV_NOPTS_VALUE || theirs == AV_NOPTS_VALUE) return false;
+    if (atomic_load(&other->eof_serial) == serial || atomic_load(&other->blocked)) return false;
+    return mine - theirs > (int64_t)dts_window_ms * 1000;
+}
+
+// What stepping the reader would do. Like all of the reader's state this is
+// only looked at by the worker holding it.
+ReaderState reader_state(InputReader *r)
+{
+    VideoContext *ctx = r->ctx;
+    JPlayer *p = ctx->player;
+    int current = atomic_load_explicit(&ctx->serial, memory_order_acquire);
+    if (current != r->serial) {
+        // the audio input follows to where the video actually went
+        if (r->input == 1 && atomic_load(&p->readers[0].seek_serial) != current) return READER_IDLE;
+        return READER_RUN;
+    }
+    // nothing left to read until the next seek once the end is published
+    if (r->done && !r->has_pending)
+        return atomic_load(&r->eof_serial) != r->serial ? READER_RUN : READER_IDLE;
+    if (r->has_pending) {
+        PacketQueue *queue = route_packet(ctx, r->input, r->pending);
+        return queue != NULL && QUEUE_FULL((*queue)) ? READER_STALL : READER_RUN;
+    }
+    // over the memory limit only read while a stream is about to run dry
+    if (OVER_MEMORY_LIMIT() && !QUEUE_LOW(p->v_packets) && (ctx->no_audio || !QUEUE_LOW(p->a_packets)))
+        return READER_STALL;
+    // far enough ahead of the other input, unless this side runs dry
+    PacketQueue *own = r->input == 0 ? &p->v_packets : &p->a_packets;
+    if (ctx->is_split && !QUEUE_LOW((*own)) && reader_ahead(r, &p->readers[!r->input], r->serial))
+        return READER_WINDOW;
+    return READER_RUN;
+}
+
+// Demux one input into its packet queues, a packet per step. A split stream
+// has a reader for each input, so the audio and video urls are fetched
+// independently and a slow one never holds up the other. Each publishes the
+// dts it has read up to and the two are merged by time: the one ahead isn't
+// stepped while it is more than dts_window past the other, which keeps one
+// queue from filling up while the other starves. A step that leaves the
+// reader unable to go on starts a stall or window wait, which lasts until it
+// is stepped again.
+void reader_step(InputReader *r)
+{
+    VideoContext *ctx = r->ctx;
+    JPlayer *p = ctx->player;
+    bool video = r->input == 0;
+    InputReader *other = ctx->is_split ? &p->readers[!r->input] : NULL;
+    AVFormatContext *input = video ? ctx->format_ctx : ctx->format_ctx2;
+    MappedFile *mapped = video ? ctx->mapped : ctx->mapped2;
+    AVPacket *packet;
+
+    double now = now_ms();
+    if (r->stall_start > 0.0) {
+        atomic_fetch_add(&r->stall_us, (long long)((now - r->stall_start) * 1000.0));
+        atomic_fetch_add(&r->stalls, 1);
+        atomic_store(&r->blocked, false);
+        r->stall_start = 0.0;
+    }
+    if (r->window_start > 0.0) {
+        atomic_fetch_add(&r->window_us, (long long)((now - r->window_start) * 1000.0));
+        atomic_fetch_add(&r->window_waits, 1);
+        r->window_start = 0.0;
+    }
+
+    int current = atomic_load_explicit(&ctx->serial, memory_order_acquire);
+    // the background scan finished, switch to its complete index
+    KeyframeIndex *ready = video ? atomic_exchange(&p->index_cache.ready, NULL) : NULL;
+    if (ready != NULL) {
+        if (!p->kf_index.complete) {
+            index_free(&p->kf_index);
+            p->kf_index = *ready;
+        } else {
+            index_free(ready);
+        }
+        av_free(ready);
+    }
+
+    if (current != r->serial) {
+        if (video) {
+            // the audio input follows to where the video actually went
+            r->seek_ts = seek_inputs(ctx, atomic_load(&ctx->seek_target), atomic_load(&ctx->seek_forward));
+            atomic_store(&r->seek_serial, current);
+        } else {
+            InputReader *v = &p->readers[0];
+            // seeked again since the step was taken
+            if (atomic_load(&v->seek_serial) != current) return;
+            int ret = av_seek_frame(input, -1, v->seek_ts, AVSEEK_FLAG_BACKWARD);
+            if (ret < 0) WARN("seeking audio, %s", av_err2str(ret));
+        }
+        av_packet_unref(r->pending);
+        r->has_pending = false;
+        r->done = false;
+        r->seeked = true;
+        r->serial = current;
+        atomic_store(&r->dts, AV_NOPTS_VALUE);
+    }
+
+    if (reader_state(r) != READER_RUN) {
+        // changed since the step was taken
+    } else if (r->done && !r->has_pending) {
+        // a full pass from the start has seen every keyframe
+        if (video && !r->seeked) p->kf_index.complete = true;
+        atomic_store(&r->eof_serial, r->serial);
+        // the stream ends with the last input
+        if (other == NULL || atomic_load(&other->eof_serial) == r->serial)
+            atomic_store(&ctx->io_eof_serial, r->serial);
+        // the decoders drain, the other reader stops waiting on this one
+        QUEUE_WAKE(task_pool);
+    } else {
+        if (!r->has_pending) {
+            double start = now_ms();
+            if (mapped != NULL && mapped->zero_copy) mapped->defer = true;
+            int ret = av_read_frame(input, r->pending);
+            bool zero_copy = mapped != NULL && mapped->zero_copy && map_zero_copy(mapped, r->pending, ret >= 0);
+            record_stage(p, STAGE_DEMUX, start);
+            trace_span("av_read_frame", start);
+            atomic_fetch_add(&r->read_us, (long long)((now_ms() - start) * 1000.0));
+            if (ret == AVERROR_EOF) {
+                r->done = true;
+            } else if (ret < 0) {
+                // the next step tries again
+                WARN("reading frame, %s", av_err2str(ret));
+            } else {
+                r->pending->opaque = (void *)(intptr_t)r->serial;
+                r->has_pending = true;
+                PacketQueue *queue = route_packet(ctx, r->input, r->pending);
+                if (queue != NULL && !zero_copy && r->pending->buf != NULL)
+                    packet_pool_move(r, queue == &p->a_packets, r->pending);
+                atomic_fetch_add(&r->packets, 1);
+                atomic_fetch_add(&r->bytes, r->pending->size);
+                startup_mark(p, PHASE_FIRST_PACKET);
+                if (r->pending->dts != AV_NOPTS_VALUE) {
+                    AVStream *stream = input->streams[r->pending->stream_index];
+                    int64_t dts = av_rescale_q(r->pending->dts, stream->time_base, AV_TIME_BASE_Q);
+                    if (input->start_time != AV_NOPTS_VALUE) dts -= input->start_time;
+                    atomic_store(&r->dts, dts);
+                }
+            }
+        }
+
+        PacketQueue *queue = r->has_pending ? route_packet(ctx, r->input, r->pending) : NULL;
+        if (r->has_pending && queue == NULL) {
+            av_packet_unref(r->pending);
+            r->has_pending = false;
+        } else if (queue != NULL && !QUEUE_FULL((*queue))) {
+            if (queue == &p->v_packets && (r->pending->flags & AV_PKT_FLAG_KEY)) {
+                int64_t pts = r->pending->pts != AV_NOPTS_VALUE ? r->pending->pts : r->pending->dts;
+                if (pts != AV_NOPTS_VALUE) index_add(&p->kf_index, pts, r->pending->pos);
+            }
+            AVRational time_base = input->streams[r->pending->stream_index]->time_base;
+            QUEUE_BACK((*queue), packet);
+            av_packet_move_ref(packet, r->pending);
+            QUEUE_INC((*queue), packet_bytes(packet), packet_duration(packet, time_base));
+            r->has_pending = false;
+        }
+    }
+
+    // the wait lasts until a queue or the other reader lets it go on
+    ReaderState state = reader_state(r);
+    if (state == READER_STALL) {
+        r->stall_start = now_ms();
+        // the other reader stops waiting on this one
+        atomic_store(&r->blocked, true);
+        if (other != NULL) QUEUE_WAKE(task_pool);
+    } else if (state == READER_WINDOW) {
+        r->window_start = now_ms();
+    }
+}
+
+void reader_init(InputReader *r, VideoContext *ctx, int input)
+{
+    r->input = input;
+    r->ctx = ctx;
+    atomic_store(&r->dts, AV_NOPTS_VALUE);
+    atomic_store(&r->blocked, false);
+    atomic_store(&r->eof_serial, -1);
+    atomic_store(&r->seek_serial, -1);
+    atomic_store(&r->packets, 0);
+    atomic_store(&r->bytes, 0);
+    atomic_store(&r->read_us, 0);
+    atomic_store(&r->stalls, 0);
+    atomic_store(&r->stall_us, 0);
+    atomic_store(&r->window_waits, 0);
+    atomic_store(&r->window_us, 0);
+    r->pending = av_packet_alloc();
+    if (r->pending == NULL) ERROR("out of memory");
+    r->has_pending = r->done = r->seeked = false;
+    // a later item of a playlist starts out under the serial of the one before
+    r->serial = atomic_load(&ctx->serial);
+    r->stall_start = r->window_start = 0.0;
+}
+
+void reader_free(InputReader *r)
+{
+    av_packet_free(&r->pending);
+    for (int i = 0; i < 2; i++) {
+        av_buffer_pool_uninit(&r->packet_pools[i]);
+        r->packet_pool_size[i] = 0;
+    }
+}
+
+// returns false if the decoder could not accept the packet yet, in which case
+// the caller must keep it and retry once the frame queue has space
+bool decode(AVPacket *packet, FrameQueue *queue, AVCodecContext *codec_ctx, int serial,
+            bool *done, int *received)
+{
+    int ret;
+    double start = trace_now();
+    ret = avcodec_send_packet(codec_ctx, packet);
+    trace_span("avcodec_send_packet", start);
+    bool sent = ret != AVERROR(EAGAIN);
+    if (ret != 0 && ret != AVERROR_EOF && sent) {
+        WARN("sending packet, %s", av_err2str(ret));
+        return true;
+    }
+    AVFrame *frame;
+    QUEUE_BACK((*queue), frame);
+    while (!QUEUE_FULL((*queue))) {
+        start = trace_now();
+        ret = avcodec_receive_frame(codec_ctx, frame);
+        trace_span("avcodec_receive_frame", start);
+        if (ret != 0) break;
+        frame->opaque = (void *)(intptr_t)serial;
+        (*received)++;
+        QUEUE_INC((*queue), frame_bytes(frame), frame_duration(frame, codec_ctx));
+        QUEUE_BACK((*queue), frame);
+    }
+    if (ret == AVERROR_EOF) {
+        // stream done
+        *done = true;
+    } else if (ret < 0 && ret != AVERROR(EAGAIN)) {
+        WARN("receiving frame, %s", av_err2str(ret));
+    }
+    return sent;
+}
+
+// whether a step of the decoder would get anywhere
+bool decoder_ready(JPlayer *p, Decoder *d)
+{
+    VideoContext *ctx = &p->ctx;
+    int current = atomic_load_explicit(&ctx->serial, memory_order_acquire);
+    bool io_done = atomic_load(&ctx->io_eof_serial) == current;
+    bool packet = !QUEUE_EMPTY((*d->packets));
+    // read before the last seek, only dropped
+    if (packet && PACKET_SERIAL(QUEUE_PEEK((*d->packets))) != current) return true;
+    // first data after a seek flushes the decoder
+    if (d->serial != current && (packet || io_done)) return true;
+    if (d->done) return false;
+    // over the memory limit only decode while the frames are about to run dry
+    if (QUEUE_FULL((*d->frames)) || (OVER_MEMORY_LIMIT() && !QUEUE_LOW((*d->frames)))) return false;
+    return packet || io_done;
+}
+
+// Decode one packet of a stream from its packet queue into its frame queue,
+// or drain the decoder once the input is done.
+void decoder_step(JPlayer *p, Decoder *d)
+{
+    VideoContext *ctx = &p->ctx;
+    AVCodecContext *codec_ctx = d->video ? ctx->v_ctx : ctx->a_ctx;
+    int current = atomic_load_explicit(&ctx->serial, memory_order_acquire);
+    // the decoder options are only safe to change between calls, which never overlap
+    if (d->video && atomic_load(&ctx->skip_level) != d->skip_level) {
+        d->skip_level = atomic_load(&ctx->skip_level);
+        codec_ctx->skip_frame = skip_levels[d->skip_level].frame;
+        codec_ctx->skip_loop_filter = skip_levels[d->skip_level].loop_filter;
+    }
+    // check io before the queue so the last packet can't be missed
+    bool io_done = atomic_load(&ctx->io_eof_serial) == current;
+
+    AVPacket *packet = NULL;
+    if (!QUEUE_EMPTY((*d->packets))) {
+        packet = QUEUE_PEEK((*d->packets));
+        // read before the last seek
+        if (PACKET_SERIAL(packet) != current) {
+            av_packet_unref(packet);
+            QUEUE_POP((*d->packets));
+            return;
+        }
+    }
+
+    // first data after a seek, forget everything buffered in the decoder
+    if (d->serial != current && (packet != NULL || io_done)) {
+        avcodec_flush_buffers(codec_ctx);
+        d->serial = current;
+        d->done = false;
+    }
+
+    if (d->done) return;
+    if (QUEUE_FULL((*d->frames)) || (OVER_MEMORY_LIMIT() && !QUEUE_LOW((*d->frames)))) return;
+
+    if (packet != NULL) {
+        double start = now_ms();
+        int received = 0;
+        bool sent = decode(packet, d->frames, codec_ctx, d->serial, &d->done, &received);
+        record_stage(p, d->stage, start);
+        if (d->video) {
+            if (sent) atomic_fetch_add(&p->late_stats.packets, 1);
+            atomic_fetch_add(&p->late_stats.frames, received);
+            if (received > 0) startup_mark(p, PHASE_FIRST_DECODED);
+        }
+        if (sent) {
+            av_packet_unref(packet);
+            QUEUE_POP((*d->packets));
+        }
+    } else if (io_done && d->serial == current) {
+        // drain the frames still buffered in the decoder
+        int received = 0;
+        decode(NULL, d->frames, codec_ctx, d->serial, &d->done, &received);
+        if (d->video) atomic_fetch_add(&p->late_stats.frames, received);
+    }
+
+    if (d->done) {
+        atomic_store(d->eof_serial, d->serial);
+        QUEUE_WAKE((*d->frames));
+    }
+}
+
+// presentation time in seconds on the playback timeline
+double frame_time(VideoContext *ctx, AVFrame *frame, AVRational time_base)
+{
+    int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ?
+        frame->best_effort_timestamp : frame->pts;
+    return pts * av_q2d(time_base) - ctx->start_time + ctx->offset;
+}
+
+// drop the frames at the head of the queue that were decoded before a seek,
+// converted frames keep their buffers for reuse
+void drop_stale_frames(VideoContext *ctx, FrameQueue *queue, bool unref)
+{
+    int serial = atomic_load(&ctx->serial);
+    while (!QUEUE_EMPTY((*queue))) {
+        AVFrame *frame = QUEUE_PEEK((*queue));
+        if (FRAME_SERIAL(frame) == serial) break;
+        if (unref) av_frame_unref(frame);
+        QUEUE_POP((*queue));
+    }
+}
+
+// Frames before the seek target were only decoded to get there, and frames
+// the master clock has already passed would only be shown late. Neither is
+// worth converting. A video master can't fall behind.
+bool convert_skip(VideoContext *ctx, AVFrame *frame, bool *preroll)
+{
+    int serial = atomic_load(&ctx->serial);
+    double ts = frame_time(ctx, frame, ctx->v_ctx->time_base);
+    double end = ts + frame_duration(frame, ctx->v_ctx) / (double)AV_TIME_BASE;
+    bool timed = frame->best_effort_timestamp != AV_NOPTS_VALUE || frame->pts != AV_NOPTS_VALUE;
+    *preroll = timed && serial > 0 && end <= atomic_load(&ctx->seek_target);
+    bool late = timed && sync_master != SYNC_VIDEO && !atomic_load(&ctx->paused) && !atomic_load(&ctx->step_frame) &&
+        ts < ctx->clock - LATE_THRESHOLD;
+    return *preroll || late;
+}
+
+// whether a step of the conversion would get anywhere
+bool converter_ready(JPlayer *p)
+{
+    if (QUEUE_EMPTY(p->v_queue)) return false;
+    AVFrame *next = QUEUE_PEEK(p->v_queue);
+    bool preroll;
+    // stale and skipped frames are only dropped
+    if (FRAME_SERIAL(next) != atomic_load(&p->ctx.serial) || convert_skip(&p->ctx, next, &preroll)) return true;
+    return !QUEUE_FULL(p->rgb_queue);
+}
+
+// Conversion stage between v_queue and the renderer, so the main thread only
+// has to upload a ready buffer. A step converts or drops one frame.
+void converter_step(JPlayer *p)
+{
+    VideoContext *ctx = &p->ctx;
+    Converter *c = &p->converter;
+    drop_stale_frames(ctx, &p->v_queue, true);
+    double now = now_ms() / 1000.0;
+    int level = atomic_load(&ctx->skip_level);
+    if (level > 0 && now - c->last_drop >= SKIP_RECOVER && now - c->level_since >= SKIP_RECOVER) {
+        atomic_store(&ctx->skip_level, --level);
+        c->level_since = now;
+        LOG("caught up, video skip level %d", level);
+    }
+    if (QUEUE_EMPTY(p->v_queue)) return;
+
+    AVFrame *next = QUEUE_PEEK(p->v_queue);
+    bool preroll;
+    if (convert_skip(ctx, next, &preroll)) {
+        av_frame_unref(next);
+        QUEUE_POP(p->v_queue);
+        if (preroll) return;
+        atomic_fetch_add(&p->late_stats.dropped, 1);
+        if (now - c->last_drop > SKIP_HOLD) c->drops = 0;
+        c->last_drop = now;
+        // still behind, make the decoder do less
+        if (++c->drops >= SKIP_ESCALATE_DROPS && level + 1 < SKIP_LEVELS &&
+            now - c->level_since >= SKIP_HOLD) {
+            atomic_store(&ctx->skip_level, ++level);
+            c->level_since = now;
+            c->drops = 0;
+            LOG("falling behind, video skip level %d", level);
+        }
+        return;
+    }
+    if (QUEUE_FULL(p->rgb_queue)) return;
+
+    AVFrame *frame = next;
+    double ts = frame_time(ctx, frame, ctx->v_ctx->time_base);
+    AVFrame *out;
+    QUEUE_BACK(p->rgb_queue, out);
+    double start = now_ms();
+    if (render_yuv && yuv_frame_supported(frame)) {
+        // the renderer takes the decoded planes and converts them while drawing
+        av_frame_unref(out);
+        if (av_frame_ref(out, frame) < 0) ERROR("Failed to reference frame");
+    } else {
+        // follow the size the renderer asked for, buffers are resized as they come around
+        int width, height;
+        output_size(ctx, &width, &height);
+        update_sws_context(ctx, frame, width, height);
+        if ((out->format != AV_PIX_FMT_RGB24 || out->width != width || out->height != height) &&
+            !alloc_rgb_frame(out, width, height))
+            ERROR("Failed to allocate image buffer");
+        if (sws_scale_frame(ctx->sws_ctx, out, frame) < 0) WARN("converting frame");
+        trace_span("sws_scale_frame", start);
+    }
+    record_stage(p, STAGE_CONVERT, start);
+    // converted frames can outlive the item they came from, so they carry
+    // their time on the playback timeline in AV_TIME_BASE
+    out->pts = ts * AV_TIME_BASE;
+    out->opaque = frame->opaque;
+
+    // publish before popping so the frame is always in one of the queues
+    QUEUE_INC(p->rgb_queue, 0, 0);
+    av_frame_unref(frame);
+    QUEUE_POP(p->v_queue);
+}
+
+// skip everything written so far, the position only moves forward since
+// seeks and the resample thread both set it
+void pcm_discard(PcmRing *r)
+{
+    int64_t pos = atomic_load(&r->write_pos);
+    int64_t discard = atomic_load(&r->discard_pos);
+    while (discard < pos && !atomic_compare_exchange_weak(&r->discard_pos, &discard, pos)) {}
+}
+
+#define ANCHOR_WRITE(R, BODY) ({ \
+    unsigned __seq = atomic_load_explicit(&(R)->anchor_seq, memory_order_relaxed); \
+    atomic_store_explicit(&(R)->anchor_seq, __seq + 1, memory_order_relaxed); \
+    atomic_thread_fence(memory_order_release); \
+    BODY; \
+    atomic_store_explicit(&(R)->anchor_seq, __seq + 2, memory_order_release); \
+})
+
+void anchor_set(PcmRing *r, int i, int64_t pos, int64_t samples)
+{
+    atomic_store_explicit(&r->anchors[i].pos, pos, memory_order_relaxed);
+    atomic_store_explicit(&r->anchors[i].samples, samples, memory_order_relaxed);
+}
+
+// Restart the clock at samples from whatever is written next, the reader
+// skips everything buffered before it. Called by the resample thread when the
+// first audio of a serial arrives, until then audio_time holds the seek target.
+void pcm_flush(PcmRing *r, int64_t samples, int serial)
+{
+    int64_t pos = atomic_load(&r->write_pos);
+    ANCHOR_WRITE(r, {
+        anchor_set(r, 0, pos, samples);
+        atomic_store_explicit(&r->anchor_start, 0, memory_order_relaxed);
+        atomic_store_explicit(&r->anchor_count, 1, memory_order_relaxed);
+    });
+    atomic_store(&r->anchor_serial, serial);
+    pcm_discard(r);
+}
+
+// Media time of the next frame written. Anchors the device has played past
+// are retired first, what pcm_played can still return is at most the last
+// callback's two periods, the limiter's delay and -audio-latency behind
+// read_pos. If the anchors are still full the previous anchor carries on and
+// only the resampler's stretching goes unaccounted.
+void pcm_mark(JPlayer *p, int64_t samples)
+{
+    int64_t oldest = atomic_load(&p->pcm.read_pos) - 2 * atomic_load(&p->pcm.cb_frames) -
+        p->dsp.delay_frames - (int64_t)audio_latency_ms * p->pcm.sample_rate / 1000;
+    int start = atomic_load_explicit(&p->pcm.anchor_start, memory_order_relaxed);
+    int count = atomic_load_explicit(&p->pcm.anchor_count, memory_order_relaxed);
+    int retire = 0;
+    while (retire < count - 1 &&
+           atomic_load_explicit(&p->pcm.anchors[(start + retire + 1) % PCM_ANCHORS].pos,
+                                memory_order_relaxed) <= oldest)
+        retire++;
+    if (retire == 0 && count == PCM_ANCHORS) return;
+    int64_t pos = atomic_load(&p->pcm.write_pos);
+    ANCHOR_WRITE(&p->pcm, {
+        start = (start + retire) % PCM_ANCHORS;
+        count -= retire;
+        if (count < PCM_ANCHORS) anchor_set(&p->pcm, (start + count++) % PCM_ANCHORS, pos, samples);
+        atomic_store_explicit(&p->pcm.anchor_start, start, memory_order_relaxed);
+        atomic_store_explicit(&p->pcm.anchor_count, count, memory_order_relaxed);
+    });
+}
+
+// the newest anchor at or before pos, or the oldest one if pos is before all
+// of them, retried while the resample thread changes them
+void pcm_anchor(PcmRing *r, double pos, int64_t *anchor_pos, int64_t *anchor_samples)
+{
+    unsigned seq;
+    do {
+        seq = atomic_load_explicit(&r->anchor_seq, memory_order_acquire);
+        int start = atomic_load_explicit(&r->anchor_start, memory_order_relaxed);
+        int count = atomic_load_explicit(&r->anchor_count, memory_order_relaxed);
+        if (count < 1 || count > PCM_ANCHORS) count = 1;
+        // positions grow along the anchors
+        int lo = 0, hi = count - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (atomic_load_explicit(&r->anchors[(start + mid) % PCM_ANCHORS].pos,
+                                     memory_order_relaxed) <= pos)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        int i = (start + lo) % PCM_ANCHORS;
+        *anchor_pos = atomic_load_explicit(&r->anchors[i].pos, memory_order_relaxed);
+        *anchor_samples = atomic_load_explicit(&r->anchors[i].samples, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&r->anchor_seq, memory_order_relaxed));
+}
+
+// frames written but not yet handed to the device
+int64_t pcm_buffered(PcmRing *r)
+{
+    int64_t read = atomic_load(&r->read_pos);
+    int64_t discard = atomic_load(&r->discard_pos);
+    return atomic_load(&r->write_pos) - (read > discard ? read : discard);
+}
+
+// media time in samples of a ring position
+double pcm_media_samples(PcmRing *r, double pos)
+{
+    int64_t anchor_pos, samples;
+    pcm_anchor(r, pos, &anchor_pos, &samples);
+    return pos > anchor_pos ? samples + pos - anchor_pos : samples;
+}
+
+// Ring position that is audible right now. The device still holds what it
+// pulled in the last callback and about as much again in its own buffer, on
+// top of the limiter's delay and -audio-latency. Between callbacks the position follows the system
+// clock, at most one callback ahead.
+double pcm_played(VideoContext *ctx, double now)
+{
+    JPlayer *p = ctx->player;
+    unsigned seq;
+    int64_t pos;
+    double time;
+    int frames;
+    do {
+        seq = atomic_load_explicit(&p->pcm.cb_seq, memory_order_acquire);
+        pos = atomic_load_explicit(&p->pcm.cb_pos, memory_order_relaxed);
+        time = atomic_load_explicit(&p->pcm.cb_time, memory_order_relaxed);
+        frames = atomic_load_explicit(&p->pcm.cb_frames, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&p->pcm.cb_seq, memory_order_relaxed));
+
+    double rate = p->pcm.sample_rate;
+    double since = 0.0;
+    if (time > 0.0) {
+        // the device doesn't pull while paused
+        since = (ctx->paused ? ctx->paused_at : now) - time;
+        if (!ctx->paused && time < ctx->resumed_at) since -= ctx->resumed_at - ctx->paused_at;
+        if (since < 0.0) since = 0.0;
+        if (since > frames / rate) since = frames / rate;
+    }
+    return pos - 2.0*frames - p->dsp.delay_frames - audio_latency_ms * rate / 1000.0 + since * rate;
+}
+
+// what is audible right now, in seconds from the start of the file, the
+// target of a seek until its first audio restarts the anchors
+double audio_time(VideoContext *ctx, double now)
+{
+    PcmRing *r = &ctx->player->pcm;
+    if (atomic_load(&r->anchor_serial) != atomic_load(&ctx->serial))
+        return atomic_load(&ctx->seek_target);
+    return pcm_media_samples(r, pcm_played(ctx, now)) / r->sample_rate;
+}
+
+double master_time(VideoContext *ctx, double now)
+{
+    switch (sync_master) {
+    case SYNC_VIDEO: return clock_get(&ctx->video_clock, now);
+    case SYNC_EXTERNAL: return clock_get(&ctx->ext_clock, now);
+    default: return audio_time(ctx, now);
+    }
+}
+
+// Runs on the audio device thread so it never blocks, whatever the ring can't
+// provide is padded with silence.
+void pcm_callback(JPlayer *p, void *buffer, unsigned int frames)
+{
+    // the device thread is only known once it calls
+    if (trace_buf == NULL) trace_thread("audio device");
+    double trace_start = trace_now();
+    float *out = buffer;
+    int channels = p->pcm.channels;
+    int64_t read = atomic_load_explicit(&p->pcm.read_pos, memory_order_relaxed);
+    int64_t discard = atomic_load(&p->pcm.discard_pos);
+    if (read < discard) read = discard;
+    int64_t n = atomic_load_explicit(&p->pcm.write_pos, memory_order_acquire) - read;
+    if (n > frames) n = frames;
+
+    for (int64_t done = 0; done < n;) {
+        int i = (read + done) % p->pcm.cap;
+        int64_t count = n - done < p->pcm.cap - i ? n - done : p->pcm.cap - i;
+        memcpy(out + done*channels, p->pcm.data + (int64_t)i*channels, count*channels*sizeof(float));
+        done += count;
+    }
+    if (n < frames) {
+        memset(out + n*channels, 0, (frames - n)*channels*sizeof(float));
+        if (!atomic_load(&p->pcm.ended)) atomic_fetch_add(&p->pcm.underruns, 1);
+    }
+    atomic_store_explicit(&p->pcm.read_pos, read + n, memory_order_release);
+    // pairs with the writer's fence between setting writer_waiting and checking for space
+    atomic_thread_fence(memory_order_seq_cst);
+    if (n > 0) pcm_wake(&p->pcm);
+    dsp_process(&p->dsp, out, frames, channels);
+
+    unsigned seq = atomic_load_explicit(&p->pcm.cb_seq, memory_order_relaxed);
+    atomic_store_explicit(&p->pcm.cb_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&p->pcm.cb_pos, read + n, memory_order_relaxed);
+    atomic_store_explicit(&p->pcm.cb_time, now_ms() / 1000.0, memory_order_relaxed);
+    atomic_store_explicit(&p->pcm.cb_frames, frames, memory_order_relaxed);
+    atomic_store_explicit(&p->pcm.cb_seq, seq + 2, memory_order_release);
+    trace_span("pcm_callback", trace_start);
+}
+
+// Copy frames into the ring, parking until the device makes room. Gives up
+// when a seek makes the audio stale.
+bool pcm_write(VideoContext *ctx, float *data, int frames, int serial)
+{
+    JPlayer *p = ctx->player;
+    int channels = p->pcm.channels;
+    double full_since = 0.0;
+    double ring_ms = 1000.0 * p->pcm.cap / p->pcm.sample_rate;
+
+    while (frames > 0) {
+        if (ctx->quit || atomic_load(&ctx->serial) != serial) return false;
+        int64_t write = atomic_load_explicit(&p->pcm.write_pos, memory_order_relaxed);
+        int64_t read = atomic_load_explicit(&p->pcm.read_pos, memory_order_acquire);
+        int64_t space = p->pcm.cap - (write - read);
+        if (space <= 0) {
+            double now = now_ms();
+            if (ctx->paused || full_since == 0.0) {
+                full_since = now;
+            } else if (full_since > 0.0 && now - full_since > ring_ms) {
+                atomic_fetch_add(&p->pcm.overruns, 1);
+                full_since = -1.0; // once per stall
+            }
+            // the callback posts once it sees the flag, after it moved read_pos
+            atomic_store(&p->pcm.writer_waiting, true);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load(&p->pcm.read_pos) == read && !ctx->quit && atomic_load(&ctx->serial) == serial) {
+                // bounded, the device doesn't pull while paused
+                struct timespec t;
+                clock_gettime(CLOCK_REALTIME, &t);
+                t.tv_nsec += QUEUE_PARK_MS * 1000000L;
+                if (t.tv_nsec >= 1000000000L) {
+                    t.tv_sec++;
+                    t.tv_nsec -= 1000000000L;
+                }
+                while (sem_timedwait(&p->pcm.space, &t) != 0 && errno == EINTR) {}
+            }
+            atomic_store(&p->pcm.writer_waiting, false);
+            continue;
+        }
+
+        int i = write % p->pcm.cap;
+        int64_t count = frames < space ? frames : space;
+        if (count > p->pcm.cap - i) count = p->pcm.cap - i;
+        memcpy(p->pcm.data + (int64_t)i*channels, data, count*channels*sizeof(float));
+        atomic_store_explicit(&p->pcm.write_pos, write + count, memory_order_release);
+        data += count*channels;
+        frames -= count;
+    }
+    return true;
+}
+
+// Audio stage between a_queue and the device, keeps the PCM ring topped up so
+// the callback never waits on the decoder or the render loop.
+void *resample_thread_func(void *arg)
+{
+    VideoContext *ctx = (VideoContext *)arg;
+    JPlayer *p = ctx->player;
+    player_thread(p, "resample");
+    PIPELINE_CATCH(p);
+    int sample_rate = p->pcm.sample_rate;
+    float *buffer = NULL;
+    int buffer_frames = 0;
+    // a later item of a playlist carries on from the audio of the one before
+    int clock_serial = p->playlist_index > 0 ? atomic_load(&ctx->serial) : -1;
+
+    while (!ctx->quit) {
+        drop_stale_frames(ctx, &p->a_queue, true);
+        int serial = atomic_load(&ctx->serial);
+        if (QUEUE_EMPTY(p->a_queue)) {
+            bool eof = atomic_load(&ctx->a_eof_serial) == serial;
+            if (eof) atomic_store(&p->pcm.ended, true);
+            QUEUE_WAIT_UNTIL(p->a_queue, !QUEUE_EMPTY(p->a_queue) || ctx->quit ||
+                             atomic_load(&ctx->serial) != serial ||
+                             (!eof && atomic_load(&ctx->a_eof_serial) == serial));
+            continue;
+        }
+
+        AVFrame *frame = QUEUE_PEEK(p->a_queue);
+        if (FRAME_SERIAL(frame) != serial) continue;
+        double start = now_ms();
+
+        // Stretch or squeeze the audio toward the master when it isn't the
+        // master, a few percent of a frame at a time so it stays inaudible
+        int correction = 0;
+        if (sync_master != SYNC_AUDIO) {
+            double drift = atomic_load(&ctx->audio_drift);
+            if (fabs(drift) > SYNC_THRESHOLD && fabs(drift) < SYNC_NOSYNC) {
+                int max = frame->nb_samples * SYNC_MAX_CORRECTION;
+                correction = av_clip(drift * sample_rate, -max, max);
+            }
+            if (swr_set_compensation(ctx->swr_ctx, correction, frame->nb_samples) < 0)
+                correction = 0;
+            atomic_fetch_add(&p->sync_stats.corrected_samples, abs(correction));
+        }
+
+        int out_frames = swr_get_out_samples(ctx->swr_ctx, frame->nb_samples) + abs(correction);
+        if (out_frames > buffer_frames) {
+            av_free(buffer);
+            buffer_frames = out_frames;
+            buffer = av_malloc_array(buffer_frames, p->pcm.channels * sizeof(float));
+            if (buffer == NULL) ERROR("out of memory");
+        }
+        uint8_t *out = (uint8_t *)buffer;
+        int n = swr_convert(ctx->swr_ctx, &out, buffer_frames,
+                            (const uint8_t **)frame->data, frame->nb_samples);
+        record_stage(p, STAGE_RESAMPLE, start);
+        trace_span("swr_convert", start);
+        if (n < 0) {
+            WARN("resampling, %s", av_err2str(n));
+            n = 0;
+        }
+
+        // first audio after a seek restarts the clock, later frames keep it
+        // in step with their timestamps
+        double t = frame_time(ctx, frame, ctx->a_ctx->pkt_timebase);
+        int64_t samples = t > 0.0 ? t * sample_rate : 0;
+        if (clock_serial != serial) {
+            clock_serial = serial;
+            pcm_flush(&p->pcm, samples, serial);
+        } else if (frame->pts != AV_NOPTS_VALUE || frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+            pcm_mark(p, samples);
+        }
+        atomic_store(&p->pcm.ended, false);
+        loudness_process(&p->loudness, buffer, n);
+        normalize_update(p);
+        if (!pcm_write(ctx, buffer, n, serial)) continue;
+
+        p->bench.audio_frames++;
+        p->bench.audio_samples += frame->nb_samples;
+        av_frame_unref(frame);
+        QUEUE_POP(p->a_queue);
+    }
+    av_free(buffer);
+    return NULL;
+}
+
+// whether a step of t would get anywhere, under the pool's lock
+bool task_ready(Task *t)
+{
+    JPlayer *p = t->player;
+    if (p->ctx.quit) return false;
+    switch (t->kind) {
+    case TASK_CONVERT: return converter_ready(p);
+    case TASK_VIDEO_DECODE: return decoder_ready(p, &p->decoders[0]);
+    case TASK_AUDIO_DECODE: return decoder_ready(p, &p->decoders[1]);
+    case TASK_READ_VIDEO: return reader_state(&p->readers[0]) == READER_RUN;
+    case TASK_READ_AUDIO: return reader_state(&p->readers[1]) == READER_RUN;
+    default: return false;
+    }
+}
+
+// one step of t, an ERROR in it fails the player instead of the process
+void task_run(Task *t)
+{
+    JPlayer *p = t->player;
+    quiet = p->quiet;
+    jmp_buf env;
+    if (setjmp(env)) {
+        error_jmp = NULL;
+        player_fail(p, error_message);
+        return;
+    }
+    error_jmp = &env;
+    switch (t->kind) {
+    case TASK_CONVERT: converter_step(p); break;
+    case TASK_VIDEO_DECODE: decoder_step(p, &p->decoders[0]); break;
+    case TASK_AUDIO_DECODE: decoder_step(p, &p->decoders[1]); break;
+    case TASK_READ_VIDEO: reader_step(&p->readers[0]); break;
+    case TASK_READ_AUDIO: reader_step(&p->readers[1]); break;
+    default: break;
+    }
+    error_jmp = NULL;
+}
+
+// a runnable task for the worker, its own first and then stolen, starting
+// somewhere else for every worker so they don't all go for the same one
+Task *pool_claim(int worker)
+{
+    TaskPool *pool = &task_pool;
+    Task *claimed = NULL;
+    pthread_mutex_lock(&pool->lock);
+    int from = worker * pool->count / pool->worker_count;
+    for (int pass = 0; pass < 2 && claimed == NULL; pass++) {
+        for (int k = 0; k < pool->count; k++) {
+            Task *t = pool->tasks[pass == 0 ? k : (from + k) % pool->count];
+            if (t->busy || (t->owner == worker) != (pass == 0) || !task_ready(t)) continue;
+            t->busy = true;
+            claimed = t;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return claimed;
+}
+
+// hand a stepped task back
+void pool_return(Task *t)
+{
+    pthread_mutex_lock(&task_pool.lock);
+    t->busy = false;
+    if (t->removed) pthread_cond_broadcast(&task_pool.released);
+    pthread_mutex_unlock(&task_pool.lock);
+}
+
+bool pool_any_ready(void)
+{
+    bool ready = false;
+    pthread_mutex_lock(&task_pool.lock);
+    for (int i = 0; i < task_pool.count && !ready; i++)
+        ready = !task_pool.tasks[i]->busy && task_ready(task_pool.tasks[i]);
+    pthread_mutex_unlock(&task_pool.lock);
+    return ready;
+}
+
+void *pool_worker_func(void *arg)
+{
+    int worker = (int)(intptr_t)arg;
+    trace_thread("worker");
+    while (true) {
+        Task *t = pool_claim(worker);
+        if (t == NULL) {
+            if (atomic_load(&task_pool.quit)) break;
+            QUEUE_WAIT_UNTIL(task_pool, pool_any_ready() || atomic_load(&task_pool.quit));
+            continue;
+        }
+        task_run(t);
+        pool_return(t);
+    }
+    return NULL;
+}
+
+// A player holds the pool from opening to closing, the workers start with
+// the first and stop with the last.
+void pool_acquire(void)
+{
+    TaskPool *pool = &task_pool;
+    pthread_mutex_lock(&pool->users_mutex);
+    if (pool->users == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        int count = cores < 1 ? 1 : cores;
+        pool->workers = av_calloc(count, sizeof(pthread_t));
+        if (pool->workers == NULL) {
+            pthread_mutex_unlock(&pool->users_mutex);
+            ERROR("out of memory");
+        }
+        pool->worker_count = count;
+        atomic_store(&pool->quit, false);
+        for (int i = 0; i < count; i++)
+            pthread_create(&pool->workers[i], NULL, pool_worker_func, (void *)(intptr_t)i);
+        LOG("task pool of %d workers", count);
+    }
+    pool->users++;
+    pthread_mutex_unlock(&pool->users_mutex);
+}
+
+void pool_release(void)
+{
+    TaskPool *pool = &task_pool;
+    pthread_mutex_lock(&pool->users_mutex);
+    if (--pool->users == 0) {
+        atomic_store(&pool->quit, true);
+        QUEUE_WAKE(task_pool);
+        for (int i = 0; i < pool->worker_count; i++) pthread_join(pool->workers[i], NULL);
+        av_freep(&pool->workers);
+        av_freep(&pool->tasks);
+        pool->cap = pool->worker_count = 0;
+    }
+    pthread_mutex_unlock(&pool->users_mutex);
+}
+
+// put the stages of p on the pool, all owned by the same worker
+void pool_add(JPlayer *p)
+{
+    TaskPool *pool = &task_pool;
+    VideoContext *ctx = &p->ctx;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count + TASK_COUNT > pool->cap) {
+        int cap = pool->cap ? pool->cap * 2 : 64;
+        Task **tasks = av_realloc_array(pool->tasks, cap, sizeof(*tasks));
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            ERROR("out of memory");
+        }
+        pool->tasks = tasks;
+        pool->cap = cap;
+    }
+    int owner = pool->next_owner++ % pool->worker_count;
+    for (TaskKind kind = 0; kind < TASK_COUNT; kind++) {
+        if ((kind == TASK_AUDIO_DECODE && ctx->no_audio) || (kind == TASK_READ_AUDIO && !ctx->is_split))
+            continue;
+        p->tasks[kind] = (Task){.player = p, .kind = kind, .owner = owner};
+        pool->tasks[pool->count++] = &p->tasks[kind];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    QUEUE_WAKE(task_pool);
+}
+
+// take the stages of p off the pool, once this returns none is being stepped
+void pool_remove(JPlayer *p)
+{
+    TaskPool *pool = &task_pool;
+    pthread_mutex_lock(&pool->lock);
+    int kept = 0;
+    for (int i = 0; i < pool->count; i++) {
+        if (pool->tasks[i]->player == p) pool->tasks[i]->removed = true;
+        else pool->tasks[kept++] = pool->tasks[i];
+    }
+    pool->count = kept;
+    for (TaskKind kind = 0; kind < TASK_COUNT; kind++) {
+        while (p->tasks[kind].busy) pthread_cond_wait(&pool->released, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void start_threads(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    // the seek index is the player's so it's set up once the item is the one playing
+    if (ctx->index_file != NULL) index_open(ctx, ctx->index_file);
+    else index_init(ctx);
+    atomic_init(&ctx->io_eof_serial, -1);
+    atomic_init(&ctx->v_eof_serial, -1);
+    atomic_init(&ctx->a_eof_serial, -1);
+    atomic_init(&ctx->skip_level, 0);
+    loudness_reset(&p->loudness);
+    ctx->video_active = true;
+    ctx->quit = false;
+
+    for (int i = 0; i < (ctx->is_split ? 2 : 1); i++) reader_init(&p->readers[i], ctx, i);
+    // the decoders may already hold the start of a prefetched item, don't flush them
+    int serial = atomic_load(&ctx->serial);
+    p->decoders[0] = (Decoder){&p->v_packets, &p->v_queue, &ctx->v_eof_serial, STAGE_VIDEO_DECODE,
+                               .video = true, .serial = serial};
+    p->decoders[1] = (Decoder){&p->a_packets, &p->a_queue, &ctx->a_eof_serial, STAGE_AUDIO_DECODE,
+                               .serial = serial};
+    p->converter = (Converter){0};
+    pool_add(p);
+    if (!ctx->no_audio) pthread_create(&ctx->r_thread, NULL, resample_thread_func, ctx);
+    if (p->index_cache.building)
+        pthread_create(&p->index_cache.thread, NULL, index_thread_func, ctx);
+    thumbs_start(ctx);
+}
+
+// take the pipeline off the pool and wait for its threads so the queues can be freed
+void stop_threads(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    ctx->quit = true;
+    pipeline_abort(p);
+    pool_remove(p);
+    for (int i = 0; i < (ctx->is_split ? 2 : 1); i++) reader_free(&p->readers[i]);
+    if (!ctx->no_audio) pthread_join(ctx->r_thread, NULL);
+    if (p->index_cache.building) {
+        pthread_join(p->index_cache.thread, NULL);
+        p->index_cache.building = false;
+        KeyframeIndex *ready = atomic_exchange(&p->index_cache.ready, NULL);
+        if (ready != NULL) index_free(ready);
+        av_free(ready);
+    }
+    thumbs_stop(p);
+}
+
+// all frames of the current serial were decoded and consumed
+bool video_finished(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    int serial = atomic_load(&ctx->serial);
+    // a frame is pushed to rgb_queue before it leaves v_queue so check v_queue first
+    return atomic_load(&ctx->v_eof_serial) == serial && QUEUE_EMPTY(p->v_queue) &&
+        QUEUE_EMPTY(p->rgb_queue);
+}
+
+bool audio_finished(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    if (ctx->no_audio) return true;
+    int serial = atomic_load(&ctx->serial);
+    // a frame is written to the ring before it leaves a_queue
+    return atomic_load(&ctx->a_eof_serial) == serial && QUEUE_EMPTY(p->a_queue) &&
+        pcm_buffered(&p->pcm) <= 0;
+}
+
+// Decode a packet of the next item into its stash, returns the frames
+// received or -1 if the decoder wants its output read first. Frames that
+// don't fit are left in the decoder for its decode task.
+int prefetch_decode(AVCodecContext *codec_ctx, AVPacket *packet, AVFrame **frames,
+                    int *count, int cap)
+{
+    int ret = avcodec_send_packet(codec_ctx, packet);
+    if (ret == AVERROR(EAGAIN)) return -1;
+    if (ret < 0) WARN("sending packet, %s", av_err2str(ret));
+    int received = 0;
+    while (*count < cap) {
+        AVFrame *frame = av_frame_alloc();
+        if (frame == NULL) ERROR("out of memory");
+        if (avcodec_receive_frame(codec_ctx, frame) != 0) {
+            av_frame_free(&frame);
+            break;
+        }
+        frames[(*count)++] = frame;
+        received++;
+    }
+    return received;
+}
+
+// what the prefetch decoded and read ahead
+void prefetch_free(Prefetch *pf)
+{
+    for (int i = 0; i < pf->video_count; i++) av_frame_free(&pf->video[i]);
+    for (int i = 0; i < pf->audio_count; i++) av_frame_free(&pf->audio[i]);
+    for (int s = 0; s < 2; s++) {
+        for (int i = 0; i < pf->packet_count[s]; i++) av_packet_free(&pf->packets[s][i]);
+    }
+    pf->video_count = pf->audio_count = pf->packet_count[0] = pf->packet_count[1] = 0;
+}
+
+// Open the next item and decode its first GOP and a little audio, then keep
+// reading until the packets past them are queued up too. Runs while the
+// current item plays.
+void *prefetch_thread_func(void *arg)
+{
+    Prefetch *pf = arg;
+    player_thread(pf->ctx.player, "prefetch");
+    VideoContext *ctx = &pf->ctx;
+    open_cancel = &pf->cancel;
+    AVPacket *packet = av_packet_alloc();
+    // a later item that doesn't open or read is skipped, it mustn't end the one playing
+    jmp_buf env;
+    if (setjmp(env)) {
+        error_jmp = NULL;
+        if (!atomic_load(&pf->cancel)) WARN("skipping %s, %s", pf->file, error_message);
+        av_packet_free(&packet);
+        prefetch_free(pf);
+        close_input(ctx);
+        atomic_store(&pf->failed, true);
+        return NULL;
+    }
+    error_jmp = &env;
+    if (packet == NULL) ERROR("out of memory");
+    init_av_streaming(ctx, pf->file, NULL);
+    init_resampler(ctx);
+
+    AVFormatContext *inputs[2] = {ctx->format_ctx, ctx->format_ctx2};
+    bool done[2] = {false, !ctx->is_split};
+    bool video_done = false, audio_done = false;
+    int64_t audio_duration = 0;
+    while (!(video_done && audio_done) && pf->packet_count[0] < PREFETCH_PACKETS &&
+           pf->packet_count[1] < PREFETCH_PACKETS && !atomic_load(&pf->cancel)) {
+        // the second input of a split stream only carries audio
+        int i = ctx->is_split && (video_done || done[0]) ? 1 : 0;
+        if (done[i]) break;
+        int ret = av_read_frame(inputs[i], packet);
+        if (ret == AVERROR_EOF) {
+            done[i] = true;
+            continue;
+        } else if (ret < 0) {
+            WARN("reading frame, %s", av_err2str(ret));
+            continue;
+        }
+        PacketQueue *queue = route_packet(ctx, i, packet);
+        if (queue == NULL) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        int stream = queue == &ctx->player->v_packets ? 0 : 1;
+        bool key = packet->flags & AV_PKT_FLAG_KEY;
+        // the next keyframe ends the first GOP
+        if (stream == 0 && key && pf->video_count > 0) video_done = true;
+        int received = -1;
+        if (stream == 0 && !video_done) {
+            int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+            if (key && pts != AV_NOPTS_VALUE && pf->key_count < PREFETCH_VIDEO_FRAMES)
+                pf->keys[pf->key_count++] = (Keyframe){pts, packet->pos, AV_NOPTS_VALUE};
+            received = prefetch_decode(ctx->v_ctx, packet, pf->video, &pf->video_count,
+                                       PREFETCH_VIDEO_FRAMES);
+            if (pf->video_count == PREFETCH_VIDEO_FRAMES) video_done = true;
+        } else if (stream == 1 && !audio_done) {
+            int first = pf->audio_count;
+            received = prefetch_decode(ctx->a_ctx, packet, pf->audio, &pf->audio_count,
+                                       PREFETCH_AUDIO_FRAMES);
+            for (int j = first; j < pf->audio_count; j++)
+                audio_duration += frame_duration(pf->audio[j], ctx->a_ctx);
+            if (audio_duration >= PREFETCH_AUDIO * AV_TIME_BASE ||
+                pf->audio_count == PREFETCH_AUDIO_FRAMES)
+                audio_done = true;
+        }
+        if (received >= 0) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        // once a stream stops decoding everything after it waits for its decode task
+        if (stream == 0) video_done = true;
+        else audio_done = true;
+        AVPacket *stashed = av_packet_alloc();
+        if (stashed == NULL) ERROR("out of memory");
+        av_packet_move_ref(stashed, packet);
+        pf->packets[stream][pf->packet_count[stream]++] = stashed;
+    }
+    error_jmp = NULL;
+    av_packet_free(&packet);
+    LOG("prefetched %s, %d video and %d audio frames decoded", pf->file,
+        pf->video_count, pf->audio_count);
+    atomic_store(&pf->ready, true);
+    return NULL;
+}
+
+void prefetch_start(VideoContext *ctx, char *file)
+{
+    JPlayer *p = ctx->player;
+    LOG("prefetching %s", file);
+    p->prefetch = (Prefetch){.file = file, .started = true};
+    p->prefetch.ctx.player = p;
+    p->prefetch.ctx.decoder_threads = ctx->decoder_threads;
+    pthread_create(&p->prefetch.thread, NULL, prefetch_thread_func, &p->prefetch);
+}
+
+// Free a prefetch that never got to play. It is always joined since it writes
+// to the player's state torn down after this, one still opening gives up at
+// its next network wait. Only a yt-dlp it is waiting on can hold this up.
+void prefetch_close(JPlayer *p)
+{
+    if (!p->prefetch.started) return;
+    atomic_store(&p->prefetch.cancel, true);
+    pthread_join(p->prefetch.thread, NULL);
+    prefetch_free(&p->prefetch);
+    close_input(&p->prefetch.ctx);
+    p->prefetch.started = false;
+}
+
+// queue what the prefetch decoded and read, in the order the decoders saw it
+void prefetch_queue(VideoContext *ctx, int serial)
+{
+    JPlayer *p = ctx->player;
+    Prefetch *pf = &p->prefetch;
+    AVFrame *frame;
+    for (int i = 0; i < pf->video_count; i++) {
+        QUEUE_BACK(p->v_queue, frame);
+        av_frame_move_ref(frame, pf->video[i]);
+        frame->opaque = (void *)(intptr_t)serial;
+        QUEUE_INC(p->v_queue, frame_bytes(frame), frame_duration(frame, ctx->v_ctx));
+        av_frame_free(&pf->video[i]);
+    }
+    for (int i = 0; i < pf->audio_count; i++) {
+        QUEUE_BACK(p->a_queue, frame);
+        av_frame_move_ref(frame, pf->audio[i]);
+        frame->opaque = (void *)(intptr_t)serial;
+        QUEUE_INC(p->a_queue, frame_bytes(frame), frame_duration(frame, ctx->a_ctx));
+        av_frame_free(&pf->audio[i]);
+    }
+
+    // the reader indexes what it reads, these were read before it started
+    for (int i = 0; i < pf->key_count; i++)
+        index_add(&p->kf_index, pf->keys[i].pts, pf->keys[i].pos);
+    PacketQueue *queues[2] = {&p->v_packets, &p->a_packets};
+    AVFormatContext *inputs[2] = {ctx->format_ctx, ctx->is_split ? ctx->format_ctx2 : ctx->format_ctx};
+    for (int s = 0; s < 2; s++) {
+        for (int i = 0; i < pf->packet_count[s]; i++) {
+            AVPacket *packet, *stashed = pf->packets[s][i];
+            if (s == 0 && (stashed->flags & AV_PKT_FLAG_KEY)) {
+                int64_t pts = stashed->pts != AV_NOPTS_VALUE ? stashed->pts : stashed->dts;
+                if (pts != AV_NOPTS_VALUE) index_add(&p->kf_index, pts, stashed->pos);
+            }
+            AVRational time_base = inputs[s]->streams[stashed->stream_index]->time_base;
+            QUEUE_BACK((*queues[s]), packet);
+            av_packet_move_ref(packet, stashed);
+            packet->opaque = (void *)(intptr_t)serial;
+            QUEUE_INC((*queues[s]), packet_bytes(packet), packet_duration(packet, time_base));
+            av_packet_free(&pf->packets[s][i]);
+        }
+    }
+}
+
+// Switch to the prefetched item once everything of the current one has left
+// the decoders. Its last frames are still converted and its audio still in
+// the ring, so the next item is queued right behind them and starts on the
+// timeline where that audio ends. The frontend's audio stream and texture
+// carry over.
+bool playlist_advance(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    if (atomic_load(&p->prefetch.failed)) {
+        // drop the item, the next update prefetches the one after it
+        pthread_join(p->prefetch.thread, NULL);
+        p->prefetch.started = false;
+        int next = p->playlist_index + 1;
+        memmove(&p->playlist[next], &p->playlist[next + 1], (p->playlist_count - next - 1) * sizeof(*p->playlist));
+        p->playlist_count--;
+        return false;
+    }
+    int serial = atomic_load(&ctx->serial);
+    bool drained = atomic_load(&ctx->v_eof_serial) == serial &&
+        atomic_load(&ctx->a_eof_serial) == serial && QUEUE_EMPTY(p->v_queue) && QUEUE_EMPTY(p->a_queue);
+    if (!drained || !atomic_load(&p->prefetch.ready)) return false;
+    pthread_join(p->prefetch.thread, NULL);
+    stop_threads(ctx);
+
+    VideoContext *next = &p->prefetch.ctx;
+    // media time of the end of what was written, from the last anchor
+    double end = pcm_media_samples(&p->pcm, atomic_load(&p->pcm.write_pos)) / p->pcm.sample_rate;
+    double first = p->prefetch.audio_count > 0 ?
+        frame_time(next, p->prefetch.audio[0], next->a_ctx->pkt_timebase) : 0.0;
+    next->offset = end - first;
+
+    // player state carries over, the item's own state starts fresh
+    atomic_init(&next->serial, serial);
+    atomic_store(&next->paused, atomic_load(&ctx->paused));
+    next->clock = ctx->clock;
+    next->video_clock = ctx->video_clock;
+    next->ext_clock = ctx->ext_clock;
+    next->paused_at = ctx->paused_at;
+    next->resumed_at = ctx->resumed_at;
+    next->display_height = ctx->display_height;
+    int height = next->v_ctx->height;
+    atomic_init(&next->out_height, bench_mode || ctx->display_height <= 0 ?
+                height : bucket_height(height, ctx->display_height));
+
+    close_input(ctx);
+    *ctx = *next;
+    p->prefetch.started = false;
+    atomic_store(&p->prefetch.ready, false);
+    index_free(&p->kf_index);
+    p->playlist_index++;
+    LOG("playing %d/%d %s", p->playlist_index + 1, p->playlist_count, p->playlist[p->playlist_index]);
+    prefetch_queue(ctx, serial);
+    start_threads(ctx);
+    return true;
+}
+
+// open the next item in time for the end of this one and hand over to it,
+// true when a new item started
+bool playlist_update(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    // a failed player stays stopped
+    if (p->playlist_index + 1 >= p->playlist_count || atomic_load(&p->failed)) return false;
+    if (p->prefetch.started) return playlist_advance(ctx);
+    // the bench has no clock to go by in fast mode, so it starts right away
+    double left = ctx->duration - (ctx->clock - ctx->offset);
+    if (bench_mode || ctx->duration <= 0.0 || left <= PLAYLIST_PREFETCH)
+        prefetch_start(ctx, p->playlist[p->playlist_index + 1]);
+    return false;
+}
+
+// Open a tile as a video only player and start it, on a thread of its own.
+// It keeps decoding on a single thread, the pool is the parallelism.
+void *wall_open_thread_func(void *arg)
+{
+    WallTile *t = arg;
+    quiet = video_wall.quiet;
+    trace_thread("wall open");
+    open_cancel = &t->cancel;
+    JPOptions options = {.decoder_threads = 1, .quiet = true, .video_only = true};
+    JPlayer *player;
+    if (jp_open(t->file, &options, &player) != JP_OK) {
+        if (!atomic_load(&t->cancel)) WARN("wall: could not open %s, %s", t->file, jp_error(NULL));
+        atomic_store(&t->state, TILE_FAILED);
+        return NULL;
+    }
+    jp_start(player);
+    t->player = player;
+    // a seek while it was opening, under the mutex so it can't slip in between
+    pthread_mutex_lock(&video_wall.mutex);
+    if (video_wall.seeked) jp_seek(player, video_wall.seek_target);
+    atomic_store(&t->state, TILE_OPEN);
+    pthread_mutex_unlock(&video_wall.mutex);
+    LOG("wall: %s %dx%d", t->file, player->info.width, player->info.height);
+    return NULL;
+}
+
+// every input after the heard one becomes a tile
+void wall_start(char **files, int count)
+{
+    VideoWall *w = &video_wall;
+    if (count <= 0) return;
+    w->tiles = av_calloc(count, sizeof(WallTile));
+    if (w->tiles == NULL) ERROR("out of memory");
+    w->count = count;
+    w->quiet = quiet;
+    w->seeked = false;
+    for (int i = 0; i < count; i++) {
+        WallTile *t = &w->tiles[i];
+        t->file = files[i];
+        t->shown_serial = -1;
+        atomic_init(&t->state, TILE_NEW);
+        atomic_init(&t->cancel, false);
+        pthread_create(&t->open_thread, NULL, wall_open_thread_func, t);
+    }
+    LOG("wall: %d more inputs", count);
+}
+
+void wall_stop(void)
+{
+    VideoWall *w = &video_wall;
+    if (w->count == 0) return;
+    for (int i = 0; i < w->count; i++) atomic_store(&w->tiles[i].cancel, true);
+    for (int i = 0; i < w->count; i++) {
+        WallTile *t = &w->tiles[i];
+        pthread_join(t->open_thread, NULL);
+        jp_close(t->player);
+    }
+    av_freep(&w->tiles);
+    w->count = 0;
+}
+
+// tiles go to the same point on their own timelines, the ones still opening
+// once they are open
+void wall_seek(double seconds)
+{
+    VideoWall *w = &video_wall;
+    pthread_mutex_lock(&w->mutex);
+    w->seeked = true;
+    w->seek_target = seconds;
+    for (int i = 0; i < w->count; i++) {
+        WallTile *t = &w->tiles[i];
+        if (atomic_load(&t->state) == TILE_OPEN) jp_seek(t->player, seconds);
+    }
+    pthread_mutex_unlock(&w->mutex);
+}
+
+// request a seek to seconds into the item, the video reader picks it up through
+// the serial. What the device has buffered is the frontend's to throw away.
+void seek_to(VideoContext *ctx, double seconds, bool forward)
+{
+    JPlayer *p = ctx->player;
+    if (ctx->duration > 0.0 && seconds > ctx->duration) seconds = ctx->duration;
+    if (seconds < 0.0) seconds = 0.0;
+    LOG("seeking to %.2fs", seconds);
+
+    seconds += ctx->offset;
+    atomic_store(&ctx->seek_target, seconds);
+    atomic_store(&ctx->seek_forward, forward);
+    atomic_fetch_add_explicit(&ctx->serial, 1, memory_order_release);
+    QUEUE_WAKE(p->v_packets);
+    QUEUE_WAKE(p->a_packets);
+    QUEUE_WAKE(p->v_queue);
+    QUEUE_WAKE(p->a_queue);
+    QUEUE_WAKE(p->rgb_queue);
+    QUEUE_WAKE(task_pool);
+
+    // show the target right away, audio_time holds it until the first audio
+    // frame restarts the anchors
+    double now = now_ms() / 1000.0;
+    pcm_discard(&p->pcm);
+    pcm_wake(&p->pcm);
+    clock_set(&ctx->video_clock, seconds, now);
+    clock_set(&ctx->ext_clock, seconds, now);
+    atomic_store(&ctx->audio_drift, 0.0);
+    ctx->clock = seconds;
+    ctx->video_active = true;
+    atomic_store(&ctx->step_frame, true);
+}
+
+// the frontend stops the device pulling while paused so the ring just holds
+// its place
+void set_paused(VideoContext *ctx, bool paused)
+{
+    if (paused == ctx->paused) return;
+    double now = now_ms() / 1000.0;
+    if (paused) ctx->paused_at = now;
+    else ctx->resumed_at = now;
+    clock_pause(&ctx->video_clock, paused, now);
+    clock_pause(&ctx->ext_clock, paused, now);
+    atomic_store(&ctx->paused, paused);
+}
+
+// a frame due at pts was just shown
+void sync_video(VideoContext *ctx, double pts, double now, bool step)
+{
+    double late = ctx->clock - pts;
+    if (!step) drift_push(&ctx->player->sync_stats.video, late);
+    // a video master keeps the lateness so it doesn't lose a tick every frame
+    bool keep = !step && late > 0.0 && late < SYNC_RESET;
+    clock_set(&ctx->video_clock, pts, keep ? now - late : now);
+}
+
+// measure the audio against the master for the resample thread to correct
+void sync_audio(VideoContext *ctx, double now)
+{
+    if (sync_master == SYNC_AUDIO || ctx->paused) return;
+    double drift = audio_time(ctx, now) - ctx->clock;
+    atomic_store(&ctx->audio_drift, drift);
+    drift_push(&ctx->player->sync_stats.audio, drift);
+}
+
+void sync_log(JPlayer *p)
+{
+    DriftStats *v = &p->sync_stats.video, *a = &p->sync_stats.audio;
+    LOG("sync %s master: video %+.1fms (sd %.1f, max %+.1f), audio %+.1fms (sd %.1f, max %+.1f), "
+        "corrected %lld samples, dropped %ld frames, skipped %ld", sync_names[sync_master],
+        drift_mean(v)*1000.0, drift_stddev(v)*1000.0, v->max*1000.0,
+        drift_mean(a)*1000.0, drift_stddev(a)*1000.0, a->max*1000.0,
+        atomic_load(&p->sync_stats.corrected_samples), atomic_load(&p->late_stats.dropped),
+        frames_skipped(p));
+}
+
+// occupancy of every stage as counter tracks, sampled once per tick
+void trace_counters(JPlayer *p)
+{
+    if (trace_path == NULL) return;
+    trace_counter("v_packets", QUEUE_SIZE(p->v_packets));
+    trace_counter("a_packets", QUEUE_SIZE(p->a_packets));
+    trace_counter("v_queue", QUEUE_SIZE(p->v_queue));
+    trace_counter("a_queue", QUEUE_SIZE(p->a_queue));
+    trace_counter("rgb_queue", QUEUE_SIZE(p->rgb_queue));
+    trace_counter("pcm frames", pcm_buffered(&p->pcm));
+    trace_counter("queued_bytes", atomic_load(&queued_bytes));
+}
+
+void init_queues(JPlayer *p)
+{
+    // packets
+    QUEUE_INIT(p->v_packets, PACKET_QUEUE_CAP, av_packet_alloc, packet_limits);
+    QUEUE_INIT(p->a_packets, PACKET_QUEUE_CAP, av_packet_alloc, packet_limits);
+    // frames
+    QUEUE_INIT(p->v_queue, VIDEO_QUEUE_CAP, av_frame_alloc, video_limits);
+    QUEUE_INIT(p->a_queue, AUDIO_QUEUE_CAP, av_frame_alloc, audio_limits);
+}
+
+// Library API
+// The player wraps the same pipeline the frontend drives. Pulling stands in
+// for the device and the render loop the way the bench does, so the pipeline
+// runs at the caller's pace. Every player has its own pipeline, the error of
+// a failed open is kept per thread since there is no player to hold it.
+_Thread_local char jp_last_error[256] = "";
+
+int jp_fail(int result, const char *message)
+{
+    snprintf(jp_last_error, sizeof(jp_last_error), "%s", message);
+    return result;
+}
+
+int jp_open_input(JPlayer *p, const char *input, const JPOptions *options)
+{
+    VideoContext *ctx = &p->ctx;
+    ctx->decoder_threads = options->decoder_threads;
+    ctx->no_audio = options->video_only;
+    jmp_buf env;
+    volatile bool queues = false;
+    if (setjmp(env)) {
+        error_jmp = NULL;
+        // whatever was set up when it failed, the rest was never allocated
+        if (queues) deinit_av_streaming(ctx);
+        else close_input(ctx);
+        return jp_fail(JP_ERROR, error_message);
+    }
+    error_jmp = &env;
+    init_av_streaming(ctx, (char *)input, (char *)options->resolver_args);
+    init_queues(p);
+    queues = true;
+    init_frame_conversion(ctx);
+    pool_acquire();
+    error_jmp = NULL;
+    int height = options->output_height > 0 ? options->output_height : ctx->v_ctx->height;
+    atomic_store(&ctx->out_height, bucket_height(ctx->v_ctx->height, height));
+    p->info = (JPInfo){
+        .width = ctx->v_ctx->width,
+        .height = ctx->v_ctx->height,
+        .fps = ctx->fps,
+        .duration = ctx->duration > 0.0 ? ctx->duration : 0.0,
+        .sample_rate = p->pcm.sample_rate,
+        .channels = p->pcm.channels,
+    };
+    return JP_OK;
+}
+
+int jp_open(const char *input, const JPOptions *options, JPlayer **player)
+{
+    *player = NULL;
+    JPOptions defaults = {0};
+    if (options == NULL) options = &defaults;
+
+    JPlayer *p = av_mallocz(sizeof(JPlayer));
+    if (p == NULL) return jp_fail(JP_ERROR, "out of memory");
+    p->ctx.player = p;
+    p->quiet = options->quiet || quiet;
+    pthread_mutex_init(&p->error_mutex, NULL);
+    // the calling thread logs like the player while it opens
+    bool was_quiet = quiet;
+    quiet = p->quiet;
+    int ret = jp_open_input(p, input, options);
+    quiet = was_quiet;
+    if (ret != JP_OK) {
+        pthread_mutex_destroy(&p->error_mutex);
+        av_free(p);
+        return ret;
+    }
+    *player = p;
+    return JP_OK;
+}
+
+const JPInfo *jp_info(JPlayer *player)
+{
+    return &player->info;
+}
+
+int jp_start(JPlayer *player)
+{
+    if (atomic_load(&player->failed)) return JP_ERROR;
+    if (player->started) return JP_OK;
+    start_threads(&player->ctx);
+    player->started = true;
+    return JP_OK;
+}
+
+int jp_pull_video(JPlayer *player, JPVideoFrame *frame, int timeout_ms)
+{
+    VideoContext *ctx = &player->ctx;
+    if (atomic_load(&player->failed)) return JP_ERROR;
+    // the frame handed out last time goes back to the converter
+    if (player->holding) {
+        QUEUE_POP(player->rgb_queue);
+        player->holding = false;
+    }
+    double deadline = now_ms() + timeout_ms;
+    while (true) {
+        drop_stale_frames(ctx, &player->rgb_queue, false);
+        if (!QUEUE_EMPTY(player->rgb_queue)) break;
+        // the failure woke the queue, the frames left are of no use
+        if (atomic_load(&player->failed)) return JP_ERROR;
+        if (video_finished(ctx)) return JP_EOF;
+        double left = deadline - now_ms();
+        if (!player->started || left <= 0.0) return JP_AGAIN;
+        // never past the caller's timeout, the park interval can be longer
+        long ms = left < QUEUE_PARK_MS ? (long)ceil(left) : QUEUE_PARK_MS;
+        QUEUE_WAIT_MS(player->rgb_queue, !QUEUE_EMPTY(player->rgb_queue) || video_finished(ctx) ||
+                      atomic_load(&player->failed), ms);
+    }
+    AVFrame *out = QUEUE_PEEK(player->rgb_queue);
+    *frame = (JPVideoFrame){
+        .data = out->data[0],
+        .width = out->width,
+        .height = out->height,
+        .stride = out->linesize[0],
+        .pts = out->pts / (double)AV_TIME_BASE,
+    };
+    player->holding = true;
+    return JP_OK;
+}
+
+int jp_pull_audio(JPlayer *player, float *samples, int frames)
+{
+    if (atomic_load(&player->failed)) return JP_ERROR;
+    int64_t ready = pcm_buffered(&player->pcm);
+    if (ready <= 0) return audio_finished(&player->ctx) ? JP_EOF : JP_AGAIN;
+    if (ready < frames) frames = ready;
+    pcm_callback(player, samples, frames);
+    return frames;
+}
+
+int jp_seek(JPlayer *player, double seconds)
+{
+    VideoContext *ctx = &player->ctx;
+    if (atomic_load(&player->failed)) return JP_ERROR;
+    if (player->holding) {
+        QUEUE_POP(player->rgb_queue);
+        player->holding = false;
+    }
+    bool was_quiet = quiet;
+    quiet = player->quiet;
+    seek_to(ctx, seconds, seconds > ctx->clock - ctx->offset);
+    quiet = was_quiet;
+    return JP_OK;
+}
+
+// the frontend reports on the pipeline between stopping it and closing
+void player_stop(JPlayer *player)
+{
+    if (!player->started) return;
+    stop_threads(&player->ctx);
+    player->started = false;
+}
+
+void jp_close(JPlayer *player)
+{
+    if (player == NULL) return;
+    player_stop(player);
+    prefetch_close(player);
+    deinit_av_streaming(&player->ctx);
+    pool_release();
+    BenchStats *b = &player->bench;
+    for (int i = 0; i < STAGE_COUNT; i++) av_freep(&b->stages[i].items);
+    for (int i = 0; i < 5; i++) av_freep(&b->occupancy[i].items);
+    av_freep(&b->queued_bytes.items);
+    pthread_mutex_destroy(&player->error_mutex);
+    av_free(player);
+}
+
+void jp_alloc_stats(JPlayer *player, JPAllocStats *stats)
+{
+    stats->frame_buffers = atomic_load(&player->alloc_stats.frame_buffers);
+    stats->frame_reuses = atomic_load(&player->alloc_stats.frame_reuses);
+    stats->packet_buffers = atomic_load(&player->alloc_stats.packet_buffers);
+}
+
+const char *jp_error(JPlayer *player)
+{
+    return player != NULL ? player->error : jp_last_error;
+}
@@ -0,0 +1,86 @@
+#ifndef JPLAYER_H
+#define JPLAYER_H
+// libjplayer, the decoding pipeline of jplay without the window.
+//
+// A player demuxes, decodes and converts once started, the caller pulls
+// converted video frames and audio samples at whatever pace it likes. Every
+// player has its own pipeline, any number can be open at once and all of
+// them share one pool of worker threads sized to the cores. Errors while
+// opening are returned, an error in a player's pipeline (running out of
+// memory) stops it and is returned by its next pull or seek.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JP_API __attribute__((visibility("default")))
+
+typedef struct JPlayer JPlayer;
+
+typedef enum {
+    JP_OK = 0,
+    JP_EOF = -1, // the stream is finished
+    JP_AGAIN = -2, // nothing ready yet
+    JP_ERROR = -3, // see jp_error()
+} JPResult;
+
+// per player, zero fields keep the defaults
+typedef struct {
+    // options for yt-dlp, makes the input a url it resolves. Split into words
+    // like a shell would, quotes and backslashes included, but never run by one.
+    const char *resolver_args;
+    int decoder_threads; // video decoder threads
+    int output_height; // frames are converted to about this height, the source height by default
+    bool quiet; // no logging to stdout from the player's threads
+    bool video_only; // the audio isn't opened, jp_pull_audio returns JP_EOF
+} JPOptions;
+
+typedef struct {
+    int width, height; // of the source
+    int fps;
+    double duration; // seconds, 0 if unknown
+    int sample_rate; // of the pulled audio
+    int channels;
+} JPInfo;
+
+// packed RGB24, valid until the next jp_pull_video, jp_seek or jp_close
+typedef struct {
+    const uint8_t *data;
+    int width, height;
+    int stride; // bytes per row
+    double pts; // seconds
+} JPVideoFrame;
+
+// Heap allocations of the player's decoded and demuxed data since it opened.
+// Frame and packet buffers come from pools and stop growing once the queues
+// are full.
+typedef struct {
+    int64_t frame_buffers;
+    int64_t frame_reuses; // frames decoded into pooled buffers only
+    int64_t packet_buffers;
+} JPAllocStats;
+
+// open a file or url, options may be NULL
+JP_API int jp_open(const char *input, const JPOptions *options, JPlayer **player);
+JP_API const JPInfo *jp_info(JPlayer *player);
+// start the pipeline
+JP_API int jp_start(JPlayer *player);
+// next converted frame, waiting up to timeout_ms for one
+JP_API int jp_pull_video(JPlayer *player, JPVideoFrame *frame, int timeout_ms);
+// up to frames interleaved float samples, returns how many were written
+JP_API int jp_pull_audio(JPlayer *player, float *samples, int frames);
+JP_API int jp_seek(JPlayer *player, double seconds);
+JP_API void jp_close(JPlayer *player);
+JP_API void jp_alloc_stats(JPlayer *player, JPAllocStats *stats);
+// message of the player's last JP_ERROR, or with NULL of the last failed
+// jp_open on this thread
+JP_API const char *jp_error(JPlayer *player);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // JPLAYER_H
@@ -0,0 +1,1068 @@
+#ifndef JPLAYER_INTERNAL_H
+#define JPLAYER_INTERNAL_H
+// Shared by the pipeline in jplayer.c and the jplay frontend in player.c.
+// None of it is part of libjplayer's api, see jplayer.h for that.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libavutil/avstring.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+
+#include "jplayer.h"
+
+// the window opens at this height and the pipeline converts to it until told otherwise
+#define DEFAULT_WINDOW_HEIGHT 600
+#define SYNC_LOG_INTERVAL 10.0 // seconds
+#define BUF_MAX_LEN 2048
+
+// inside a library call ERROR unwinds to the call, which returns it
+#define ERROR(fmt, ...) ({ \
+    snprintf(error_message, sizeof(error_message), fmt, ##__VA_ARGS__); \
+    if (error_jmp != NULL) longjmp(*error_jmp, 1); \
+    fprintf(stderr, "ERROR: %s\n", error_message); \
+    exit(1); \
+})
+#define LOG(fmt, ...) ({ if (!quiet) printf("LOG: "fmt"\n", ##__VA_ARGS__); })
+#define WARN(fmt, ...) ({ if (!quiet) printf("WARN: "fmt"\n", ##__VA_ARGS__); })
+//#define endl "\n"
+
+extern _Thread_local jmp_buf *error_jmp;
+extern _Thread_local char error_message[256];
+// set by a thread that may be told to give up while it opens inputs, network
+// inputs it opens stop waiting once it is
+extern _Thread_local atomic_bool *open_cancel;
+
+// Queue stuff
+// Queues are single-producer/single-consumer rings: windex is only written by
+// the producer and rindex only by the consumer, so each side publishes its
+// index with a release store and reads the other with an acquire load.
+// The mutex/cond pair is only used to park a thread while the ring is full or
+// empty; the other side wakes it only if someone is actually parked.
+//
+// cap is only a hard upper bound on the slots. A queue is normally bounded by
+// the bytes and presentation time it holds, recorded per slot by the producer
+// so the consumer can give back exactly that amount, and all queues together
+// count towards queued_bytes which the threads keep under memory_limit.
+#define QUEUE_PARK_MS 100
+// a queue below these is never considered full so the pipeline can't stall
+#define QUEUE_MIN_ITEMS 2
+#define QUEUE_LOW_DURATION 250000 // us
+
+#define QUEUE_INIT(Q, CAP, ALLOC, LIMITS) ({ \
+    Q.cap = CAP; \
+    Q.items = av_malloc_array(Q.cap, sizeof(*Q.items)); \
+    for (int __i = 0; __i < Q.cap; __i++) Q.items[__i] = ALLOC(); \
+    Q.item_bytes = av_calloc(Q.cap, sizeof(int64_t)); \
+    Q.item_duration = av_calloc(Q.cap, sizeof(int64_t)); \
+    Q.limits = LIMITS; \
+    atomic_init(&Q.bytes, 0); \
+    atomic_init(&Q.duration, 0); \
+    atomic_init(&Q.windex, 0); \
+    atomic_init(&Q.rindex, 0); \
+    atomic_init(&Q.waiters, 0); \
+    pthread_mutex_init(&Q.mutex, NULL); \
+    pthread_cond_init(&Q.cond, NULL); \
+})
+
+// what is still queued stops counting towards queued_bytes, the next player
+// starts from nothing
+#define QUEUE_FREE(Q, FREE) ({ \
+    atomic_fetch_sub(&queued_bytes, atomic_load(&Q.bytes)); \
+    atomic_store(&Q.bytes, 0); \
+    for (int __i = 0; __i < Q.cap; __i++) FREE(&Q.items[__i]); \
+    av_freep(&Q.items); \
+    av_freep(&Q.item_bytes); \
+    av_freep(&Q.item_duration); \
+    pthread_mutex_destroy(&Q.mutex); \
+    pthread_cond_destroy(&Q.cond); \
+    Q.cap = 0; \
+})
+
+#define QUEUE_SIZE(Q) ({ \
+    int __W = atomic_load_explicit(&Q.windex, memory_order_acquire); \
+    int __R = atomic_load_explicit(&Q.rindex, memory_order_acquire); \
+    (__W - __R + Q.cap) % Q.cap; \
+})
+
+#define QUEUE_EMPTY(Q) ({ \
+    atomic_load_explicit(&Q.rindex, memory_order_acquire) == \
+    atomic_load_explicit(&Q.windex, memory_order_acquire); \
+})
+
+#define QUEUE_FULL(Q) ({ \
+    int __N = QUEUE_SIZE(Q); \
+    __N == Q.cap - 1 || (__N >= QUEUE_MIN_ITEMS && \
+        (atomic_load(&Q.bytes) >= Q.limits.max_bytes || \
+         atomic_load(&Q.duration) >= Q.limits.max_duration)); \
+})
+
+// close to running dry, such a queue may always be filled even over memory_limit
+#define QUEUE_LOW(Q) ({ \
+    QUEUE_SIZE(Q) < QUEUE_MIN_ITEMS || atomic_load(&Q.duration) < QUEUE_LOW_DURATION; \
+})
+
+#define OVER_MEMORY_LIMIT() (atomic_load(&queued_bytes) >= memory_limit)
+
+// wake a thread parked on Q, the fence pairs with the one in QUEUE_WAIT_UNTIL
+#define QUEUE_WAKE(Q) ({ \
+    atomic_thread_fence(memory_order_seq_cst); \
+    if (atomic_load_explicit(&Q.waiters, memory_order_relaxed) > 0) { \
+        pthread_mutex_lock(&Q.mutex); \
+        pthread_cond_broadcast(&Q.cond); \
+        pthread_mutex_unlock(&Q.mutex); \
+    } \
+})
+
+// Pushing and popping also wakes a worker of the task pool, whose tasks wait
+// on queues. One is enough, whichever it is can take any task and the worker
+// that pushed takes the next runnable one itself.
+#define POOL_WAKE() ({ \
+    atomic_thread_fence(memory_order_seq_cst); \
+    if (atomic_load_explicit(&task_pool.waiters, memory_order_relaxed) > 0) { \
+        pthread_mutex_lock(&task_pool.mutex); \
+        pthread_cond_signal(&task_pool.cond); \
+        pthread_mutex_unlock(&task_pool.mutex); \
+    } \
+})
+
+// park until COND holds or QUEUE_PARK_MS passes, callers loop and recheck
+#define QUEUE_WAIT_UNTIL(Q, COND) QUEUE_WAIT_MS(Q, COND, QUEUE_PARK_MS)
+
+#define QUEUE_WAIT_MS(Q, COND, MS) ({ \
+    if (!(COND)) { \
+        struct timespec __T; \
+        clock_gettime(CLOCK_REALTIME, &__T); \
+        __T.tv_nsec += (MS) * 1000000L; \
+        __T.tv_sec += __T.tv_nsec / 1000000000L; \
+        __T.tv_nsec %= 1000000000L; \
+        pthread_mutex_lock(&Q.mutex); \
+        atomic_fetch_add_explicit(&Q.waiters, 1, memory_order_relaxed); \
+        atomic_thread_fence(memory_order_seq_cst); \
+        if (!(COND)) pthread_cond_timedwait(&Q.cond, &Q.mutex, &__T); \
+        atomic_fetch_sub_explicit(&Q.waiters, 1, memory_order_relaxed); \
+        pthread_mutex_unlock(&Q.mutex); \
+    } \
+})
+
+// producer side
+#define QUEUE_BACK(Q, W) ({ \
+    W = Q.items[atomic_load_explicit(&Q.windex, memory_order_relaxed)]; \
+})
+
+#define QUEUE_INC(Q, BYTES, DURATION) ({ \
+    int __W = atomic_load_explicit(&Q.windex, memory_order_relaxed); \
+    Q.item_bytes[__W] = BYTES; \
+    Q.item_duration[__W] = DURATION; \
+    atomic_fetch_add(&Q.bytes, Q.item_bytes[__W]); \
+    atomic_fetch_add(&Q.duration, Q.item_duration[__W]); \
+    atomic_fetch_add(&queued_bytes, Q.item_bytes[__W]); \
+    atomic_store_explicit(&Q.windex, (__W + 1) % Q.cap, memory_order_release); \
+    QUEUE_WAKE(Q); \
+    POOL_WAKE(); \
+})
+
+// consumer side, the peeked item stays owned by the consumer until QUEUE_POP
+#define QUEUE_PEEK(Q) ({ \
+    Q.items[atomic_load_explicit(&Q.rindex, memory_order_relaxed)]; \
+})
+
+#define QUEUE_POP(Q) ({ \
+    int __R = atomic_load_explicit(&Q.rindex, memory_order_relaxed); \
+    atomic_fetch_sub(&Q.bytes, Q.item_bytes[__R]); \
+    atomic_fetch_sub(&Q.duration, Q.item_duration[__R]); \
+    atomic_fetch_sub(&queued_bytes, Q.item_bytes[__R]); \
+    atomic_store_explicit(&Q.rindex, (__R + 1) % Q.cap, memory_order_release); \
+    QUEUE_WAKE(Q); \
+    POOL_WAKE(); \
+})
+
+// Media time that advances with the system clock
+typedef struct {
+    double pts; // seconds
+    double updated; // system time pts was set at
+    bool paused;
+} Clock;
+
+typedef enum {
+    SYNC_AUDIO,
+    SYNC_VIDEO,
+    SYNC_EXTERNAL,
+} SyncMaster;
+
+typedef struct {
+    struct JPlayer *player; // whose queues the pipeline threads fill
+    AVFormatContext *format_ctx;
+    AVFormatContext *format_ctx2; // used for split audio
+
+    // Codecs
+    AVCodecContext *v_ctx;
+    int v_index;
+    AVCodecContext *a_ctx;
+    int a_index;
+
+    struct SwsContext *sws_ctx;
+    int sws_src_width, sws_src_height, sws_src_format;
+    int sws_dst_width, sws_dst_height;
+    atomic_int out_height; // conversion size requested by the renderer
+    int display_height; // height the video was last drawn at
+    double shrink_since;
+    SwrContext *swr_ctx;
+
+    // state stuff
+    bool is_split;
+    bool no_audio; // video only, the audio stream isn't opened
+    bool video_active;
+    atomic_bool paused; // read by the converter
+    atomic_bool quit; // read by every pipeline thread
+    atomic_bool step_frame; // show the next frame even if paused
+
+    // Every seek bumps serial. Packets and frames are tagged with the serial
+    // they were read under, so stale ones are dropped by whichever thread
+    // consumes them and the queues never need to be locked to flush them.
+    atomic_int serial;
+    // written before the serial is bumped, so a thread that sees the new
+    // serial sees the target it was bumped for
+    _Atomic double seek_target;
+    atomic_bool seek_forward;
+    // serial at which the input/decoders reached the end of the stream
+    atomic_int io_eof_serial;
+    atomic_int v_eof_serial;
+    atomic_int a_eof_serial;
+
+    // the other stages are steps on the task pool
+    pthread_t r_thread;
+
+    // clock
+    _Atomic double clock; // master time, updated once per tick
+    Clock video_clock; // time of the shown frame
+    Clock ext_clock;
+    // audio minus master, the resample thread corrects it when audio isn't the master
+    _Atomic double audio_drift;
+    double paused_at, resumed_at;
+    // how much work the video decoder skips, raised by the conversion step
+    // while frames arrive late and applied by the decode step
+    atomic_int skip_level;
+
+    // read-ahead caches of network inputs, NULL for local files
+    struct NetCache *net_cache;
+    struct NetCache *net_cache2;
+    // local inputs read from a mapping, NULL otherwise
+    struct MappedFile *mapped;
+    struct MappedFile *mapped2;
+    // decoder buffers, owned here since a playlist moves the context around
+    struct FramePool *v_pool;
+    struct FramePool *a_pool;
+    char *index_file; // local input the seek index is cached for, NULL otherwise
+    int fps;
+    double start_time;
+    // found by the probe or later by the index scan, which runs alongside playback
+    _Atomic double duration;
+    int decoder_threads; // of the player that opened it, 0 lets ffmpeg pick
+    // where the item starts on the playback timeline, items of a playlist
+    // follow each other so the clock never jumps back between them
+    double offset;
+} VideoContext;
+
+typedef struct {
+    int64_t max_bytes;
+    int64_t max_duration; // us
+} QueueLimits;
+
+#define MB (1024*1024LL)
+#define NO_LIMITS ((QueueLimits){INT64_MAX, INT64_MAX})
+
+#define VIDEO_QUEUE_CAP 256
+#define AUDIO_QUEUE_CAP 1024
+#define RGB_QUEUE_CAP 4
+typedef struct FrameQueue {
+    AVFrame **items;
+    int cap;
+    QueueLimits limits;
+    int64_t *item_bytes;
+    int64_t *item_duration;
+    atomic_llong bytes;
+    atomic_llong duration;
+    atomic_int windex;
+    atomic_int rindex;
+    atomic_int waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} FrameQueue;
+
+// Decoder buffer pools
+// The decoders get their frame buffers from a pool per stream, sized for the
+// stream's frames. A buffer goes back to the pool when the last frame that
+// references it is unreferenced, so once the queues have filled up to their
+// limits decoding allocates no more frame data. The pools are rebuilt when
+// the frame size or format changes, buffers of the old one are freed as they
+// come back.
+typedef struct FramePool {
+    pthread_mutex_t mutex; // get_buffer2 is called from the decoder's threads
+    AVBufferPool *pools[4]; // a plane each
+    int planes;
+    // video
+    int width, height, format;
+    int linesize[4];
+    // audio, planes are sized for the largest frame seen
+    int plane_size;
+    int64_t allocs;
+    struct AllocStats *stats; // of the player decoding into it
+} FramePool;
+
+#define PACKET_QUEUE_CAP 4096
+// smallest buffer of a packet pool, pools are rebuilt at twice the size when outgrown
+#define PACKET_POOL_MIN (16*1024)
+typedef struct PacketQueue {
+    AVPacket **items;
+    int cap;
+    QueueLimits limits;
+    int64_t *item_bytes;
+    int64_t *item_duration;
+    atomic_llong bytes;
+    atomic_llong duration;
+    atomic_int windex;
+    atomic_int rindex;
+    atomic_int waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} PacketQueue;
+
+// Demuxer of one input, two for split streams. Stepped by the pool, the stats
+// are read by the bench report.
+typedef struct {
+    int input; // 0 has the video, 1 the audio of a split stream
+    VideoContext *ctx;
+    atomic_llong dts; // read up to, AV_TIME_BASE from the input's start
+    atomic_bool blocked; // waiting on a full queue or the memory limit
+    atomic_int eof_serial;
+    // where the video input seeked to for seek_serial, the audio one follows
+    int64_t seek_ts;
+    atomic_int seek_serial;
+    // throughput and time spent not reading, in us
+    atomic_long packets;
+    atomic_llong bytes;
+    atomic_llong read_us;
+    atomic_long stalls;
+    atomic_llong stall_us;
+    atomic_long window_waits;
+    atomic_llong window_us;
+    // buffers queued packets are moved into, video and audio
+    AVBufferPool *packet_pools[2];
+    size_t packet_pool_size[2];
+    // kept between steps, only touched by the worker stepping the reader
+    AVPacket *pending; // read but not queued yet
+    bool has_pending;
+    bool done; // at the end of the input for serial
+    bool seeked; // since the start, the index isn't complete
+    int serial;
+    double stall_start; // ms, when the last step ended on a stall or 0
+    double window_start; // ms, likewise for a window wait
+} InputReader;
+
+// what the next step of a reader would do
+typedef enum {
+    READER_RUN,
+    READER_IDLE, // at its end, or the audio input waiting for the video one to seek
+    READER_STALL, // its queue is full or memory is short
+    READER_WINDOW, // too far ahead of the other input
+} ReaderState;
+
+// Keyframes of the video stream in pts order. Only touched by the video input's
+// reader, which both demuxes and performs seeks.
+// The layout of Keyframe is also the on-disk layout of the index cache.
+typedef struct {
+    int64_t pts;       // video stream time base
+    int64_t pos;       // byte offset or -1
+    int64_t audio_pts; // first audio packet after the keyframe or AV_NOPTS_VALUE
+} Keyframe;
+
+typedef struct {
+    Keyframe *items;
+    int count;
+    int cap;
+    bool complete; // every keyframe in the file is known
+    // set when items points into a mapped cache file and can't grow
+    void *map;
+    size_t map_size;
+    double duration;
+} KeyframeIndex;
+
+// Seek index cache
+// A sidecar index for local files, kept in the user cache directory and keyed
+// by the real path, size and mtime of the input. It is built by a low
+// priority background scan the first time a file is opened.
+#define INDEX_MAGIC 0x5844494a // "JIDX"
+#define INDEX_VERSION 1
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    double duration;
+    int32_t v_index;
+    int32_t a_index;
+    int64_t count;
+    uint32_t path_len;
+    uint32_t pad;
+    // followed by the path padded to 8 bytes and then the entries
+} IndexHeader;
+
+typedef struct {
+    char path[PATH_MAX]; // cache file
+    char file[PATH_MAX]; // real path of the input
+    uint64_t file_size;
+    struct timespec mtime;
+    bool enabled;
+    bool building;
+    pthread_t thread;
+    // handed from the index thread to the video reader once the scan is done
+    KeyframeIndex *_Atomic ready;
+} IndexCache;
+
+// Timeline thumbnails
+// Keyframes at a fixed spacing, decoded by a lowest priority thread on its own
+// demuxer and decoder and scaled down into an atlas of RGB cells. Cells are
+// stored one after the other and fill in order, the renderer uploads each
+// into its place in a grid texture once it is ready. Local files only, the
+// finished atlas is cached beside the seek index.
+#define THUMB_HEIGHT 90
+#define THUMB_COLUMNS 16
+#define THUMB_MAX 256
+#define THUMB_MIN_INTERVAL 2.0
+#define THUMB_PAUSE_MS 20 // between cells
+#define THUMB_SCALE 0.2f // of the video height
+#define THUMB_MAGIC 0x4d48544a // "JTHM"
+#define THUMB_VERSION 1
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    double interval;
+    int32_t count;
+    int32_t width;
+    int32_t height;
+    int32_t pad;
+    // followed by the cells
+} ThumbHeader;
+
+typedef struct {
+    pthread_t thread;
+    bool running;
+    uint8_t *pixels;
+    int width, height; // of a cell
+    int count;
+    double interval;
+    atomic_int filled; // cells ready, from the first
+    int generation; // bumped for every item so the renderer starts over
+} ThumbAtlas;
+
+// PCM ring
+// Resampled audio waiting for the device. The resample thread is the only
+// writer and the audio callback the only reader. Positions count frames
+// since the start and only grow, the slot is the position modulo cap.
+#define AUDIO_DEVICE_FRAMES 1024
+#define PCM_ANCHORS 256
+typedef struct {
+    atomic_llong pos;
+    atomic_llong samples;
+} PcmAnchor;
+
+typedef struct {
+    float *data;
+    int cap; // frames
+    // format of the device, set by the first item and kept for the rest
+    int channels;
+    int sample_rate;
+    AVChannelLayout layout;
+    atomic_llong write_pos;
+    atomic_llong read_pos;
+    // set by a seek, the reader skips everything buffered before it
+    atomic_llong discard_pos;
+    // A full ring parks the writer on space. The callback can't take a lock,
+    // it posts only when writer_waiting says someone is parked.
+    sem_t space;
+    atomic_bool writer_waiting;
+    // Media time of ring positions, one anchor per resampled frame. Written
+    // only by the resample thread under anchor_seq, readers retry like they
+    // do for the callback fields below and never block it.
+    atomic_uint anchor_seq;
+    PcmAnchor anchors[PCM_ANCHORS];
+    atomic_int anchor_start;
+    atomic_int anchor_count;
+    atomic_int anchor_serial; // serial the anchors were restarted for
+    // the last callback, the playback position between callbacks is
+    // extrapolated from it. Written only by the callback under cb_seq.
+    atomic_uint cb_seq;
+    atomic_llong cb_pos;
+    _Atomic double cb_time;
+    atomic_int cb_frames;
+    atomic_bool ended; // nothing more is coming for the current serial
+    atomic_long underruns; // callbacks that had to pad with silence
+    atomic_long overruns; // times the ring stayed full while the device should have been pulling
+} PcmRing;
+
+// Audio processing
+// Gain and limiting run in the callback as the device pulls, so a volume change
+// is heard right away instead of after everything already in the ring. The
+// gain ramps to its target over GAIN_RAMP_MS to avoid zipper noise, then a
+// look-ahead limiter brings peaks under the ceiling before they leave its
+// delay line. Loudness is measured by the resample thread as audio is written.
+#define GAIN_RAMP_MS 20
+#define LIMITER_LOOKAHEAD_MS 5 // also how late the limiter makes the output
+#define LIMITER_RELEASE_MS 100
+#define LIMITER_CEILING 0.891f // -1 dBFS
+#define NORMALIZE_MAX_BOOST 12.0 // dB
+#define NORMALIZE_MAX_CUT 24.0 // dB
+typedef void (*GainFunc)(float *data, int frames, int channels, float gain, float step);
+
+typedef struct {
+    _Atomic float volume; // set by the ui, 0 while muted
+    _Atomic float norm_gain; // from the loudness normalization
+    // gain ramp, only touched by the callback
+    float gain;
+    float ramp_target;
+    float ramp_step;
+    int ramp_left;
+    int ramp_frames;
+    // limiter
+    float *delay;
+    int delay_frames;
+    int delay_pos;
+    float env; // gain applied to what leaves the delay line
+    float target;
+    float attack; // per frame
+    float release; // fraction of the way back per frame
+    int hold;
+    atomic_long limited; // callbacks the limiter had to reduce
+    GainFunc gain_apply; // fastest path the cpu has, picked when the stream opens
+} AudioDsp;
+
+// EBU R128 integrated loudness. K-weighted mean squares over 400ms blocks
+// every 100ms, gated at -70 LUFS and 10 LU under the ungated loudness. Blocks
+// go into a 0.1 LU histogram so the gating never has to revisit them.
+#define LOUDNESS_BINS 800 // -70 to +10 LUFS
+typedef struct {
+    int channels;
+    double b[2][3], a[2][3]; // shelving pre-filter then RLB high-pass
+    double (*z)[4]; // per channel state of both biquads
+    double *weights;
+    double sum; // weighted squares of the current 100ms
+    int frames;
+    int step_frames;
+    double steps[4]; // the last four 100ms make a block
+    int step_count;
+    double bin_energy[LOUDNESS_BINS];
+    long bin_count[LOUDNESS_BINS];
+    _Atomic double integrated; // LUFS, -HUGE_VAL until the first block
+} Loudness;
+
+// Network cache
+// Network inputs are read through a custom AVIOContext backed by an in-memory
+// ring that a fetch thread keeps filled ahead of the reader. Bytes that fall
+// out of the ring are spilled to an unlinked file in the cache directory so
+// seeking back doesn't have to go to the network again.
+#define NET_CHUNK (64*1024)
+#define NET_AVIO_BUFFER (32*1024)
+typedef struct {
+    int64_t start;
+    int64_t end;
+} ByteRange;
+
+typedef struct NetCache {
+    AVIOContext *avio; // what the demuxer reads
+    AVIOContext *upstream;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // data arrived or the reader moved
+    // ring holding [mem_start, mem_end) of the stream
+    uint8_t *data;
+    int64_t cap;
+    int64_t readahead;
+    int64_t mem_start;
+    int64_t mem_end;
+    int64_t read_pos;
+    int64_t size; // -1 while unknown
+    bool eof;
+    int error;
+    bool quit;
+    atomic_bool *cancel; // of the thread that opened it, also stops it when set
+    bool quiet; // of the player that opened it, for the fetch thread's logging
+    // spilled ranges, sorted and disjoint
+    int disk_fd;
+    ByteRange *ranges;
+    int range_count;
+    int range_cap;
+    int64_t disk_bytes;
+    // stats
+    int64_t fetched;
+    int64_t stalls; // reads that had to wait for the network
+    int64_t refetches; // times the fetch restarted somewhere else
+} NetCache;
+
+// Mapped files
+// Local inputs are read out of a mapping of the file instead of through
+// read() calls into the file protocol's buffer. The AVIOContext is direct, so
+// reads as large as a packet are copied straight from the page cache into the
+// packet, and the kernel is asked to fault in a window ahead of the reader.
+// The mapping is only as long as the file was at open. The size is checked
+// again when a read reaches the end of the mapping, a file that changed size
+// is read with pread() from then on. Touching mapped pages past a truncation
+// raises SIGBUS, the handler maps zeros over the rest of that mapping and
+// flags it so the reader switches to pread() as well.
+#define MAP_AVIO_BUFFER (32*1024) // only small reads of headers go through it
+#define MAP_READAHEAD (16*MB)
+#define MAP_SLOTS 64 // mappings open at once that SIGBUS is caught for
+// reads of a packet deferred by the reader, see map_zero_copy
+#define MAP_DEFERRED 8
+
+// Where the SIGBUS handler looks for mappings. Written under map_slots_mutex
+// and seq, the handler retries while seq is odd or changes.
+typedef struct {
+    atomic_uint seq;
+    atomic_uintptr_t start;
+    atomic_uintptr_t end;
+    atomic_bool truncated; // the handler mapped zeros over part of it
+} MapSlot;
+
+typedef struct {
+    uint8_t *dest;
+    int64_t pos;
+    int size;
+} MapRead;
+
+typedef struct MappedFile {
+    AVIOContext *avio;
+    int fd;
+    uint8_t *data;
+    int64_t size; // of the mapping
+    int slot; // in map_slots
+    // the mapping outlives the input while packets and frames point into it
+    atomic_int refs;
+    bool unmapped; // the file changed size, read through fd
+    int64_t pos;
+    int64_t advised; // end of the window passed to MADV_WILLNEED
+    // Packets of inputs that take their payload as it is in the file
+    // reference the mapping instead of a copy of it. While the reader demuxes
+    // one, large reads only note where they would have copied to.
+    bool zero_copy;
+    bool defer;
+    MapRead deferred[MAP_DEFERRED];
+    int deferred_count;
+    // stats
+    int64_t reads;
+    int64_t advises;
+    atomic_long zero_copies; // packets that point into the mapping
+} MappedFile;
+
+// Playlist
+// Inputs are played back to back. Near the end of an item the next one is
+// opened on a background thread and the start of it decoded, so once the
+// current item has left the decoders the pipeline can switch over while its
+// last frames and audio are still queued.
+#define PLAYLIST_PREFETCH 30.0 // seconds before the end of an item the next one is opened
+#define PREFETCH_VIDEO_FRAMES 8 // at most, decoding stops at the end of the first GOP
+#define PREFETCH_AUDIO_FRAMES 64
+#define PREFETCH_AUDIO 0.5 // seconds of audio decoded ahead
+#define PREFETCH_PACKETS 512
+typedef struct {
+    VideoContext ctx;
+    char *file;
+    pthread_t thread;
+    bool started;
+    atomic_bool ready;
+    atomic_bool failed; // the item couldn't be opened, it is skipped
+    atomic_bool cancel; // closing before it was played, stop opening and reading
+    // decoded ahead
+    AVFrame *video[PREFETCH_VIDEO_FRAMES];
+    int video_count;
+    AVFrame *audio[PREFETCH_AUDIO_FRAMES];
+    int audio_count;
+    // keyframes among the decoded packets, for the seek index
+    Keyframe keys[PREFETCH_VIDEO_FRAMES];
+    int key_count;
+    // read past what was decoded, video and audio
+    AVPacket *packets[2][PREFETCH_PACKETS];
+    int packet_count[2];
+} Prefetch;
+
+// Task pool
+// The demux, decode and conversion of every player run as steps on one pool
+// of workers sized to the cores. A step does one unit of work, reading a
+// packet, decoding one or converting a frame, and never waits: a task is only
+// stepped while it can get somewhere, and workers park on the pool while none
+// can, woken by every queue like a consumer. A worker takes the tasks of the
+// players it owns first, so their decoder state stays in its caches, and
+// steals a runnable task of another worker's when none of its own is. The
+// resample thread stays on its own since the device paces it through the ring.
+typedef enum {
+    // the order a worker tries them in, downstream first so frames leave
+    // before more come in
+    TASK_CONVERT,
+    TASK_VIDEO_DECODE,
+    TASK_AUDIO_DECODE,
+    TASK_READ_VIDEO,
+    TASK_READ_AUDIO, // the second input of a split stream
+    TASK_COUNT,
+} TaskKind;
+
+typedef struct {
+    struct JPlayer *player;
+    TaskKind kind;
+    int owner; // worker that steps it unless another is idle
+    // under the pool's lock
+    bool busy; // a worker is stepping it
+    bool removed; // the player is stopping, wake it once the step is done
+} Task;
+
+typedef struct {
+    pthread_mutex_t lock; // the task list and the flags of every task
+    pthread_cond_t released; // a removed task's step finished
+    Task **tasks;
+    int count;
+    int cap;
+    int next_owner;
+    pthread_t *workers;
+    int worker_count;
+    // players holding the pool, the workers stop with the last
+    pthread_mutex_t users_mutex;
+    int users;
+    atomic_bool quit;
+    // workers park while no task is runnable
+    atomic_int waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} TaskPool;
+
+// Video wall
+// With -wall the inputs share the window as a grid instead of playing one
+// after another. The heard input is the frontend's player, every other is a
+// video only player of its own following its clock, opened through jp_open
+// like any other so it gets the same caches, mapping and limits. All of them
+// run on the task pool. Tiles open on threads of their own so a slow camera
+// doesn't hold up the window or the other tiles.
+typedef enum {
+    TILE_NEW,
+    TILE_OPEN,
+    TILE_FAILED,
+} TileState;
+
+typedef struct {
+    char *file;
+    struct JPlayer *player; // once open
+    pthread_t open_thread;
+    atomic_int state;
+    atomic_bool cancel; // the wall stopped while the tile was opening
+    // renderer
+    int shown_serial;
+    long presented;
+    long dropped; // converted but never uploaded, a later one was due
+} WallTile;
+
+typedef struct {
+    WallTile *tiles;
+    int count;
+    bool quiet; // of the thread that started the wall, the open threads log like it
+    // a seek while tiles are opening, applied once they are open
+    pthread_mutex_t mutex;
+    bool seeked;
+    double seek_target;
+} VideoWall;
+
+#define PACKET_SERIAL(P) ((int)(intptr_t)(P)->opaque)
+#define FRAME_SERIAL(F) ((int)(intptr_t)(F)->opaque)
+
+// Globals, the state of a pipeline is in its JPlayer
+extern VideoWall video_wall;
+extern TaskPool task_pool;
+
+// flags
+// the player a thread works for decides, see player_thread
+extern _Thread_local bool quiet;
+extern int codec_thread_type;
+extern int convert_threads; // 0 lets swscale pick based on core count
+extern QueueLimits packet_limits;
+extern QueueLimits video_limits;
+extern QueueLimits audio_limits;
+extern int64_t memory_limit;
+extern int64_t net_cache_size;
+extern int64_t net_disk_limit;
+extern const char *resolver;
+extern int64_t probesize; // bytes, 0 for the ffmpeg default
+extern int64_t analyzeduration; // us, 0 for the ffmpeg default
+extern int audio_buffer_ms;
+extern int audio_latency_ms; // output latency beyond what the device reports
+extern SyncMaster sync_master;
+extern double normalize_lufs; // loudness target, 0 disables normalization
+extern bool wall_mode; // all inputs at once in a grid
+extern bool use_mmap; // local inputs are read from a mapping
+extern bool windowed; // jplay with a window, not the bench or the library
+extern bool render_yuv; // decoded planes are drawn through a shader instead of converted
+extern const char *audio_input; // audio from a separate input, like a split stream
+extern int dts_window_ms; // how far the inputs of a split stream may read apart
+extern const char *sync_names[];
+extern atomic_llong queued_bytes;
+extern bool bench_mode; // stage latencies are recorded, only the bench reads them
+// set by a thread that opens a player, what the open is doing for a loading screen
+extern _Thread_local const char *_Atomic *open_status;
+
+// Bench
+// Per-stage latencies are only recorded in bench mode. Each stage is timed by
+// one thread or task at a time and only read after the pipeline stopped.
+#define BENCH_SAMPLE_MS 100
+#define BENCH_WARMUP 2.0 // seconds until the queues and pools should be full
+typedef enum {
+    STAGE_DEMUX,
+    STAGE_VIDEO_DECODE,
+    STAGE_AUDIO_DECODE,
+    STAGE_CONVERT,
+    STAGE_RESAMPLE,
+    STAGE_COUNT,
+} Stage;
+
+extern const char *stage_names[STAGE_COUNT];
+
+typedef struct {
+    double *items;
+    int count;
+    int cap;
+} Samples;
+
+typedef struct {
+    Samples stages[STAGE_COUNT];
+    // queue occupancy sampled every BENCH_SAMPLE_MS
+    Samples occupancy[5];
+    Samples queued_bytes;
+    int64_t video_frames;
+    int64_t audio_frames;
+    int64_t audio_samples;
+    // pool buffers allocated by the time the pipeline had warmed up
+    int64_t warm_frame_buffers;
+    int64_t warm_packet_buffers;
+    bool warm;
+    double start;
+    double end;
+} BenchStats;
+
+// Startup timeline
+// When each phase of a player first completed, in ms since main started. Every
+// phase is marked by whichever thread gets there and read once playback is
+// underway.
+typedef enum {
+    PHASE_OPEN,
+    PHASE_PROBE,
+    PHASE_CODEC_OPEN,
+    PHASE_FIRST_PACKET,
+    PHASE_FIRST_DECODED,
+    PHASE_FIRST_PRESENTED,
+    PHASE_COUNT,
+} StartupPhase;
+
+extern const char *phase_names[PHASE_COUNT];
+extern double startup_origin;
+
+// Dropped frames were decoded but too late to convert, skipped ones were
+// never output by the decoder (packets sent minus frames received).
+typedef struct {
+    atomic_long dropped;
+    atomic_long packets;
+    atomic_long frames;
+} LateStats;
+
+// Heap allocations of frame and packet data, both level off once the pools
+// are warm. The demuxer still allocates each packet itself, which has no
+// hook, but hands it back right after the reader moved it into a pool buffer.
+typedef struct AllocStats {
+    atomic_llong frame_buffers; // new pool buffers
+    atomic_llong frame_reuses; // frames that got only buffers handed out before
+    atomic_llong packet_buffers; // new pool buffers
+} AllocStats;
+
+typedef struct {
+    int64_t count;
+    double sum;
+    double sum_sq;
+    double max; // largest magnitude
+} DriftStats;
+
+// A/V sync statistics. video is how far off the master each frame was shown,
+// audio how far the audio was from the master when it isn't the master.
+// Written by the render loop, corrected_samples by the resample thread.
+typedef struct {
+    DriftStats video;
+    DriftStats audio;
+    atomic_llong corrected_samples;
+    double last_log;
+} SyncStats;
+
+// Tracing
+// -trace records spans of the expensive calls and counters of the queues into
+// a buffer per thread that only that thread writes, and saves them as a Chrome
+// trace (chrome://tracing or ui.perfetto.dev) on exit. Buffers grow a chunk at
+// a time so a span never waits on anything but its own allocation.
+#define TRACE_CHUNK 65536 // events
+#define TRACE_MAX_CHUNKS 64 // per thread, later events are dropped
+typedef struct {
+    const char *name;
+    double start; // ms
+    double dur; // ms, negative for a counter
+    double value;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    const char *thread;
+    int tid;
+    TraceEvent *chunks[TRACE_MAX_CHUNKS];
+    atomic_int count; // published, chunks below it are complete
+    long dropped;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+extern const char *trace_path; // NULL unless tracing
+extern TraceBuffer *_Atomic trace_buffers;
+extern atomic_int trace_threads;
+extern _Thread_local TraceBuffer *trace_buf;
+
+// between the steps of a decode task
+typedef struct {
+    PacketQueue *packets;
+    FrameQueue *frames;
+    atomic_int *eof_serial;
+    Stage stage;
+    bool video;
+    bool done;
+    int serial;
+    int skip_level; // applied to the decoder
+} Decoder;
+
+// skip level bookkeeping of the conversion task
+typedef struct {
+    int drops;
+    double last_drop;
+    double level_since;
+} Converter;
+
+// Everything one pipeline works on, the frontend drives the pipeline of its
+// player directly. The playlist advances ctx in place, the rest lives as long
+// as the player.
+struct JPlayer {
+    VideoContext ctx;
+    KeyframeIndex kf_index;
+    IndexCache index_cache;
+    ThumbAtlas thumbs;
+    PacketQueue v_packets;
+    PacketQueue a_packets;
+    FrameQueue v_queue;
+    FrameQueue rgb_queue; // converted frames ready for upload
+    FrameQueue a_queue;
+    PcmRing pcm;
+    AudioDsp dsp;
+    Loudness loudness;
+    InputReader readers[2];
+    Decoder decoders[2]; // video and audio
+    Converter converter;
+    Task tasks[TASK_COUNT]; // the stages on the pool, by kind
+    // the items played back to back, the first is the opened input. Owned by
+    // whoever set them
+    char **playlist;
+    int playlist_count;
+    int playlist_index;
+    Prefetch prefetch;
+
+    BenchStats bench;
+    _Atomic double startup[PHASE_COUNT];
+    LateStats late_stats;
+    AllocStats alloc_stats;
+    SyncStats sync_stats;
+
+    bool quiet; // logging of every thread working for the player
+    // a pipeline thread failed, the threads are stopped and error says why
+    atomic_bool failed;
+    pthread_mutex_t error_mutex;
+    char error[256];
+
+    JPInfo info;
+    bool started;
+    bool holding; // the last pulled frame is still at the head of rgb_queue
+};
+
+// what the frontend calls of the pipeline, in the order jplayer.c defines it
+long frames_skipped(JPlayer *p);
+double now_ms(void);
+void samples_push(Samples *s, double value);
+void trace_thread(const char *name);
+double trace_now(void);
+void trace_span(const char *name, double start);
+void trace_write(void);
+void clock_set(Clock *c, double pts, double now);
+double drift_mean(DriftStats *d);
+double drift_stddev(DriftStats *d);
+bool startup_mark(JPlayer *p, StartupPhase phase);
+void startup_log(JPlayer *p);
+double net_cache_fill(NetCache *c);
+void gain_scalar(float *data, int frames, int channels, float gain, float step);
+#ifdef HAVE_X86
+void gain_sse(float *data, int frames, int channels, float gain, float step);
+void gain_avx(float *data, int frames, int channels, float gain, float step);
+#endif
+GainFunc gain_best(const char **name);
+void dsp_init(AudioDsp *d, int channels, int sample_rate);
+void limiter_process(AudioDsp *d, float *data, int frames, int channels);
+void loudness_init(Loudness *l, AVChannelLayout *layout, int sample_rate);
+void loudness_free(Loudness *l);
+void loudness_process(Loudness *l, const float *data, int frames);
+int bucket_height(int src_height, int height);
+void output_size(VideoContext *ctx, int *width, int *height);
+void drop_stale_frames(VideoContext *ctx, FrameQueue *queue, bool unref);
+int64_t pcm_buffered(PcmRing *r);
+double master_time(VideoContext *ctx, double now);
+void pcm_callback(JPlayer *p, void *buffer, unsigned int frames);
+bool video_finished(VideoContext *ctx);
+bool audio_finished(VideoContext *ctx);
+bool playlist_update(VideoContext *ctx);
+void wall_start(char **files, int count);
+void wall_stop(void);
+void wall_seek(double seconds);
+void seek_to(VideoContext *ctx, double seconds, bool forward);
+void set_paused(VideoContext *ctx, bool paused);
+void sync_video(VideoContext *ctx, double pts, double now, bool step);
+void sync_audio(VideoContext *ctx, double now);
+void sync_log(JPlayer *p);
+void trace_counters(JPlayer *p);
+void player_stop(JPlayer *player);
+
+#endif // JPLAYER_INTERNAL_H
@@ -1,143 +1,299 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <assert.h>
-#include <pthread.h>
-
+// jplay, the window, controls and bench around the pipeline in jplayer.c
+#include "jplayer_internal.h"
 #include <raylib.h>
-#include <libavcodec/avcodec.h>
-#include <libavutil/avutil.h>
-#include <libavutil/imgutils.h>
-#include <libavformat/avformat.h>
-#include <libswscale/swscale.h>
-#include <libswresample/swresample.h>
 
 #define MIN_WINDOW_HEIGHT 200
-#define DEFAULT_WINDOW_HEIGHT 600
 #define MAX_VOLUME 4.0f
 #define VOLUME_STEP 0.05f
+#define SEEK_STEP 5.0
+#define SEEK_STEP_LONG 60.0
 
 #define TIME_FONT_SCALE 0.03f
 #define VOLUME_BAR_SCALE 0.1f
 #define PAUSE_SCALE 0.1f
+#define TIMELINE_SCALE 0.3f
+// wait this long before converting at a smaller size after the window shrinks
+#define OUTPUT_SHRINK_DELAY 0.5
+// The window is only redrawn when something on it changed, in between the
+// render loop sleeps until the next frame is due or input may have come in
+#define RENDER_IDLE_WAIT 0.05 // input polling while nothing plays
+#define RENDER_ACTIVE_HOLD 0.5 // input is polled every refresh this long after the last
+#define DOUBLE_CLICK_TIME 0.25
+
+// With -yuv decoded frames skip swscale and go to the GPU as they are, one
+// single channel texture per plane (two for NV12, whose chroma is interleaved).
+// The textures are a linesize wide so rows go up without repacking, the source
+// rect crops the padding and a fragment shader does the colorspace matrix
+// while the frame is drawn.
+typedef struct {
+    Shader shader;
+    int u_loc, v_loc, nv12_loc, chroma_scale_loc, offset_loc, row_locs[3];
+    Texture planes[3];
+    int format; // of the textures, AV_PIX_FMT_NONE before the first upload
+    int width, height; // of the picture
+    // what the matrix was set up for
+    enum AVColorSpace colorspace;
+    enum AVColorRange range;
+    bool active; // the frame on screen is in the planes, not the RGB surface
+} YuvRender;
+
+// the thumbnail atlas of the player on the GPU, cells go up as the thread
+// fills them
+typedef struct {
+    Texture texture;
+    int generation; // of the atlas the texture was made for
+    int uploaded; // cells in the texture, from the first
+} ThumbTexture;
 
-#define ERROR(fmt, ...) ({ fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__); exit(1); })
-#define LOG(fmt, ...) ({ if (!quiet) printf("LOG: "fmt"\n", ##__VA_ARGS__); })
-#define WARN(fmt, ...) ({ if (!quiet) printf("WARN: "fmt"\n", ##__VA_ARGS__); })
-//#define endl "\n"
-
-// Queue stuff
-#define QUEUE_SIZE(Q) ({ \
-    int __S; \
-    if (Q.windex >= Q.rindex) __S = Q.windex - Q.rindex; \
-    else __S = Q.cap - Q.rindex + Q.windex + 1; \
-    __S; \
-})
-
-#define QUEUE_EMPTY(Q) ({ \
-    pthread_mutex_lock(&Q.mutex); \
-    bool _V = Q.rindex == Q.windex; \
-    pthread_mutex_unlock(&Q.mutex); \
-    _V; \
-})
+// where a wall tile was last drawn and with what
+typedef struct {
+    Texture texture;
+    Rectangle dst;
+} WallView;
 
-#define QUEUE_FULL(Q) ({ \
-    pthread_mutex_lock(&Q.mutex); \
-    bool _V = (Q.windex + 1) % Q.cap == Q.rindex; \
-    pthread_mutex_unlock(&Q.mutex); \
-    _V; \
-})
+// Globals
+YuvRender yuv_render = {.format = AV_PIX_FMT_NONE};
+double last_click = -1.0; // GetTime() of a click that may become a double click
+int codec_threads = 0; // passed to the player, 0 lets ffmpeg pick based on core count
+bool autoexit = false; // quit once the video of the last item has been shown
+int wall_audio = 0; // cell of the input that is heard on a wall, it plays through the pipeline
+bool bench_realtime = false; // --bench-realtime, paced like playback instead of as fast as it goes
+// every input to play, handed to the player once it is open
+char **playlist = NULL;
+int playlist_count = 0;
+JPlayer *heard = NULL; // whose audio the device plays
+AudioStream audio_stream;
+float volume = 1.0f;
+bool muted = false;
+ThumbTexture thumb_texture;
+WallView *wall_views = NULL; // one per tile
+
+// Runs on the default vertex shader. GLSL 330 is what raylib's desktop GL 3.3
+// backend speaks, which Mesa's llvmpipe has as well (LIBGL_ALWAYS_SOFTWARE=1).
+// Two channel textures come back from raylib swizzled as (r, r, r, g), so the
+// V of NV12 is in alpha.
+const char *yuv_shader_code =
+    "#version 330\n"
+    "in vec2 fragTexCoord;\n"
+    "in vec4 fragColor;\n"
+    "out vec4 finalColor;\n"
+    "uniform sampler2D texture0;\n" // Y
+    "uniform sampler2D u_plane;\n" // U, or UV for NV12
+    "uniform sampler2D v_plane;\n"
+    "uniform int nv12;\n"
+    "uniform vec2 chroma_scale;\n"
+    "uniform vec3 offset;\n"
+    "uniform vec3 row_r;\n"
+    "uniform vec3 row_g;\n"
+    "uniform vec3 row_b;\n"
+    "void main()\n"
+    "{\n"
+    "    vec2 c = fragTexCoord * chroma_scale;\n"
+    "    vec2 uv = nv12 != 0 ? texture(u_plane, c).ra\n"
+    "                        : vec2(texture(u_plane, c).r, texture(v_plane, c).r);\n"
+    "    vec3 yuv = vec3(texture(texture0, fragTexCoord).r, uv) - offset;\n"
+    "    vec3 rgb = vec3(dot(row_r, yuv), dot(row_g, yuv), dot(row_b, yuv));\n"
+    "    finalColor = vec4(clamp(rgb, 0.0, 1.0), 1.0) * fragColor;\n"
+    "}\n";
+
+// needs the GL context, false if the shader didn't compile
+bool yuv_init(YuvRender *r)
+{
+    r->shader = LoadShaderFromMemory(NULL, yuv_shader_code);
+    // raylib hands back its default shader when compiling fails, which has none of these
+    r->u_loc = GetShaderLocation(r->shader, "u_plane");
+    r->v_loc = GetShaderLocation(r->shader, "v_plane");
+    r->nv12_loc = GetShaderLocation(r->shader, "nv12");
+    r->chroma_scale_loc = GetShaderLocation(r->shader, "chroma_scale");
+    r->offset_loc = GetShaderLocation(r->shader, "offset");
+    r->row_locs[0] = GetShaderLocation(r->shader, "row_r");
+    r->row_locs[1] = GetShaderLocation(r->shader, "row_g");
+    r->row_locs[2] = GetShaderLocation(r->shader, "row_b");
+    if (r->row_locs[0] < 0 || r->offset_loc < 0) {
+        UnloadShader(r->shader);
+        r->shader = (Shader){0};
+        return false;
+    }
+    r->format = AV_PIX_FMT_NONE;
+    return true;
+}
 
-#define QUEUE_BACK(Q, W) ({ \
-    pthread_mutex_lock(&Q.mutex); \
-    W = Q.items[Q.windex]; \
-    pthread_mutex_unlock(&Q.mutex); \
-})
+void yuv_unload(YuvRender *r)
+{
+    for (int i = 0; i < 3; i++) {
+        if (r->planes[i].id != 0) UnloadTexture(r->planes[i]);
+        r->planes[i] = (Texture){0};
+    }
+    if (r->shader.id != 0) UnloadShader(r->shader);
+    r->shader = (Shader){0};
+}
 
-#define QUEUE_INC(Q) ({ \
-    pthread_mutex_lock(&Q.mutex); \
-    if (++Q.windex >= Q.cap) Q.windex = 0; \
-    pthread_mutex_unlock(&Q.mutex); \
-})
+// YUV to RGB for the frame's color properties, limited range is stretched to
+// full and unspecified matrices are guessed from the height like players do
+void yuv_set_colorspace(YuvRender *r, const AVFrame *frame)
+{
+    float kr, kb;
+    enum AVColorSpace space = frame->colorspace;
+    if (space == AVCOL_SPC_UNSPECIFIED)
+        space = frame->height > 576 ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+    switch (space) {
+    case AVCOL_SPC_BT709:
+        kr = 0.2126f, kb = 0.0722f;
+        break;
+    case AVCOL_SPC_BT2020_NCL:
+    case AVCOL_SPC_BT2020_CL:
+        kr = 0.2627f, kb = 0.0593f;
+        break;
+    default: // BT.601 and whatever else
+        kr = 0.299f, kb = 0.114f;
+        break;
+    }
+    bool full = frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P ||
+        frame->format == AV_PIX_FMT_YUVJ422P || frame->format == AV_PIX_FMT_YUVJ444P;
+    float ys = full ? 1.0f : 255.0f / 219.0f;
+    float cs = full ? 1.0f : 255.0f / 224.0f;
+    float kg = 1.0f - kr - kb;
+    float rows[3][3] = {
+        {ys, 0.0f, 2.0f * (1.0f - kr) * cs},
+        {ys, -2.0f * kb * (1.0f - kb) / kg * cs, -2.0f * kr * (1.0f - kr) / kg * cs},
+        {ys, 2.0f * (1.0f - kb) * cs, 0.0f},
+    };
+    float offset[3] = {full ? 0.0f : 16.0f / 255.0f, 128.0f / 255.0f, 128.0f / 255.0f};
+    for (int i = 0; i < 3; i++)
+        SetShaderValue(r->shader, r->row_locs[i], rows[i], SHADER_UNIFORM_VEC3);
+    SetShaderValue(r->shader, r->offset_loc, offset, SHADER_UNIFORM_VEC3);
+    r->colorspace = frame->colorspace;
+    r->range = frame->color_range;
+}
 
-#define DEQUEUE(Q) ({ \
-    pthread_mutex_lock(&Q.mutex); \
-    __typeof__(*Q.items) _V = Q.items[Q.rindex]; \
-    if (++Q.rindex >= Q.cap) Q.rindex = 0; \
-    pthread_mutex_unlock(&Q.mutex); \
-    _V; \
-})
+// upload the planes of a frame yuv_frame_supported took, the textures are
+// recreated when the layout changes
+void yuv_upload(YuvRender *r, const AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    bool nv12 = frame->format == AV_PIX_FMT_NV12;
+    int planes = nv12 ? 2 : 3;
+    int chroma_width = AV_CEIL_RSHIFT(frame->width, desc->log2_chroma_w);
+    int chroma_height = AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h);
+    int widths[3] = {frame->linesize[0], nv12 ? frame->linesize[1] / 2 : frame->linesize[1],
+                     frame->linesize[2]};
+    int heights[3] = {frame->height, chroma_height, chroma_height};
+
+    bool layout = frame->format != r->format || frame->width != r->width ||
+        frame->height != r->height;
+    for (int i = 0; i < planes; i++)
+        layout = layout || widths[i] != r->planes[i].width || heights[i] != r->planes[i].height;
+    if (!layout) {
+        for (int i = 0; i < planes; i++) UpdateTexture(r->planes[i], frame->data[i]);
+    } else {
+        LOG("Drawing %dx%d %s through the YUV shader", frame->width, frame->height, desc->name);
+        for (int i = 0; i < 3; i++) {
+            if (r->planes[i].id != 0) UnloadTexture(r->planes[i]);
+            r->planes[i] = (Texture){0};
+        }
+        for (int i = 0; i < planes; i++) {
+            Image img = {
+                .width = widths[i],
+                .height = heights[i],
+                .mipmaps = 1,
+                .format = nv12 && i == 1 ? PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA
+                                         : PIXELFORMAT_UNCOMPRESSED_GRAYSCALE,
+                .data = frame->data[i],
+            };
+            r->planes[i] = LoadTextureFromImage(img);
+            SetTextureFilter(r->planes[i], TEXTURE_FILTER_BILINEAR);
+            // the last row mustn't blend with the first
+            SetTextureWrap(r->planes[i], TEXTURE_WRAP_CLAMP);
+        }
+        r->format = frame->format;
+        r->width = frame->width;
+        r->height = frame->height;
+        // texture coordinates are in the luma texture, which is padded differently
+        float chroma_scale[2] = {
+            (float)widths[0] * chroma_width / (frame->width * (float)widths[1]), 1.0f,
+        };
+        int is_nv12 = nv12;
+        SetShaderValue(r->shader, r->chroma_scale_loc, chroma_scale, SHADER_UNIFORM_VEC2);
+        SetShaderValue(r->shader, r->nv12_loc, &is_nv12, SHADER_UNIFORM_INT);
+        // the format may carry the range
+        r->colorspace = AVCOL_SPC_NB;
+    }
+    if (frame->colorspace != r->colorspace || frame->color_range != r->range)
+        yuv_set_colorspace(r, frame);
+}
 
-#define QUEUE_PEEK(Q) ({ \
-    pthread_mutex_lock(&Q.mutex); \
-    __typeof__(*Q.items) _V = Q.items[Q.rindex]; \
-    pthread_mutex_unlock(&Q.mutex); \
-    _V; \
-})
+void yuv_draw(YuvRender *r, Rectangle dst)
+{
+    BeginShaderMode(r->shader);
+    SetShaderValueTexture(r->shader, r->u_loc, r->planes[1]);
+    if (r->planes[2].id != 0) SetShaderValueTexture(r->shader, r->v_loc, r->planes[2]);
+    Rectangle src = {0, 0, r->width, r->height};
+    DrawTexturePro(r->planes[0], src, dst, (Vector2){0}, 0, WHITE);
+    EndShaderMode();
+}
 
-typedef struct {
-    AVFormatContext *format_ctx;
-    AVFormatContext *format_ctx2; // used for split audio
-
-    // Codecs
-    AVCodecContext *v_ctx;
-    int v_index;
-    AVCodecContext *a_ctx;
-    int a_index;
-
-    AVFrame *out_frame;
-    struct SwsContext *sws_ctx;
-    AudioStream audio_stream;
-    int a_buffer_size;
-    float volume;
-    int sample_size;
-    SwrContext *swr_ctx;
-
-    // state stuff
-    bool is_split;
-    bool video_active;
-    bool decoding_active;
-    bool io_active;
-    bool paused;
-    bool muted;
-
-    // clock
-    int64_t video_clock;
-    int64_t audio_clock;
-    int fps;
-    double duration;
-} VideoContext;
-
-#define FRAME_QUEUE_CAP 32
-typedef struct FrameQueue {
-    AVFrame **items;
-    int cap;
-    int windex;
-    int rindex;
-    pthread_mutex_t mutex;
-} FrameQueue;
-
-#define PACKET_QUEUE_CAP 64
-typedef struct PacketQueue {
-    AVPacket **items;
-    int cap;
-    int windex;
-    int rindex;
-    pthread_mutex_t mutex;
-} PacketQueue;
+// true if a new frame was uploaded
+bool update_frames(Texture *surface, VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    if (playlist_update(ctx)) SetWindowTitle(p->playlist[p->playlist_index]);
+    // video finished, the last frame stays up while the next item is still opening
+    if (ctx->video_active && video_finished(ctx) && p->playlist_index + 1 >= p->playlist_count) {
+        ctx->video_active = false;
+        return false;
+    }
 
-// Globals
-PacketQueue packets = {0};
-PacketQueue packets2 = {0};
-FrameQueue v_queue = {0};
-FrameQueue a_queue = {0};
-uint8_t *audio_buffer = NULL;
+    drop_stale_frames(ctx, &p->rgb_queue, false);
+    // the audio callback feeds itself, the render loop only follows the clock
+    double now = now_ms() / 1000.0;
+    ctx->clock = master_time(ctx, now);
+    sync_audio(ctx, now);
+    if (now - p->sync_stats.last_log >= SYNC_LOG_INTERVAL) {
+        if (p->sync_stats.last_log > 0.0) sync_log(p);
+        p->sync_stats.last_log = now;
+    }
 
-bool pressed_last_frame = false;
-int press_frame_count = 0;
+    AVFrame *frame;
+    if ((!ctx->paused || ctx->step_frame) && !QUEUE_EMPTY(p->rgb_queue)) {
+        frame = QUEUE_PEEK(p->rgb_queue);
+        assert(frame != NULL);
+        double next_ts = frame->pts / (double)AV_TIME_BASE;
+        if (ctx->clock >= next_ts || ctx->step_frame) {
+            sync_video(ctx, next_ts, now, ctx->step_frame);
+            atomic_store(&ctx->step_frame, false);
 
-// flags
-bool quiet = false;
+            // already converted, just upload
+            if (frame->data[0] == NULL) ERROR("NULL Frame");
+            double start = trace_now();
+            yuv_render.active = frame->format != AV_PIX_FMT_RGB24;
+            if (yuv_render.active) {
+                // planes straight from the decoder, the shader does the rest
+                yuv_upload(&yuv_render, frame);
+                trace_span("UpdateTexture", start);
+            } else if (frame->width != surface->width || frame->height != surface->height) {
+                // the conversion size changed so the texture follows
+                UnloadTexture(*surface);
+                Image img = {
+                    .width = frame->width,
+                    .height = frame->height,
+                    .mipmaps = 1,
+                    .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8,
+                    .data = frame->data[0],
+                };
+                *surface = LoadTextureFromImage(img);
+                SetTextureFilter(*surface, TEXTURE_FILTER_BILINEAR);
+                trace_span("LoadTextureFromImage", start);
+            } else {
+                UpdateTexture(*surface, frame->data[0]);
+                trace_span("UpdateTexture", start);
+            }
+            QUEUE_POP(p->rgb_queue);
+            if (startup_mark(p, PHASE_FIRST_PRESENTED)) startup_log(p);
+            return true;
+        }
+    }
+    return false;
+}
 
 char *get_time_string(char *buf, int seconds)
 {
@@ -155,353 +311,73 @@ char *get_time_string(char *buf, int seconds)
     }
 
 }
- 
-// initialize format context from youtube url
-#define BUF_MAX_LEN 2048
-#define DEFAULT_ARGS "-f \"b*[height<=1080]+ba\""
-void init_format_yt(VideoContext *ctx, char *video_file, char *yt_dlp_args)
-{
-    LOG("initializing youtube streaming...");
-
-    char cmd[BUF_MAX_LEN];
-    if (yt_dlp_args == NULL) yt_dlp_args = DEFAULT_ARGS;
-    snprintf(cmd, BUF_MAX_LEN, "yt-dlp %s --get-url %s", yt_dlp_args, video_file);
-    FILE *yt_stdout = popen(cmd, "r");
-    if (yt_stdout == NULL) ERROR("popen");
-
-    // Read the urls from yt-dlp stdout
-    char url_buf[BUF_MAX_LEN];
-    char url_buf2[BUF_MAX_LEN];
-    fgets(url_buf, BUF_MAX_LEN, yt_stdout);
-    char *ret = fgets(url_buf2, BUF_MAX_LEN, yt_stdout);
-
-    if (pclose(yt_stdout) != 0) ERROR("failed to retrieve video with yt-dlp");
-
-    // open the video file from url
-    ctx->format_ctx = avformat_alloc_context();
-    if (avformat_open_input(&ctx->format_ctx, url_buf, NULL, NULL) != 0)
-        ERROR("Could not open youtube video %s", video_file);
-    if (avformat_find_stream_info(ctx->format_ctx, NULL) < 0)
-        ERROR("Could not find stream info");
 
-    // if two streams were returned open the audio file into format_ctx2
-    if (ret != NULL) {
-        ctx->format_ctx2 = avformat_alloc_context();
-        ctx->is_split = true;
-        if (avformat_open_input(&ctx->format_ctx2, url_buf2, NULL, NULL) != 0)
-            ERROR("Could not open youtube video %s", video_file);
-        if (avformat_find_stream_info(ctx->format_ctx2, NULL) < 0)
-            ERROR("Could not find stream info");
-    }
+// seek bar above the time display, rect is the video rect
+Rectangle timeline_rect(Rectangle rect)
+{
+    float font_size = rect.height * TIME_FONT_SCALE;
+    float padding = font_size*0.2f;
+    float height = font_size * TIMELINE_SCALE;
+    return (Rectangle){
+        .x = rect.x + padding,
+        .y = rect.y + rect.height - font_size - 3*padding - height,
+        .width = rect.width - 2*padding,
+        .height = height,
+    };
 }
 
-// youtube also has the youtu.be domain
-#define YT_DOMAINS {"https://www.youtu", "https://youtu", "youtu"}
-// TODO: parse url for timestamp to seek to
-void init_av_streaming(VideoContext *ctx, char *video_file, char *yt_dlp_args)
+// where the mouse counts as on the timeline, with some slack above and below the bar
+Rectangle timeline_hit_rect(Rectangle timeline)
 {
-    av_log_set_level(AV_LOG_ERROR);
-    //---Format---
-    bool yt_url = false;
-    const char *domains[] = YT_DOMAINS;
-    for (int i = 0; i < 3; i++) {
-        if (strncmp(video_file, domains[i], strlen(domains[i])) == 0)
-            yt_url = true;
-    }
-    if (yt_url || yt_dlp_args != NULL) {
-        init_format_yt(ctx, video_file, yt_dlp_args);
-    } else {
-        LOG("Loading Video");
-        ctx->format_ctx = avformat_alloc_context();
-        // allocate format context and read format from file
-        if (avformat_open_input(&ctx->format_ctx, video_file, NULL, NULL) != 0)
-            ERROR("Could not open video file %s", video_file);
-
-        // find the streams in the format
-        if (avformat_find_stream_info(ctx->format_ctx, NULL) < 0)
-            ERROR("Could not find stream info");
-    }
-    LOG("Format %s%s", ctx->format_ctx->iformat->long_name,
-        ctx->is_split ? " | split stream" : "");
-
-    //---Codecs---
-    int ret;
-    const AVCodec *codec;
-
-    // find video stream
-    ret = av_find_best_stream(ctx->format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
-    if (ret < 0 && ctx->is_split) {
-        ret = av_find_best_stream(ctx->format_ctx2, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
-        if (ret < 0) ERROR("Could not find a video stream");
-        // swap so that video is in ctx 1
-        AVFormatContext *tmp = ctx->format_ctx;
-        ctx->format_ctx = ctx->format_ctx2;
-        ctx->format_ctx2 = tmp;
-    }
-    ctx->v_index = ret;
-    ctx->v_ctx = avcodec_alloc_context3(codec);
-    // create vido codec ctx
-    if (avcodec_parameters_to_context(ctx->v_ctx, 
-        ctx->format_ctx->streams[ctx->v_index]->codecpar) < 0)
-        ERROR("could not create video codec context");
-
-    // setup fps and time_base for vido ctx
-    AVRational framerate = ctx->format_ctx->streams[ctx->v_index]->avg_frame_rate;
-    ctx->fps = framerate.num / framerate.den;
-    ctx->duration = (double)ctx->format_ctx->duration / AV_TIME_BASE;
-    ctx->v_ctx->time_base = ctx->format_ctx->streams[ctx->v_index]->time_base;
-    LOG("Video %dx%d at %dfps", ctx->v_ctx->width, ctx->v_ctx->height, ctx->fps);
-    LOG("Codec %s ID %d", codec->long_name, codec->id);
-
-    // initialize audio codec
-    // if we are using seperated streams then audio must be in context 2
-    AVFormatContext *audio_ctx = ctx->is_split ? ctx->format_ctx2 : ctx->format_ctx;
-
-    ctx->a_index = av_find_best_stream(audio_ctx, AVMEDIA_TYPE_AUDIO, -1, ctx->v_index, &codec, 0);
-    if (ctx->a_index < 0) ERROR("Could not find audio stream");
-    ctx->a_ctx = avcodec_alloc_context3(codec);
-    if (avcodec_parameters_to_context(ctx->a_ctx,
-        audio_ctx->streams[ctx->a_index]->codecpar) < 0)
-        ERROR("could not create audio codec context");
-    if (ctx->a_index == ctx->v_index) ctx->a_index++;
-
-    LOG("Audio %d chanels, sample rate %dHZ, sample fmt %s", 
-        ctx->a_ctx->ch_layout.nb_channels, ctx->a_ctx->sample_rate, 
-        av_get_sample_fmt_name(ctx->a_ctx->sample_fmt));
-    LOG("Codec %s ID %d", codec->long_name, codec->id);
-
-    // open the initialized codecs for use
-    if (avcodec_open2(ctx->v_ctx, ctx->v_ctx->codec, NULL) < 0)
-        ERROR("Could not open video codec");
-    if (avcodec_open2(ctx->a_ctx, ctx->a_ctx->codec, NULL) < 0)
-        ERROR("Could not open audio codec");
-     
-    return;
-}
-
-void deinit_av_streaming(VideoContext *ctx)
-{
-    // free queues
-    for (int i = 0; i < v_queue.cap; i++)
-        av_frame_free(&v_queue.items[i]);
-    for (int i = 0; i < a_queue.cap; i++)
-        av_frame_free(&a_queue.items[i]);
-    for (int i = 0; i < packets.cap; i++)
-        av_packet_free(&packets.items[i]);
-
-    av_frame_unref(ctx->out_frame);
-    av_frame_free(&ctx->out_frame);
-    avcodec_free_context(&ctx->v_ctx);
-    avcodec_free_context(&ctx->a_ctx);
-    avformat_close_input(&ctx->format_ctx);
-    avformat_free_context(ctx->format_ctx);
-    if (ctx->is_split) {
-        for (int i = 0; i < packets2.cap; i++)
-            av_packet_free(&packets2.items[i]);
-        avformat_close_input(&ctx->format_ctx2);
-        avformat_free_context(ctx->format_ctx2);
-    }
-    sws_freeContext(ctx->sws_ctx);
-    swr_close(ctx->swr_ctx);
-    swr_free(&ctx->swr_ctx);
-    av_free(audio_buffer);
-    audio_buffer = NULL;
-}
-
-void init_frame_conversion(VideoContext *ctx)
-{
-    int ret;
-
-    // Pixel conversion
-    enum AVPixelFormat format = ctx->v_ctx->pix_fmt;
-    int vid_width = ctx->v_ctx->width, vid_height = ctx->v_ctx->height;
-    ctx->sws_ctx = sws_getContext(vid_width, vid_height, format, 
-                                                vid_width, vid_height, AV_PIX_FMT_RGB24,
-                                                SWS_BILINEAR, NULL, NULL, NULL);
-    if (ctx->sws_ctx == NULL)
-        ERROR("Failed to get sws context");
-
-    ctx->out_frame = av_frame_alloc();
-    ctx->out_frame->width = vid_width;
-    ctx->out_frame->height = vid_height;
-    ctx->out_frame->format = AV_PIX_FMT_RGB24;
-    // allocate the image data and make sure the data is alligned to 1 byte
-    if (av_image_alloc(ctx->out_frame->data, ctx->out_frame->linesize,
-                       ctx->out_frame->width, ctx->out_frame->height,
-                       ctx->out_frame->format, 1) < 0) {
-        ERROR("Failed to allocate image buffer\n");
-    }
-
-    // Sample conversion
-    ret = swr_alloc_set_opts2(&ctx->swr_ctx, &ctx->a_ctx->ch_layout, AV_SAMPLE_FMT_FLT,
-                        ctx->a_ctx->sample_rate, &ctx->a_ctx->ch_layout,
-                        ctx->a_ctx->sample_fmt, ctx->a_ctx->sample_rate, 0, NULL);
-    if (ret < 0) ERROR("Could not alloc swresample");
-    if (swr_init(ctx->swr_ctx) < 0) ERROR("Could not init swresample");
-}
-
-void *io_thread_func(void *arg)
-{
-    VideoContext *ctx = (VideoContext *)arg;
-    AVPacket *packet;
-    bool done = false;
-    int ret = 0;
-
-    while (true) {
-        if (IsWindowReady() && WindowShouldClose()) break;
-
-        if (!QUEUE_FULL(packets)) {
-            QUEUE_BACK(packets, packet);
-            ret = av_read_frame(ctx->format_ctx, packet);
-            if (ret == AVERROR_EOF) {
-                done = true;
-            }
-            else if (ret < 0) {
-                WARN("reading frame, %s", av_err2str(ret));
-            } else {
-                QUEUE_INC(packets);
-            }
-        }
-        if (ctx->is_split) {
-            if (QUEUE_FULL(packets2)) continue;
-            QUEUE_BACK(packets2, packet);
-            ret = av_read_frame(ctx->format_ctx2, packet);
-            if (ret == AVERROR_EOF && done) {
-                break;
-            } else if (ret < 0 && ret != AVERROR_EOF) {
-                WARN("reading audio frame, %s", av_err2str(ret));
-            } else {
-                packet->stream_index = ctx->a_index;
-                QUEUE_INC(packets2);
-            }
-        } else if (done) break;
-    }
-    ctx->io_active = false;
-    return NULL;
+    return (Rectangle){timeline.x, timeline.y - timeline.height, timeline.width, 3*timeline.height};
 }
 
-void decode(AVPacket *packet, FrameQueue *queue, AVCodecContext *codec_ctx, bool *done)
+// bring the thumbnail texture up to date with the cells the thread finished
+void thumbs_upload(ThumbAtlas *thumbs)
 {
-    // Video
-    int ret;
-    ret = avcodec_send_packet(codec_ctx, packet);
-    if (ret != 0 && ret != AVERROR_EOF && ret != AVERROR(EAGAIN)) {
-        WARN("sending packet, %s", av_err2str(ret));
-        return;
+    ThumbTexture *tex = &thumb_texture;
+    if (tex->texture.id != 0 && (thumbs->pixels == NULL || tex->generation != thumbs->generation)) {
+        UnloadTexture(tex->texture);
+        tex->texture = (Texture){0};
     }
-    AVFrame *frame;
-    QUEUE_BACK((*queue), frame);
-    while(!QUEUE_FULL((*queue)) && (ret = avcodec_receive_frame(codec_ctx, frame)) == 0) {
-        QUEUE_INC((*queue));
-        QUEUE_BACK((*queue), frame);
+    if (thumbs->pixels == NULL) return;
+    if (tex->texture.id == 0) {
+        int rows = (thumbs->count + THUMB_COLUMNS - 1) / THUMB_COLUMNS;
+        int width = THUMB_COLUMNS * thumbs->width, height = rows * thumbs->height;
+        unsigned char *black = av_mallocz((size_t)width * height * 3);
+        if (black == NULL) return;
+        Image img = {
+            .width = width,
+            .height = height,
+            .mipmaps = 1,
+            .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8,
+            .data = black,
+        };
+        tex->texture = LoadTextureFromImage(img);
+        SetTextureFilter(tex->texture, TEXTURE_FILTER_BILINEAR);
+        av_free(black);
+        tex->generation = thumbs->generation;
+        tex->uploaded = 0;
     }
-    if (ret == AVERROR_EOF) {
-        // Video done
-        *done = true;
-    } else if (ret < 0 && ret != AVERROR(EAGAIN)) {
-        WARN("receiving frame, %s", av_err2str(ret));
+    int filled = atomic_load_explicit(&thumbs->filled, memory_order_acquire);
+    for (; tex->uploaded < filled; tex->uploaded++) {
+        int i = tex->uploaded;
+        Rectangle cell = {(i % THUMB_COLUMNS) * thumbs->width, (i / THUMB_COLUMNS) * thumbs->height,
+            thumbs->width, thumbs->height};
+        UpdateTextureRec(tex->texture, cell, thumbs->pixels + (size_t)i * thumbs->width * thumbs->height * 3);
     }
 }
 
-void *decode_thread_func(void *arg)
-{
-    VideoContext *ctx = (VideoContext *)arg;
-    bool video_done = false, audio_done = false;
-
-    while (ctx->decoding_active) {
-        if (IsWindowReady() && WindowShouldClose()) break;
-
-        AVPacket *packet;
-        if (!QUEUE_EMPTY(packets)) {
-            packet = QUEUE_PEEK(packets);
-            if (!QUEUE_FULL(v_queue) && packet->stream_index == ctx->v_index) {
-                packet = DEQUEUE(packets);
-                decode(packet, &v_queue, ctx->v_ctx, &video_done);
-            } else if (!ctx->is_split && !QUEUE_FULL(a_queue) && packet->stream_index == ctx->a_index) {
-                packet = DEQUEUE(packets);
-                decode(packet, &a_queue, ctx->a_ctx, &audio_done);
-            }
-        } else if (!ctx->io_active) {
-            ctx->decoding_active = false;
-            LOG("VIDEO DECODING DONE");
-            break;
-        }
-        if (ctx->is_split && !QUEUE_EMPTY(packets2) && !QUEUE_FULL(a_queue)) {
-            packet = DEQUEUE(packets2);
-            decode(packet, &a_queue, ctx->a_ctx, &audio_done);
-        }
-
-        if (audio_done && video_done) {
-            ctx->decoding_active = false;
-            LOG("VIDEO DECODING DONE");
-            break;
-        }
-    }
-    LOG("DONE");
-    return NULL;
-}
-
-void start_threads(VideoContext *ctx)
+// how far the network caches reach together, -1 for local inputs
+float cache_fill(VideoContext *ctx)
 {
-    pthread_t io_thread, decode_thread;
-    pthread_mutex_init(&packets.mutex, NULL);
-    pthread_mutex_init(&v_queue.mutex, NULL);
-    pthread_mutex_init(&a_queue.mutex, NULL);
-    pthread_create(&io_thread, NULL, io_thread_func, ctx);
-    pthread_create(&decode_thread, NULL, decode_thread_func, ctx);
-    pthread_detach(io_thread);
-    pthread_detach(decode_thread);
-
-    ctx->decoding_active = true;
-    ctx->video_active = true;
-    ctx->io_active = true;
-}
-
-void update_frames(Texture surface, VideoContext *ctx)
-{
-    // video finished
-    if (!ctx->decoding_active && ctx->video_active && QUEUE_EMPTY(v_queue)) {
-        ctx->video_active = false;
-        return;
+    float fill = -1.0f;
+    if (ctx->net_cache != NULL) fill = net_cache_fill(ctx->net_cache);
+    if (ctx->net_cache2 != NULL && fill >= 0.0f) {
+        float fill2 = net_cache_fill(ctx->net_cache2);
+        if (fill2 < fill) fill = fill2;
     }
-
-    //LOG("%d %d %d %d", QUEUE_SIZE(packets), QUEUE_SIZE(packets2), QUEUE_SIZE(v_queue), QUEUE_SIZE(a_queue));
-    AVFrame *frame;
-    if (!QUEUE_EMPTY(a_queue) && IsAudioStreamProcessed(ctx->audio_stream)) {
-        pthread_mutex_lock(&a_queue.mutex);
-        frame = a_queue.items[a_queue.rindex];
-        a_queue.rindex = (a_queue.rindex + 1) % a_queue.cap;
-
-        swr_convert(ctx->swr_ctx, &audio_buffer, ctx->a_buffer_size,
-                              (const uint8_t **)frame->data, frame->nb_samples);
-
-        ctx->audio_clock += frame->nb_samples;
-        UpdateAudioStream(ctx->audio_stream, audio_buffer, frame->nb_samples);
-        av_frame_unref(frame);
-        pthread_mutex_unlock(&a_queue.mutex);
-    }
-    if (!QUEUE_EMPTY(v_queue)) {
-        pthread_mutex_lock(&v_queue.mutex);
-        frame = v_queue.items[v_queue.rindex];
-        assert(frame != NULL);
-        double next_ts = frame->pts * av_q2d(ctx->v_ctx->time_base);
-        double audio_time = (double)ctx->audio_clock / ctx->audio_stream.sampleRate;
-        if (audio_time >= next_ts) {
-            ctx->video_clock = frame->pts;
-            v_queue.rindex = (v_queue.rindex + 1) % v_queue.cap;
-            pthread_mutex_unlock(&v_queue.mutex);
-
-            // convert to rgb and update video
-            if (frame->data[0] == NULL) ERROR("NULL Frame");
-            sws_scale_frame(ctx->sws_ctx, ctx->out_frame, frame);
-            UpdateTexture(surface, ctx->out_frame->data[0]);
-
-            av_frame_unref(frame);
-        } else {
-            pthread_mutex_unlock(&v_queue.mutex);
-        }
-    } 
-
+    return fill;
 }
 
 void render_ui(VideoContext *ctx, Rectangle rect)
@@ -513,7 +389,8 @@ void render_ui(VideoContext *ctx, Rectangle rect)
 
     // Time
     float padding = font_size*0.2f;
-    int current_time = ctx->audio_clock / ctx->audio_stream.sampleRate;
+    double position = ctx->clock - ctx->offset;
+    int current_time = position > 0.0 ? position : 0;
     char buf1[128], buf2[128];
     char *cur_time_str = get_time_string(buf1, current_time);
     char *dur_str = get_time_string(buf2, ctx->duration);
@@ -526,6 +403,51 @@ void render_ui(VideoContext *ctx, Rectangle rect)
     DrawRectangleRounded(time_rect, 0.4f, 20, faded_black);
     DrawText(text, right - text_width, bottom - font_size, font_size, RAYWHITE);
 
+    // Timeline
+    if (ctx->duration > 0.0) {
+        Rectangle timeline = timeline_rect(rect);
+        DrawRectangleRec(timeline, faded_black);
+        // how far the network cache reaches, bytes are taken as proportional to time
+        float fill = cache_fill(ctx);
+        if (fill > 0.0f) {
+            Rectangle cached = timeline;
+            cached.width *= fill;
+            DrawRectangleRec(cached, (Color){200, 200, 200, 120});
+        }
+        float progress = position / ctx->duration;
+        Rectangle played = timeline;
+        played.width *= progress > 1.0f ? 1.0f : progress;
+        DrawRectangleRec(played, RAYWHITE);
+
+        // preview of where a click would seek to, the keyframe at or before it
+        Vector2 mouse = GetMousePosition();
+        ThumbAtlas *thumbs = &ctx->player->thumbs;
+        thumbs_upload(thumbs);
+        if (thumb_texture.texture.id != 0 && CheckCollisionPointRec(mouse, timeline_hit_rect(timeline))) {
+            double hover = ctx->duration * (mouse.x - timeline.x) / timeline.width;
+            int cell = hover / thumbs->interval;
+            if (cell >= 0 && cell < thumb_texture.uploaded) {
+                float height = rect.height * THUMB_SCALE;
+                float width = height * thumbs->width / thumbs->height;
+                float x = mouse.x - width / 2;
+                if (x < rect.x + padding) x = rect.x + padding;
+                if (x > right - width - padding) x = right - width - padding;
+                Rectangle dst = {x, timeline.y - 2*padding - height, width, height};
+                Rectangle src = {(cell % THUMB_COLUMNS) * thumbs->width,
+                    (cell / THUMB_COLUMNS) * thumbs->height, thumbs->width, thumbs->height};
+                DrawTexturePro(thumb_texture.texture, src, dst, (Vector2){0}, 0, WHITE);
+                DrawRectangleLinesEx(dst, 1.0f, RAYWHITE);
+                const char *hover_str = get_time_string(buf1, hover);
+                int hover_width = MeasureText(hover_str, font_size);
+                DrawRectangle(dst.x + (width - hover_width) / 2 - padding,
+                              dst.y + height - font_size - padding, hover_width + 2*padding,
+                              font_size + padding, faded_black);
+                DrawText(hover_str, dst.x + (width - hover_width) / 2,
+                         dst.y + height - font_size, font_size, RAYWHITE);
+            }
+        }
+    }
+
     // Volume
     // TODO: icon
     font_size *= 0.8f;
@@ -535,10 +457,10 @@ void render_ui(VideoContext *ctx, Rectangle rect)
     volume_bar = (Rectangle){
         .x = rect.x + padding,
         .y = bottom - font_size + padding,
-        .width = (ctx->volume / MAX_VOLUME) * max_width - 2*padding,
+        .width = (volume / MAX_VOLUME) * max_width - 2*padding,
         .height = font_size - 2*padding
     };
-    Color color = ctx->muted ? GRAY : RAYWHITE;
+    Color color = muted ? GRAY : RAYWHITE;
     DrawRectangleRounded(volume_bar, 0.4f, 20, color);
 
     // Pause
@@ -565,95 +487,815 @@ void render_ui(VideoContext *ctx, Rectangle rect)
 
 }
 
-void main_loop(VideoContext *ctx, Texture surface)
+// pick the conversion size for the displayed height, growing right away but
+// only shrinking once the window has stayed smaller for a while
+void update_output_size(VideoContext *ctx, int display_height)
 {
-    PlayAudioStream(ctx->audio_stream);
-    while (!WindowShouldClose()) {
-        //float dt = GetFrameTime();
+    ctx->display_height = display_height;
+    int want = bucket_height(ctx->v_ctx->height, display_height);
+    int current = atomic_load(&ctx->out_height);
+    if (want > current) {
+        atomic_store(&ctx->out_height, want);
+        ctx->shrink_since = 0.0;
+    } else if (want < current) {
+        double now = GetTime();
+        if (ctx->shrink_since == 0.0) {
+            ctx->shrink_since = now;
+        } else if (now - ctx->shrink_since >= OUTPUT_SHRINK_DELAY) {
+            atomic_store(&ctx->out_height, want);
+            ctx->shrink_since = 0.0;
+        }
+    } else {
+        ctx->shrink_since = 0.0;
+    }
+}
+
+// largest rect of the video's aspect centered in area
+Rectangle fit_rect(Rectangle area, int vid_width, int vid_height)
+{
+    float width = area.height * vid_width / vid_height;
+    float height = area.height;
+    if (area.width < width) {
+        width = area.width;
+        height = area.width * vid_height / vid_width;
+    }
+    return (Rectangle){(int)(area.x + (area.width - width) / 2), (int)(area.y + (area.height - height) / 2),
+                       (int)width, (int)height};
+}
+
+// columns and rows of the grid, the main video is cell wall_audio and the
+// tiles fill the others in the order they were given
+void wall_grid(int *cols, int *rows)
+{
+    int cells = video_wall.count + 1;
+    *cols = (int)ceil(sqrt(cells));
+    *rows = (cells + *cols - 1) / *cols;
+}
+
+Rectangle wall_cell(Rectangle screen, int cell)
+{
+    int cols, rows;
+    wall_grid(&cols, &rows);
+    float width = screen.width / cols, height = screen.height / rows;
+    return (Rectangle){screen.x + (cell % cols) * width, screen.y + (cell / cols) * height, width, height};
+}
+
+int wall_tile_cell(int tile)
+{
+    return tile < wall_audio ? tile : tile + 1;
+}
 
-        if (!ctx->paused && ctx->video_active)
-            update_frames(surface, ctx);
+// Present the frame of every tile that is due on the clock of ctx, all
+// uploads happen here before anything is drawn. The tiles follow its clock
+// and pausing, their converters drop what it has passed. Without a window the
+// frames are only counted, and without real-time pacing every one is due.
+// True if a texture changed.
+bool wall_update(Rectangle screen, VideoContext *ctx, bool upload)
+{
+    bool paced = !bench_mode || bench_realtime;
+    double clock = paced ? ctx->clock : INFINITY;
+    bool uploaded = false;
+    for (int i = 0; i < video_wall.count; i++) {
+        WallTile *t = &video_wall.tiles[i];
+        if (atomic_load(&t->state) != TILE_OPEN) continue;
+        JPlayer *tile = t->player;
+        VideoContext *tile_ctx = &tile->ctx;
+        if (paced) tile_ctx->clock = clock;
+        set_paused(tile_ctx, ctx->paused);
+        WallView *view = &wall_views[i];
+        view->dst = fit_rect(wall_cell(screen, wall_tile_cell(i)), tile->info.width, tile->info.height);
+        atomic_store(&tile_ctx->out_height, bucket_height(tile->info.height, view->dst.height));
+
+        int serial = atomic_load(&tile_ctx->serial);
+        drop_stale_frames(tile_ctx, &tile->rgb_queue, false);
+        // frames that are due, the first after opening or seeking is shown right away
+        int size = QUEUE_SIZE(tile->rgb_queue);
+        int rindex = atomic_load_explicit(&tile->rgb_queue.rindex, memory_order_relaxed);
+        int due = 0;
+        for (; due < size; due++) {
+            AVFrame *frame = tile->rgb_queue.items[(rindex + due) % tile->rgb_queue.cap];
+            bool first = due == 0 && t->shown_serial != serial;
+            if (frame->pts / (double)AV_TIME_BASE > clock && !first) break;
+        }
+        if (due == 0) continue;
+        t->shown_serial = serial;
+        atomic_store(&tile_ctx->step_frame, false);
+        if (!upload) {
+            for (int j = 0; j < due; j++) QUEUE_POP(tile->rgb_queue);
+            t->presented += due;
+            continue;
+        }
+        // only the latest is worth uploading
+        for (int j = 0; j < due - 1; j++) QUEUE_POP(tile->rgb_queue);
+        t->dropped += due - 1;
+        AVFrame *frame = QUEUE_PEEK(tile->rgb_queue);
+        double start = trace_now();
+        if (view->texture.id == 0 || frame->width != view->texture.width ||
+            frame->height != view->texture.height) {
+            if (view->texture.id != 0) UnloadTexture(view->texture);
+            Image img = {
+                .width = frame->width,
+                .height = frame->height,
+                .mipmaps = 1,
+                .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8,
+                .data = frame->data[0],
+            };
+            view->texture = LoadTextureFromImage(img);
+            SetTextureFilter(view->texture, TEXTURE_FILTER_BILINEAR);
+            trace_span("LoadTextureFromImage", start);
+        } else {
+            UpdateTexture(view->texture, frame->data[0]);
+            trace_span("UpdateTexture", start);
+        }
+        QUEUE_POP(tile->rgb_queue);
+        t->presented++;
+        uploaded = true;
+    }
+    return uploaded;
+}
+
+void wall_draw(void)
+{
+    for (int i = 0; i < video_wall.count; i++) {
+        WallView *view = &wall_views[i];
+        if (view->texture.id == 0) continue;
+        Rectangle src = {0, 0, view->texture.width, view->texture.height};
+        DrawTexturePro(view->texture, src, view->dst, (Vector2){0}, 0, WHITE);
+    }
+}
+
+// the tiles and their textures, wall_start gave them their inputs
+void wall_views_init(void)
+{
+    if (video_wall.count == 0) return;
+    wall_views = av_calloc(video_wall.count, sizeof(WallView));
+    if (wall_views == NULL) ERROR("out of memory");
+}
+
+void wall_views_free(void)
+{
+    for (int i = 0; i < video_wall.count && wall_views != NULL; i++) {
+        if (wall_views[i].texture.id != 0) UnloadTexture(wall_views[i].texture);
+    }
+    av_freep(&wall_views);
+}
+
+// Sleep until deadline, seconds on the now_ms() clock. When frames is set the
+// converter of p publishing one ends it early.
+void render_wait(JPlayer *p, double deadline, bool frames)
+{
+    double wait = deadline - now_ms() / 1000.0;
+    if (wait <= 0.0) return;
+    double start = trace_now();
+    if (frames) {
+        long ms = wait * 1000.0 + 1.0;
+        QUEUE_WAIT_MS(p->rgb_queue, !QUEUE_EMPTY(p->rgb_queue) || atomic_load(&p->failed), ms);
+    } else {
+        struct timespec t = {(time_t)wait, (wait - (time_t)wait) * 1e9};
+        nanosleep(&t, NULL);
+    }
+    trace_span("render_wait", start);
+}
+
+// the pipeline seeks, the device throws away what it has buffered and the
+// tiles go to the same point on their own timelines
+void seek_player(VideoContext *ctx, double seconds, bool forward)
+{
+    seek_to(ctx, seconds, forward);
+    wall_seek(atomic_load(&ctx->seek_target) - ctx->offset);
+    StopAudioStream(audio_stream);
+    PlayAudioStream(audio_stream);
+    if (ctx->paused) PauseAudioStream(audio_stream);
+}
+
+void seek_relative(VideoContext *ctx, double seconds)
+{
+    seek_player(ctx, ctx->clock - ctx->offset + seconds, seconds > 0.0);
+}
+
+// the device stops pulling while paused
+void pause_player(VideoContext *ctx, bool paused)
+{
+    set_paused(ctx, paused);
+    if (paused) PauseAudioStream(audio_stream);
+    else ResumeAudioStream(audio_stream);
+}
+
+void set_volume(void)
+{
+    atomic_store(&heard->dsp.volume, muted ? 0.0f : volume);
+}
+
+// the device's callback, it plays the heard player
+void audio_callback(void *buffer, unsigned int frames)
+{
+    pcm_callback(heard, buffer, frames);
+}
+
+// Only draws when a frame was uploaded, the user did something or the overlay
+// changed on its own (the time, the cache bar), at most once per display
+// refresh. In between it sleeps until the next frame is due, is woken by the
+// converter when it waits for one, and polls input every RENDER_IDLE_WAIT, or
+// every refresh for a while after the last input.
+void main_loop(VideoContext *ctx, Texture *surface)
+{
+    JPlayer *p = ctx->player;
+    double now = now_ms() / 1000.0;
+    clock_set(&ctx->ext_clock, 0.0, now);
+    clock_set(&ctx->video_clock, 0.0, now);
+    PlayAudioStream(audio_stream);
+    int refresh = GetMonitorRefreshRate(GetCurrentMonitor());
+    double refresh_period = 1.0 / (refresh > 0 ? refresh : 60);
+    double last_present = 0.0, last_input = 0.0;
+    // what the overlay showed when it was last drawn
+    int shown_second = -1;
+    float shown_fill = -1.0f;
+    bool dirty = true;
+    while (!WindowShouldClose()) {
+        // the pipeline stopped itself, there is nothing left to play
+        if (atomic_load(&p->failed)) ERROR("%s", p->error);
+        trace_counters(p);
+
+        if (ctx->video_active && update_frames(surface, ctx))
+            dirty = true;
+        if (autoexit && !ctx->video_active) break;
+
+        // Handle Window resizing, on a wall the main video gets the cell of the heard input
+        Rectangle src = {0, 0, surface->width, surface->height};
+        Rectangle screen = {0, 0, GetScreenWidth(), GetScreenHeight()};
+        if (video_wall.count > 0 && wall_update(screen, ctx, true))
+            dirty = true;
+        Rectangle area = video_wall.count > 0 ? wall_cell(screen, wall_audio) : screen;
+        Rectangle dst = fit_rect(area, ctx->v_ctx->width, ctx->v_ctx->height);
+        update_output_size(ctx, dst.height);
 
         //---Events---
+        now = now_ms() / 1000.0;
+        Vector2 mouse_delta = GetMouseDelta();
+        float scroll = GetMouseWheelMoveV().y;
+        if (GetKeyPressed() != 0 || IsKeyPressedRepeat(KEY_RIGHT) || IsKeyPressedRepeat(KEY_LEFT) ||
+            mouse_delta.x != 0.0f || mouse_delta.y != 0.0f || scroll != 0.0f ||
+            IsMouseButtonPressed(MOUSE_LEFT_BUTTON) || IsMouseButtonReleased(MOUSE_LEFT_BUTTON) ||
+            IsWindowResized()) {
+            last_input = now;
+            dirty = true;
+        }
         if (IsKeyPressed(KEY_SPACE)) {
-            ctx->paused = !ctx->paused;
+            // restart once the video is done
+            if (!ctx->video_active) {
+                seek_player(ctx, 0.0, false);
+                pause_player(ctx, false);
+            } else {
+                pause_player(ctx, !ctx->paused);
+            }
+        }
+        bool shift = IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT);
+        double seek_step = shift ? SEEK_STEP_LONG : SEEK_STEP;
+        if (IsKeyPressed(KEY_RIGHT) || IsKeyPressedRepeat(KEY_RIGHT))
+            seek_relative(ctx, seek_step);
+        else if (IsKeyPressed(KEY_LEFT) || IsKeyPressedRepeat(KEY_LEFT))
+            seek_relative(ctx, -seek_step);
+        // number keys jump to 0%..90%
+        for (int key = KEY_ZERO; key <= KEY_NINE; key++) {
+            if (IsKeyPressed(key) && ctx->duration > 0.0)
+                seek_player(ctx, ctx->duration * (key - KEY_ZERO) / 10.0, false);
         }
-        float scroll = GetMouseWheelMoveV().y;
         if (IsKeyPressed(KEY_UP) || scroll > 0.0f) {
-            if (!ctx->muted) {
+            if (!muted) {
                 float step = scroll ? VOLUME_STEP : VOLUME_STEP * 4.0f;
-                ctx->volume += step;
-                ctx->volume = ctx->volume > MAX_VOLUME ? MAX_VOLUME : ctx->volume;
-                SetAudioStreamVolume(ctx->audio_stream, ctx->volume);
+                volume += step;
+                volume = volume > MAX_VOLUME ? MAX_VOLUME : volume;
+                set_volume();
             }
         } else if (IsKeyPressed(KEY_DOWN) || scroll < 0.0f) {
-            if (!ctx->muted) {
+            if (!muted) {
                 float step = scroll ? VOLUME_STEP : VOLUME_STEP * 4.0f;
-                ctx->volume -= step;
-                ctx->volume = ctx->volume < 0.0f ? 0.0f : ctx->volume;
-                SetAudioStreamVolume(ctx->audio_stream, ctx->volume);
+                volume -= step;
+                volume = volume < 0.0f ? 0.0f : volume;
+                set_volume();
             }
         }
         if (IsKeyPressed(KEY_M)) {
-            if (ctx->muted)
-                SetAudioStreamVolume(ctx->audio_stream, ctx->volume);
-            else
-                SetAudioStreamVolume(ctx->audio_stream, 0.0f);
-            ctx->muted = !ctx->muted;
+            muted = !muted;
+            set_volume();
         }
-        if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON)) {
-            if (pressed_last_frame) {
+
+        // clicking the timeline seeks
+        Rectangle timeline = timeline_rect(dst);
+        Rectangle timeline_hit = timeline_hit_rect(timeline);
+        Vector2 mouse = GetMousePosition();
+        if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON) && ctx->duration > 0.0 &&
+            CheckCollisionPointRec(mouse, timeline_hit)) {
+            seek_player(ctx, ctx->duration * (mouse.x - timeline.x) / timeline.width, false);
+        } else if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON)) {
+            // the loop runs at no fixed rate, so double clicks go by time
+            if (last_click >= 0.0 && GetTime() - last_click < DOUBLE_CLICK_TIME) {
                 if (IsWindowState(FLAG_WINDOW_MAXIMIZED))
                     ClearWindowState(FLAG_WINDOW_MAXIMIZED);
                 else
                     SetWindowState(FLAG_WINDOW_MAXIMIZED);
+                last_click = -1.0;
+            } else {
+                last_click = GetTime();
             }
-            pressed_last_frame = true;
+        }
 
-        } else if (pressed_last_frame) {
-            int fps = GetFPS();
-            if (++press_frame_count >= fps / 4) {
-                press_frame_count = 0;
-                pressed_last_frame = false;
-            }
+        // the overlay also changes without input or new frames
+        double position = ctx->clock - ctx->offset;
+        int second = position > 0.0 ? position : 0;
+        float fill = cache_fill(ctx);
+        if (second != shown_second || fabsf(fill - shown_fill) >= 0.001f) dirty = true;
+
+        if (dirty && now - last_present >= refresh_period) {
+            // Rendering
+            ClearBackground(BLACK);
+
+            double start = trace_now();
+            if (ctx->video_active && yuv_render.active)
+                yuv_draw(&yuv_render, dst);
+            else if (ctx->video_active)
+                DrawTexturePro(*surface, src, dst, (Vector2){0}, 0, WHITE);
+            wall_draw();
+            trace_span("DrawTexturePro", start);
+
+            render_ui(ctx, dst);
+            shown_second = second;
+            shown_fill = fill;
+
+            // the swap waits for vsync, so this is where the frame pacing shows up,
+            // input is polled as part of it
+            start = trace_now();
+            EndDrawing();
+            trace_span("EndDrawing", start);
+            last_present = now;
+            dirty = false;
+            continue;
         }
 
-        // Rendering
-        ClearBackground(BLACK);
+        // nothing to draw yet, sleep until something may have changed
+        double deadline = now + (now - last_input < RENDER_ACTIVE_HOLD ? refresh_period
+                                                                        : RENDER_IDLE_WAIT);
+        if (dirty) deadline = fmin(deadline, last_present + refresh_period);
+        // tiles follow the clock on their own queues, they are checked every refresh
+        if (video_wall.count > 0 && !ctx->paused) deadline = fmin(deadline, now + refresh_period);
+        bool playing = ctx->video_active && (!ctx->paused || ctx->step_frame);
+        bool awaiting = false;
+        if (playing && !QUEUE_EMPTY(p->rgb_queue)) {
+            AVFrame *next = QUEUE_PEEK(p->rgb_queue);
+            if (FRAME_SERIAL(next) == atomic_load(&ctx->serial) && !ctx->step_frame)
+                deadline = fmin(deadline, now + next->pts / (double)AV_TIME_BASE - ctx->clock);
+            else
+                deadline = now; // stale or stepped to, update_frames takes care of it
+        } else if (playing) {
+            awaiting = true;
+        }
+        render_wait(p, deadline, awaiting);
+        PollInputEvents();
+    }
+
+}
+
+// null sink used by --bench, consumes frames as fast as possible or at
+// real-time pace without a window or audio device
+void bench_loop(VideoContext *ctx)
+{
+    JPlayer *p = ctx->player;
+    BenchStats *bench = &p->bench;
+    int sample_rate = p->pcm.sample_rate;
+    float *sink = av_malloc_array(AUDIO_DEVICE_FRAMES, p->pcm.channels * sizeof(float));
+    if (sink == NULL) ERROR("out of memory");
+    double next_sample = 0.0;
+    int64_t pulled = 0;
+    double presented = 0.0; // time of the last frame
+
+    bench->start = now_ms();
+    clock_set(&ctx->ext_clock, 0.0, bench->start / 1000.0);
+    clock_set(&ctx->video_clock, 0.0, bench->start / 1000.0);
+    while (true) {
+        if (atomic_load(&p->failed)) ERROR("%s", p->error);
+        double now = now_ms();
+        double elapsed = (now - bench->start) / 1000.0;
+        playlist_update(ctx);
+        bool video_done = video_finished(ctx);
+        bool audio_done = audio_finished(ctx);
+        if (video_done && audio_done && p->playlist_index + 1 >= p->playlist_count) break;
+
+        // by media time, so a fast run warms up over as much of the input as a real-time one
+        if (!bench->warm && presented - ctx->offset >= BENCH_WARMUP) {
+            bench->warm = true;
+            bench->warm_frame_buffers = atomic_load(&p->alloc_stats.frame_buffers);
+            bench->warm_packet_buffers = atomic_load(&p->alloc_stats.packet_buffers);
+        }
+        if (now >= next_sample) {
+            trace_counters(p);
+            samples_push(&bench->occupancy[0], QUEUE_SIZE(p->v_packets));
+            samples_push(&bench->occupancy[1], QUEUE_SIZE(p->a_packets));
+            samples_push(&bench->occupancy[2], QUEUE_SIZE(p->v_queue));
+            samples_push(&bench->occupancy[3], QUEUE_SIZE(p->a_queue));
+            samples_push(&bench->occupancy[4], QUEUE_SIZE(p->rgb_queue));
+            samples_push(&bench->queued_bytes, atomic_load(&queued_bytes));
+            next_sample = now + BENCH_SAMPLE_MS;
+        }
+
+        bool idle = true;
+        AVFrame *frame;
+        // stand in for the audio device, pulling whole periods in real time
+        int64_t due = pcm_buffered(&p->pcm);
+        if (bench_realtime) due = (int64_t)(elapsed * sample_rate) - pulled;
+        if (due >= (bench_realtime ? AUDIO_DEVICE_FRAMES : 1)) {
+            int frames = due < AUDIO_DEVICE_FRAMES ? due : AUDIO_DEVICE_FRAMES;
+            pcm_callback(p, sink, frames);
+            pulled += frames;
+            idle = false;
+        }
+        // only real-time pacing has a clock to be in sync with
+        if (bench_realtime) {
+            ctx->clock = master_time(ctx, now / 1000.0);
+            sync_audio(ctx, now / 1000.0);
+        }
+        if (video_wall.count > 0) {
+            // the tiles are converted at about their native size
+            int cols, rows;
+            wall_grid(&cols, &rows);
+            Rectangle screen = {0, 0, cols * ctx->v_ctx->width, rows * ctx->v_ctx->height};
+            wall_update(screen, ctx, false);
+        }
+        if (!QUEUE_EMPTY(p->rgb_queue)) {
+            frame = QUEUE_PEEK(p->rgb_queue);
+            double next_ts = frame->pts / (double)AV_TIME_BASE;
+            if (!bench_realtime || ctx->clock >= next_ts) {
+                if (bench_realtime) sync_video(ctx, next_ts, now / 1000.0, false);
+                presented = next_ts;
+                startup_mark(p, PHASE_FIRST_PRESENTED);
+                bench->video_frames++;
+                QUEUE_POP(p->rgb_queue);
+                idle = false;
+            }
+        }
 
-        // Handle Window resizing
-        Rectangle src = {0, 0, surface.width, surface.height};
-        int screen_height = GetScreenHeight();
-        int screen_width = GetScreenWidth();
-        int height = screen_height;
-        int width = screen_height * surface.width / surface.height;
-        if (screen_width < width) {
-            width = screen_width;
-            height = screen_width * surface.height / surface.width;
+        if (idle) {
+            if (!bench_realtime && !video_done) {
+                QUEUE_WAIT_UNTIL(p->rgb_queue, !QUEUE_EMPTY(p->rgb_queue) || video_finished(ctx) ||
+                                 atomic_load(&p->failed));
+            } else {
+                // the ring has no condition to wait on, like the device we poll it
+                struct timespec t = {0, 1000000L};
+                nanosleep(&t, NULL);
+            }
         }
-        int x = (screen_width - width) / 2;
-        int y = (screen_height - height) / 2;
-        Rectangle dst = {x, y, width, height};
-        if (ctx->video_active)
-            DrawTexturePro(surface, src, dst, (Vector2){0}, 0, WHITE);
+    }
+    bench->end = now_ms();
+    av_free(sink);
+}
 
-        render_ui(ctx, dst);
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
 
-        EndDrawing();
+// nearest-rank percentile of sorted samples
+double percentile(Samples *s, double p)
+{
+    if (s->count == 0) return 0.0;
+    int i = (int)(p / 100.0 * s->count + 0.5) - 1;
+    i = i < 0 ? 0 : i >= s->count ? s->count - 1 : i;
+    return s->items[i];
+}
 
+void print_json_string(const char *str)
+{
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') printf("\\%c", *str);
+        else if ((unsigned char)*str < 0x20) printf("\\u%04x", *str);
+        else putchar(*str);
     }
+    putchar('"');
+}
 
+void print_bench_report(VideoContext *ctx, const char *video_file)
+{
+    JPlayer *p = ctx->player;
+    BenchStats *bench = &p->bench;
+    double wall = (bench->end - bench->start) / 1000.0;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    // nothing above the gate was heard
+    char lufs[32] = "null";
+    if (atomic_load(&p->loudness.integrated) != -HUGE_VAL)
+        snprintf(lufs, sizeof(lufs), "%.2f", atomic_load(&p->loudness.integrated));
+
+    printf("{\n  \"input\": ");
+    print_json_string(video_file);
+    printf(",\n  \"mode\": \"%s\",\n", bench_realtime ? "realtime" : "fast");
+    printf("  \"wall_seconds\": %.3f,\n", wall);
+    printf("  \"video\": {\"codec\": \"%s\", \"width\": %d, \"height\": %d, "
+           "\"threads\": %d, \"frames\": %ld, \"fps\": %.2f, \"dropped\": %ld, \"skipped\": %ld},\n",
+           ctx->v_ctx->codec->name, ctx->v_ctx->width, ctx->v_ctx->height,
+           ctx->v_ctx->thread_count, (long)bench->video_frames,
+           wall > 0.0 ? bench->video_frames / wall : 0.0,
+           atomic_load(&p->late_stats.dropped), frames_skipped(p));
+    printf("  \"audio\": {\"codec\": \"%s\", \"frames\": %ld, \"samples\": %ld, "
+           "\"buffer_frames\": %d, \"underruns\": %ld, \"overruns\": %ld, "
+           "\"limited_callbacks\": %ld, \"loudness_lufs\": %s},\n",
+           ctx->a_ctx->codec->name, (long)bench->audio_frames, (long)bench->audio_samples,
+           p->pcm.cap, atomic_load(&p->pcm.underruns), atomic_load(&p->pcm.overruns),
+           atomic_load(&p->dsp.limited), lufs);
+
+    printf("  \"startup_ms\": {");
+    for (int i = 0; i < PHASE_COUNT; i++)
+        printf("%s\"%s\": %.3f", i ? ", " : "", phase_names[i], p->startup[i]);
+    printf("},\n");
+    printf("  \"stages_ms\": {\n");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        Samples *st = &bench->stages[i];
+        qsort(st->items, st->count, sizeof(double), compare_double);
+        printf("    \"%s\": {\"count\": %d, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}%s\n",
+               stage_names[i], st->count, percentile(st, 50), percentile(st, 90),
+               percentile(st, 99), percentile(st, 100), i < STAGE_COUNT - 1 ? "," : "");
+    }
+    printf("  },\n");
+
+    const char *queue_names[5] = {"v_packets", "a_packets", "v_queue", "a_queue", "rgb_queue"};
+    printf("  \"queue_occupancy\": {\n    \"interval_ms\": %d,\n", BENCH_SAMPLE_MS);
+    for (int i = 0; i < 5; i++) {
+        printf("    \"%s\": [", queue_names[i]);
+        for (int j = 0; j < bench->occupancy[i].count; j++)
+            printf("%s%d", j ? ", " : "", (int)bench->occupancy[i].items[j]);
+        printf("]%s\n", i < 4 ? "," : "");
+    }
+    printf("  },\n");
+    DriftStats *v = &p->sync_stats.video, *a = &p->sync_stats.audio;
+    printf("  \"sync\": {\"master\": \"%s\", "
+           "\"video_drift_ms\": {\"mean\": %.3f, \"stddev\": %.3f, \"max\": %.3f}, "
+           "\"audio_drift_ms\": {\"mean\": %.3f, \"stddev\": %.3f, \"max\": %.3f}, "
+           "\"corrected_samples\": %lld},\n", sync_names[sync_master],
+           drift_mean(v)*1000.0, drift_stddev(v)*1000.0, v->max*1000.0,
+           drift_mean(a)*1000.0, drift_stddev(a)*1000.0, a->max*1000.0,
+           atomic_load(&p->sync_stats.corrected_samples));
+    struct NetCache *caches[2] = {ctx->net_cache, ctx->net_cache2};
+    for (int i = 0; i < 2; i++) {
+        if (caches[i] == NULL) continue;
+        printf("  \"network%s\": {\"fetched\": %ld, \"stalls\": %ld, \"refetches\": %ld, "
+               "\"disk_bytes\": %ld},\n", i ? "_audio" : "", (long)caches[i]->fetched,
+               (long)caches[i]->stalls, (long)caches[i]->refetches, (long)caches[i]->disk_bytes);
+    }
+    // per reader, read_ms is time in av_read_frame, stall_ms waiting on full
+    // queues and window_ms waiting for the other input to catch up
+    printf("  \"inputs\": {\"dts_window_ms\": %d, \"readers\": [\n", dts_window_ms);
+    for (int i = 0; i < (ctx->is_split ? 2 : 1); i++) {
+        InputReader *r = &p->readers[i];
+        long long bytes = atomic_load(&r->bytes);
+        printf("    {\"input\": \"%s\", \"packets\": %ld, \"bytes\": %lld, \"mb_per_s\": %.2f, "
+               "\"read_ms\": %.1f, \"stalls\": %ld, \"stall_ms\": %.1f, \"window_waits\": %ld, "
+               "\"window_ms\": %.1f}%s\n", i ? "audio" : ctx->is_split ? "video" : "main",
+               atomic_load(&r->packets), bytes, wall > 0.0 ? bytes / (double)MB / wall : 0.0,
+               atomic_load(&r->read_us) / 1000.0, atomic_load(&r->stalls),
+               atomic_load(&r->stall_us) / 1000.0, atomic_load(&r->window_waits),
+               atomic_load(&r->window_us) / 1000.0, i == 0 && ctx->is_split ? "," : "");
+    }
+    printf("  ]},\n");
+    long frame_buffers = atomic_load(&p->alloc_stats.frame_buffers);
+    long packet_buffers = atomic_load(&p->alloc_stats.packet_buffers);
+    printf("  \"allocations\": {\"warm\": %s, \"frame_buffers\": %ld, \"frame_buffers_after_warmup\": %ld, "
+           "\"frame_reuses\": %ld, \"packet_buffers\": %ld, \"packet_buffers_after_warmup\": %ld},\n",
+           bench->warm ? "true" : "false", frame_buffers,
+           bench->warm ? frame_buffers - (long)bench->warm_frame_buffers : 0L,
+           (long)atomic_load(&p->alloc_stats.frame_reuses), packet_buffers,
+           bench->warm ? packet_buffers - (long)bench->warm_packet_buffers : 0L);
+    // local inputs, the second one is the audio of a split stream
+    AVFormatContext *inputs[2] = {ctx->format_ctx, ctx->is_split ? ctx->format_ctx2 : NULL};
+    struct MappedFile *maps[2] = {ctx->mapped, ctx->mapped2};
+    for (int i = 0; i < 2; i++) {
+        if (inputs[i] == NULL || caches[i] != NULL) continue;
+        if (maps[i] != NULL) {
+            // unmapped once the file changed size and was read with pread() from then on
+            printf("  \"input_io%s\": {\"mode\": \"mmap\", \"bytes\": %ld, \"reads\": %ld, "
+                   "\"madvise_calls\": %ld, \"zero_copy_packets\": %ld, \"unmapped\": %s},\n",
+                   i ? "_audio" : "", (long)inputs[i]->pb->bytes_read, (long)maps[i]->reads,
+                   (long)maps[i]->advises, atomic_load(&maps[i]->zero_copies),
+                   maps[i]->unmapped ? "true" : "false");
+        } else {
+            printf("  \"input_io%s\": {\"mode\": \"file\", \"bytes\": %ld},\n",
+                   i ? "_audio" : "", (long)inputs[i]->pb->bytes_read);
+        }
+    }
+    // user and system time, compare runs with and without -no-mmap
+    printf("  \"cpu_ms\": {\"user\": %.1f, \"system\": %.1f}, "
+           "\"page_faults\": {\"minor\": %ld, \"major\": %ld},\n",
+           usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0,
+           usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0,
+           usage.ru_minflt, usage.ru_majflt);
+    if (video_wall.count > 0) {
+        // the pool runs every input, the heard one included
+        printf("  \"wall\": {\"workers\": %d, \"tiles\": [\n", task_pool.worker_count);
+        for (int i = 0; i < video_wall.count; i++) {
+            WallTile *t = &video_wall.tiles[i];
+            bool open = atomic_load(&t->state) == TILE_OPEN;
+            // late ones the converter skipped and converted ones a later frame replaced
+            long dropped = t->dropped + (open ? atomic_load(&t->player->late_stats.dropped) : 0);
+            printf("    {\"input\": ");
+            print_json_string(t->file);
+            printf(", \"open\": %s, \"frames\": %ld, \"fps\": %.2f, \"dropped\": %ld}%s\n",
+                   open ? "true" : "false", t->presented, wall > 0.0 ? t->presented / wall : 0.0,
+                   dropped, i < video_wall.count - 1 ? "," : "");
+        }
+        printf("  ]},\n");
+    }
+    printf("  \"memory_limit\": %ld,\n  \"queued_bytes\": [", (long)memory_limit);
+    for (int j = 0; j < bench->queued_bytes.count; j++)
+        printf("%s%ld", j ? ", " : "", (long)bench->queued_bytes.items[j]);
+    printf("],\n");
+    // ru_maxrss is in kilobytes on linux
+    printf("  \"peak_rss_kb\": %ld\n}\n", usage.ru_maxrss);
+}
+
+// --bench-audio
+// Samples per second each audio processing path gets through on one core, a
+// device period at a time. Gain alternates ramping up and down so the levels
+// stay put, the limiter is fed a copy of audio that peaks over its ceiling.
+#define BENCH_AUDIO_SECONDS 0.5
+#define BENCH_AUDIO_RATE 48000
+typedef void (*AudioBenchFunc)(float *data, const float *src, int frames, int channels, void *arg);
+
+void bench_gain(float *data, const float *src, int frames, int channels, void *arg)
+{
+    (void)src;
+    static float step = 1e-7f;
+    ((GainFunc)arg)(data, frames, channels, 1.0f, step);
+    step = -step;
+}
+
+void bench_limiter(float *data, const float *src, int frames, int channels, void *arg)
+{
+    memcpy(data, src, (size_t)frames * channels * sizeof(float));
+    limiter_process(arg, data, frames, channels);
+}
+
+void bench_loudness(float *data, const float *src, int frames, int channels, void *arg)
+{
+    (void)data;
+    (void)channels;
+    loudness_process(arg, src, frames);
+}
+
+double bench_audio_rate(AudioBenchFunc func, void *arg, float *data, const float *src, int channels)
+{
+    long samples = 0;
+    double start = now_ms(), elapsed;
+    do {
+        for (int i = 0; i < 64; i++) func(data, src, AUDIO_DEVICE_FRAMES, channels, arg);
+        samples += 64L * AUDIO_DEVICE_FRAMES * channels;
+        elapsed = (now_ms() - start) / 1000.0;
+    } while (elapsed < BENCH_AUDIO_SECONDS);
+    return samples / elapsed;
+}
+
+void bench_audio(void)
+{
+    AVChannelLayout layout = AV_CHANNEL_LAYOUT_STEREO;
+    int channels = layout.nb_channels;
+    float *src = av_malloc_array(AUDIO_DEVICE_FRAMES * channels, sizeof(float));
+    float *data = av_malloc_array(AUDIO_DEVICE_FRAMES * channels, sizeof(float));
+    if (src == NULL || data == NULL) ERROR("out of memory");
+    for (int i = 0; i < AUDIO_DEVICE_FRAMES * channels; i++)
+        src[i] = 1.5f * sinf(2.0f * M_PI * 440.0f * (i / channels) / BENCH_AUDIO_RATE);
+
+    struct { const char *name; GainFunc func; bool supported; } paths[] = {
+        {"scalar", gain_scalar, true},
+#ifdef HAVE_X86
+        {"sse", gain_sse, __builtin_cpu_supports("sse2")},
+        {"avx", gain_avx, __builtin_cpu_supports("avx")},
+#endif
+    };
+    const char *best;
+    gain_best(&best);
+    printf("{\n  \"channels\": %d,\n  \"sample_rate\": %d,\n  \"selected\": \"%s\",\n",
+           channels, BENCH_AUDIO_RATE, best);
+    printf("  \"gain_samples_per_second\": {");
+    for (size_t i = 0; i < sizeof(paths)/sizeof(*paths); i++) {
+        if (!paths[i].supported) continue;
+        memcpy(data, src, AUDIO_DEVICE_FRAMES * channels * sizeof(float));
+        double rate = bench_audio_rate(bench_gain, paths[i].func, data, src, channels);
+        printf("%s\"%s\": %.0f", i ? ", " : "", paths[i].name, rate);
+    }
+    printf("},\n");
+
+    AudioDsp limiter = {0};
+    dsp_init(&limiter, channels, BENCH_AUDIO_RATE);
+    printf("  \"limiter_samples_per_second\": %.0f,\n",
+           bench_audio_rate(bench_limiter, &limiter, data, src, channels));
+    Loudness meter = {0};
+    loudness_init(&meter, &layout, BENCH_AUDIO_RATE);
+    printf("  \"loudness_samples_per_second\": %.0f\n}\n",
+           bench_audio_rate(bench_loudness, &meter, data, src, channels));
+
+    av_free(limiter.delay);
+    loudness_free(&meter);
+    av_free(src);
+    av_free(data);
 }
 
 #define USAGE() fprintf(stderr, \
-"USAGE: %s [OPTIONS] <input file/url>\n" \
+"USAGE: %s [OPTIONS] <input file/url/.m3u>...\n" \
 "yt-dlp: %s [-- [yt-dlp options]] <url>\n\n" \
 "Options:\n" \
 "-q\tquite\n" \
+"-threads <n>\tvideo decoder threads, 0 for auto\n" \
+"-thread-type <frame|slice|both>\tvideo decoder threading\n" \
+"-convert-threads <n>\tpixel conversion threads, 0 for auto\n" \
+"-yuv\tdraw YUV frames with a shader instead of converting them to RGB\n" \
+"-autoexit\tquit when the video has played to the end\n" \
+"-packet-queue <MB>,<s>\tlimit of each packet queue (16,10)\n" \
+"-video-queue <MB>,<s>\tlimit of the decoded video queue (256,1)\n" \
+"-audio-queue <MB>,<s>\tlimit of the decoded audio queue (16,2)\n" \
+"-mem-limit <MB>\tceiling for everything queued (512)\n" \
+"-net-cache <MB>\tread-ahead memory for network inputs (64)\n" \
+"-no-mmap\tread local files with read() instead of mapping them, for files still being written\n" \
+"-net-disk <MB>\tdisk space network data is spilled to, 0 to disable (1024)\n" \
+"-probesize <bytes>\tinput probing limit, smaller opens faster\n" \
+"-analyzeduration <ms>\tmedia probed for stream info, smaller opens faster\n" \
+"-resolver <command>\tused instead of yt-dlp, called as <command> <args> --get-url <url>\n" \
+"-audio-buffer <ms>\tresampled audio buffered ahead of the device (200)\n" \
+"-audio-latency <ms>\textra output latency to compensate, e.g. bluetooth (0)\n" \
+"-sync <audio|video|external>\tmaster clock (audio)\n" \
+"-normalize <LUFS>\tnormalize the loudness to this, e.g. -16\n" \
+"-wall\tplay all inputs at once in a grid, the first is heard\n" \
+"-wall-audio <n>\ton a wall hear the nth input instead, implies -wall\n" \
+"-audio <file/url>\tplay the audio of this input instead, read alongside like a split stream\n" \
+"-dts-window <ms>\thow far apart the inputs of a split stream may read (500)\n" \
+"-trace <file.json>\trecord a chrome trace of the pipeline, open in ui.perfetto.dev\n" \
+"--bench\trun headless as fast as possible and print stats as json\n" \
+"--bench-realtime\trun headless at real-time pace and print stats as json\n" \
+"--bench-audio\tbenchmark the audio processing paths, no input needed\n" \
 , argv[0], argv[0])
 
-// return video file
-char *parse_args(int argc, char *argv[], char **yt_dlp)
+// value of an option that takes an argument, the input is always last
+#define OPTION_VALUE() ({ \
+    if (i + 1 >= argc - 1) { \
+        USAGE(); \
+        exit(1); \
+    } \
+    argv[++i]; \
+})
+
+// <MB>,<seconds>
+QueueLimits parse_queue_limits(const char *value)
+{
+    double mb, seconds;
+    if (sscanf(value, "%lf,%lf", &mb, &seconds) != 2 || mb <= 0.0 || seconds <= 0.0)
+        ERROR("invalid queue limits %s, expected <MB>,<seconds>", value);
+    return (QueueLimits){mb * MB, seconds * AV_TIME_BASE};
+}
+
+void playlist_add(char *input)
+{
+    playlist = av_realloc_array(playlist, playlist_count + 1, sizeof(char *));
+    if (playlist == NULL) ERROR("out of memory");
+    playlist[playlist_count++] = input;
+}
+
+// Add the entries of a local .m3u playlist, relative to where it is. False if
+// it isn't one, an .m3u8 with #EXT-X- tags is an HLS stream ffmpeg plays itself.
+bool playlist_load(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    if (ext == NULL || strstr(path, "://") != NULL ||
+        (strcasecmp(ext, ".m3u") != 0 && strcasecmp(ext, ".m3u8") != 0))
+        return false;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return false;
+
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash != NULL ? slash - path + 1 : 0;
+    char **entries = NULL;
+    int count = 0;
+    bool hls = false;
+    char line[BUF_MAX_LEN];
+    while (!hls && fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "#EXT-X-", 7) == 0) hls = true;
+        if (line[0] == '\0' || line[0] == '#') continue;
+        entries = av_realloc_array(entries, count + 1, sizeof(char *));
+        if (entries == NULL) ERROR("out of memory");
+        bool relative = line[0] != '/' && strstr(line, "://") == NULL;
+        entries[count++] = relative ? av_asprintf("%.*s%s", dir_len, path, line) : av_strdup(line);
+        if (entries[count - 1] == NULL) ERROR("out of memory");
+    }
+    fclose(f);
+
+    for (int i = 0; i < count; i++) {
+        if (hls) av_free(entries[i]);
+        else playlist_add(entries[i]);
+    }
+    av_free(entries);
+    if (!hls && count == 0) ERROR("playlist %s is empty", path);
+    return !hls;
+}
+
+// fills the playlist, every input after the options is played in order
+void parse_args(int argc, char *argv[], char **yt_dlp)
 {
     static char yt_dlp_buf[1024];
     //---Arguments---
@@ -663,113 +1305,304 @@ char *parse_args(int argc, char *argv[], char **yt_dlp)
     }
     *yt_dlp = NULL;
     // parse flags
+    int i = 1;
     if (argc >= 3) {
-        for (int i = 1; i < argc - 1; i++) {
+        for (; i < argc - 1 && argv[i][0] == '-'; i++) {
             char *arg = argv[i];
             // yt-dlp args
             if (strcmp(arg, "--") == 0) {
+                // each one single quoted, the resolver gets them back as they were given
+                size_t len = 0;
                 for (i++; i < argc - 1; i++) {
-                    size_t len = strlen(yt_dlp_buf);
-                    if (len < 1023) {
-                        yt_dlp_buf[len] = ' ';
-                        yt_dlp_buf[len + 1] = '\0';
+                    if (len + 4 * strlen(argv[i]) + 4 > sizeof(yt_dlp_buf))
+                        ERROR("yt-dlp options too long");
+                    if (len > 0) yt_dlp_buf[len++] = ' ';
+                    yt_dlp_buf[len++] = '\'';
+                    for (const char *c = argv[i]; *c; c++) {
+                        if (*c == '\'') {
+                            memcpy(yt_dlp_buf + len, "'\\''", 4);
+                            len += 4;
+                        } else {
+                            yt_dlp_buf[len++] = *c;
+                        }
                     }
-                    size_t n = 1024 - len;
-                    strncat(yt_dlp_buf, argv[i], n);
+                    yt_dlp_buf[len++] = '\'';
+                    yt_dlp_buf[len] = '\0';
                 }
+                // the url is all that's left
                 *yt_dlp = yt_dlp_buf;
+                break;
             } else if (strcmp(arg, "-q") == 0) {
                 quiet = true;
+            } else if (strcmp(arg, "--bench") == 0) {
+                bench_mode = true;
+            } else if (strcmp(arg, "--bench-realtime") == 0) {
+                bench_mode = true;
+                bench_realtime = true;
+            } else if (strcmp(arg, "-threads") == 0) {
+                codec_threads = atoi(OPTION_VALUE());
+                if (codec_threads < 0) ERROR("invalid thread count %d", codec_threads);
+            } else if (strcmp(arg, "-convert-threads") == 0) {
+                convert_threads = atoi(OPTION_VALUE());
+                if (convert_threads < 0) ERROR("invalid thread count %d", convert_threads);
+            } else if (strcmp(arg, "-packet-queue") == 0) {
+                packet_limits = parse_queue_limits(OPTION_VALUE());
+            } else if (strcmp(arg, "-video-queue") == 0) {
+                video_limits = parse_queue_limits(OPTION_VALUE());
+            } else if (strcmp(arg, "-audio-queue") == 0) {
+                audio_limits = parse_queue_limits(OPTION_VALUE());
+            } else if (strcmp(arg, "-mem-limit") == 0) {
+                double mb = atof(OPTION_VALUE());
+                if (mb <= 0.0) ERROR("invalid memory limit %.1f", mb);
+                memory_limit = mb * MB;
+            } else if (strcmp(arg, "-probesize") == 0) {
+                probesize = atoll(OPTION_VALUE());
+                // ffmpeg won't go below 32 bytes
+                if (probesize < 32) ERROR("invalid probe size %ld", (long)probesize);
+            } else if (strcmp(arg, "-analyzeduration") == 0) {
+                double ms = atof(OPTION_VALUE());
+                if (ms <= 0.0) ERROR("invalid analyze duration %.1f", ms);
+                analyzeduration = ms * 1000.0;
+            } else if (strcmp(arg, "-resolver") == 0) {
+                resolver = OPTION_VALUE();
+            } else if (strcmp(arg, "-net-cache") == 0) {
+                double mb = atof(OPTION_VALUE());
+                if (mb < 1.0) ERROR("invalid network cache size %.1f", mb);
+                net_cache_size = mb * MB;
+            } else if (strcmp(arg, "-net-disk") == 0) {
+                double mb = atof(OPTION_VALUE());
+                if (mb < 0.0) ERROR("invalid network disk limit %.1f", mb);
+                net_disk_limit = mb * MB;
+            } else if (strcmp(arg, "-audio-buffer") == 0) {
+                audio_buffer_ms = atoi(OPTION_VALUE());
+                if (audio_buffer_ms <= 0) ERROR("invalid audio buffer %d", audio_buffer_ms);
+            } else if (strcmp(arg, "-audio-latency") == 0) {
+                audio_latency_ms = atoi(OPTION_VALUE());
+                if (audio_latency_ms < 0) ERROR("invalid audio latency %d", audio_latency_ms);
+            } else if (strcmp(arg, "-sync") == 0) {
+                char *master = OPTION_VALUE();
+                if (strcmp(master, "audio") == 0) sync_master = SYNC_AUDIO;
+                else if (strcmp(master, "video") == 0) sync_master = SYNC_VIDEO;
+                else if (strcmp(master, "external") == 0) sync_master = SYNC_EXTERNAL;
+                else ERROR("unknown sync master %s", master);
+            } else if (strcmp(arg, "-normalize") == 0) {
+                normalize_lufs = atof(OPTION_VALUE());
+                if (normalize_lufs >= 0.0 || normalize_lufs < -70.0)
+                    ERROR("invalid loudness target %.1f", normalize_lufs);
+            } else if (strcmp(arg, "-no-mmap") == 0) {
+                use_mmap = false;
+            } else if (strcmp(arg, "-yuv") == 0) {
+                render_yuv = true;
+            } else if (strcmp(arg, "-autoexit") == 0) {
+                autoexit = true;
+            } else if (strcmp(arg, "-audio") == 0) {
+                audio_input = OPTION_VALUE();
+            } else if (strcmp(arg, "-dts-window") == 0) {
+                dts_window_ms = atoi(OPTION_VALUE());
+                if (dts_window_ms <= 0) ERROR("invalid dts window %d", dts_window_ms);
+            } else if (strcmp(arg, "-wall") == 0) {
+                wall_mode = true;
+            } else if (strcmp(arg, "-wall-audio") == 0) {
+                wall_mode = true;
+                wall_audio = atoi(OPTION_VALUE()) - 1;
+                if (wall_audio < 0) ERROR("invalid wall audio input %d", wall_audio + 1);
+            } else if (strcmp(arg, "-trace") == 0) {
+                trace_path = OPTION_VALUE();
+            } else if (strcmp(arg, "-thread-type") == 0) {
+                char *type = OPTION_VALUE();
+                if (strcmp(type, "frame") == 0) codec_thread_type = FF_THREAD_FRAME;
+                else if (strcmp(type, "slice") == 0) codec_thread_type = FF_THREAD_SLICE;
+                else if (strcmp(type, "both") == 0) codec_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+                else ERROR("unknown thread type %s", type);
             } else {
                 USAGE();
                 exit(1);
             }
         }
     }
-char *video_file = argv[argc - 1];
-    return video_file;
+    for (; i < argc; i++) {
+        if (!playlist_load(argv[i])) playlist_add(argv[i]);
+    }
+}
+
+typedef struct {
+    char *video_file;
+    char *yt_dlp;
+    JPlayer *player;
+    int result;
+    const char *_Atomic status; // what the loading screen says
+    atomic_bool done;
+} LoadJob;
+
+// opening can wait on yt-dlp and the network for seconds so it runs beside
+// the window, the pipeline starts as soon as the decoders are open
+void *load_thread_func(void *arg)
+{
+    LoadJob *job = arg;
+    trace_thread("load");
+    open_status = &job->status;
+    JPOptions options = {
+        .resolver_args = job->yt_dlp,
+        .decoder_threads = codec_threads,
+        .quiet = quiet,
+    };
+    job->result = jp_open(job->video_file, &options, &job->player);
+    open_status = NULL;
+    if (job->result == JP_OK) {
+        // the player goes on to the rest of the inputs by itself
+        job->player->playlist = playlist;
+        job->player->playlist_count = playlist_count;
+        job->result = jp_start(job->player);
+    }
+    atomic_store(&job->done, true);
+    return NULL;
+}
+
+// loading screen until the input is open, false if the window was closed
+bool wait_for_load(LoadJob *job)
+{
+    while (!atomic_load(&job->done)) {
+        if (WindowShouldClose()) return false;
+        BeginDrawing();
+        ClearBackground(BLACK);
+        const char *text = atomic_load(&job->status);
+        int font_size = GetScreenHeight() * TIME_FONT_SCALE * 2.0f;
+        int text_width = MeasureText(text, font_size);
+        DrawText(text, (GetScreenWidth() - text_width) / 2, (GetScreenHeight() - font_size) / 2,
+                 font_size, RAYWHITE);
+        EndDrawing();
+    }
+    return true;
 }
 
 int main(int argc, char *argv[])
 {
-    char *video_file;
+    startup_origin = now_ms();
+    // the microbenchmark needs no input
+    if (argc == 2 && strcmp(argv[1], "--bench-audio") == 0) {
+        bench_audio();
+        return 0;
+    }
     char *yt_dlp = NULL;
-    video_file = parse_args(argc, argv, &yt_dlp);
+    parse_args(argc, argv, &yt_dlp);
+    // logs go to stdout so keep it clean for the json report
+    if (bench_mode) quiet = true;
+    // on a wall the inputs play at once, the heard one through the pipeline and
+    // the others as tiles
+    int wall_count = 0;
+    if (wall_mode) {
+        if (wall_audio >= playlist_count)
+            ERROR("wall audio input %d, there are %d inputs", wall_audio + 1, playlist_count);
+        char *heard = playlist[wall_audio];
+        memmove(&playlist[1], &playlist[0], wall_audio * sizeof(*playlist));
+        playlist[0] = heard;
+        wall_count = playlist_count - 1;
+        playlist_count = 1;
+    }
+    char *video_file = playlist[0];
+    if (playlist_count > 1) LOG("playing 1/%d %s", playlist_count, video_file);
+    trace_thread("main");
 
     // Initialization
-    VideoContext ctx = {0};
-    init_av_streaming(&ctx, video_file, yt_dlp);
-    init_frame_conversion(&ctx);
-
-    // packets
-    packets.cap = PACKET_QUEUE_CAP;
-    packets.items = av_malloc_array(PACKET_QUEUE_CAP, sizeof(AVPacket *));
-    for (int i = 0; i < packets.cap; i++) packets.items[i] = av_packet_alloc();
-    if (ctx.is_split) {
-        packets2.cap = PACKET_QUEUE_CAP;
-        packets2.items = av_malloc_array(PACKET_QUEUE_CAP, sizeof(AVPacket *));
-        for (int i = 0; i < packets2.cap; i++) packets2.items[i] = av_packet_alloc();
-    }
-    // video queue
-    v_queue.cap = FRAME_QUEUE_CAP;
-    v_queue.items = av_malloc_array(v_queue.cap, sizeof(AVFrame *));
-    for (int i = 0; i < v_queue.cap; i++) v_queue.items[i] = av_frame_alloc();
-    // audio queue
-    a_queue.cap = FRAME_QUEUE_CAP;
-    a_queue.items = av_malloc_array(a_queue.cap, sizeof(AVFrame *));
-    for (int i = 0; i < a_queue.cap; i++) a_queue.items[i] = av_frame_alloc();
-
-    start_threads(&ctx);
+    LoadJob load = {.video_file = video_file, .yt_dlp = yt_dlp, .status = "Loading..."};
+
+    // headless, the json report is the only output
+    if (bench_mode) {
+        load_thread_func(&load);
+        // a player that opened but didn't start has the error
+        if (load.result != JP_OK) ERROR("%s", jp_error(load.player));
+        VideoContext *ctx = &load.player->ctx;
+        trace_thread("main");
+        wall_start(playlist + 1, wall_count);
+        bench_loop(ctx);
+        player_stop(load.player);
+        if (trace_path != NULL) trace_write();
+        print_bench_report(ctx, video_file);
+        wall_stop();
+        jp_close(load.player);
+        return 0;
+    }
 
     // Initialize raylib
-    int vid_width = ctx.v_ctx->width, vid_height = ctx.v_ctx->height;
+    // the window comes up right away at a guessed size while the input opens
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     SetTraceLogLevel(LOG_WARNING);
-    InitWindow(DEFAULT_WINDOW_HEIGHT * vid_width / vid_height,
-               DEFAULT_WINDOW_HEIGHT, video_file);
-    SetTargetFPS(120);
+    InitWindow(DEFAULT_WINDOW_HEIGHT * 16 / 9, DEFAULT_WINDOW_HEIGHT, video_file);
+    // no target fps, main_loop paces itself
+    windowed = true;
+    // before the pipeline starts, the converter decides by it what to pass on
+    if (render_yuv && !yuv_init(&yuv_render)) {
+        WARN("YUV shader unavailable, converting to RGB");
+        render_yuv = false;
+    }
+    pthread_t load_thread;
+    pthread_create(&load_thread, NULL, load_thread_func, &load);
+    // the audio device doesn't depend on the input so it overlaps with opening it
     InitAudioDevice();
+    if (!wait_for_load(&load)) {
+        // the loader may be stuck on the network, exiting takes it down
+        CloseAudioDevice();
+        CloseWindow();
+        return 0;
+    }
+    pthread_join(load_thread, NULL);
+    if (load.result != JP_OK) ERROR("%s", jp_error(load.player));
+    VideoContext *ctx = &load.player->ctx;
+    heard = load.player;
+    wall_start(playlist + 1, wall_count);
+    wall_views_init();
+
+    // a wall starts with every cell at the main video's aspect
+    int cols, rows;
+    wall_grid(&cols, &rows);
+    int vid_width = ctx->v_ctx->width * cols, vid_height = ctx->v_ctx->height * rows;
+    SetWindowSize(DEFAULT_WINDOW_HEIGHT * vid_width / vid_height, DEFAULT_WINDOW_HEIGHT);
     SetWindowMinSize(MIN_WINDOW_HEIGHT * vid_width / vid_height, MIN_WINDOW_HEIGHT);
 
-    // Frame buffer
+    // Frame buffer, starts out black at the first conversion size
+    int out_width, out_height;
+    output_size(ctx, &out_width, &out_height);
+    unsigned char *black = av_mallocz(out_width * out_height * 3);
     Image img = {
-        .width = vid_width,
-        .height = vid_height,
+        .width = out_width,
+        .height = out_height,
         .mipmaps = 1,        
         .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8,
-        .data = ctx.out_frame->data[0],
+        .data = black,
     };
     Texture surface = LoadTextureFromImage(img);
     SetTextureFilter(surface, TEXTURE_FILTER_BILINEAR);
+    av_free(black);
 
     //---Audio---
-    ctx.sample_size = 32;
-    AVFrame *f;
-
-    // Because of buffer filling issues when frame size is unknown we scan the frames for a value
-    ctx.a_buffer_size = ctx.a_ctx->frame_size;
-    if (!ctx.a_ctx->frame_size) {
-        for (int i = a_queue.rindex; i < a_queue.windex; i++) {
-            f = a_queue.items[i];
-            ctx.a_buffer_size = f->nb_samples > ctx.a_buffer_size ? f->nb_samples : ctx.a_buffer_size;
-        }
-    }
-    assert(ctx.a_buffer_size != 0);
-    SetAudioStreamBufferSizeDefault(ctx.a_buffer_size);
-    ctx.audio_stream = LoadAudioStream(ctx.a_ctx->sample_rate, ctx.sample_size,
-                                       ctx.a_ctx->ch_layout.nb_channels);
-    ctx.volume = 1.0f;
-    SetAudioStreamVolume(ctx.audio_stream, ctx.volume);
-
-    int size = ctx.a_buffer_size * ctx.audio_stream.channels * (ctx.audio_stream.sampleSize / 8);
-    audio_buffer = av_malloc(size);
+    // pulled by the device through the callback, the period is independent of
+    // the codec frame size
+    SetAudioStreamBufferSizeDefault(AUDIO_DEVICE_FRAMES);
+    audio_stream = LoadAudioStream(heard->pcm.sample_rate, 32, heard->pcm.channels);
+    SetAudioStreamCallback(audio_stream, audio_callback);
+    // the gain is applied in the callback, where it can't clip
+    SetAudioStreamVolume(audio_stream, 1.0f);
+    set_volume();
     LOG("PLAYING...");
 
-    main_loop(&ctx, surface);
-    deinit_av_streaming(&ctx);
-
-    CloseWindow();
+    main_loop(ctx, &surface);
+    // the callback reads the ring so the device goes first
+    UnloadAudioStream(audio_stream);
     CloseAudioDevice();
+    LOG("audio underruns: %ld, overruns: %ld, limited: %ld, loudness %.1f LUFS",
+        atomic_load(&heard->pcm.underruns), atomic_load(&heard->pcm.overruns),
+        atomic_load(&heard->dsp.limited), atomic_load(&heard->loudness.integrated));
+    sync_log(heard);
+    wall_views_free();
+    wall_stop();
+    player_stop(load.player);
+    if (trace_path != NULL) trace_write();
+    jp_close(load.player);
+
+    UnloadTexture(surface);
+    yuv_unload(&yuv_render);
+    if (thumb_texture.texture.id != 0) UnloadTexture(thumb_texture.texture);
+    CloseWindow();
 
     return 0;
 }
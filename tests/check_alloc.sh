@@ -0,0 +1,16 @@
+#!/bin/sh
+# Pooled frame and packet buffers: once the first seconds of an input have
+# played the queues are as full as they get, so nothing is allocated after.
+. tests/lib.sh
+
+for input in bench/h264_1080p30.mkv bench/mpeg4_720p60.mkv bench/prores_1080p25.mov; do
+    name=$(basename "$input")
+    bench "$name" "$input"
+    [ "$(json "$name" allocations.warm)" = True ] || fail "$name never warmed up"
+    [ "$(json "$name" allocations.frame_buffers_after_warmup)" -eq 0 ] ||
+        fail "$name allocated $(json "$name" allocations.frame_buffers_after_warmup) frame buffers after warming up"
+    [ "$(json "$name" allocations.packet_buffers_after_warmup)" -eq 0 ] ||
+        fail "$name allocated $(json "$name" allocations.packet_buffers_after_warmup) packet buffers after warming up"
+    pass "$name: $(json "$name" allocations.frame_buffers) frame and" \
+        "$(json "$name" allocations.packet_buffers) packet buffers, none after warming up"
+done
@@ -0,0 +1,36 @@
+#!/bin/sh
+# -audio with two local files standing in for the separate video and audio
+# urls of YouTube. Each input gets its own reader, both read every packet of
+# their file and all video frames are decoded, with the default dts window
+# and with one tight enough that the readers wait on each other. The audio
+# file is opened like the video, from a mapping unless -no-mmap.
+. tests/lib.sh
+video=bench/split_video.mkv
+audio=bench/split_audio.m4a
+count() {
+    ffprobe -v error -select_streams "$1:0" -count_packets -show_entries stream=nb_read_packets \
+        -of csv=p=0 "$2"
+}
+frames=$(ffprobe -v error -select_streams v:0 -count_frames -show_entries stream=nb_read_frames \
+    -of csv=p=0 "$video")
+
+for window in 500 20; do
+    bench "w$window" -dts-window "$window" -audio "$audio" "$video"
+    [ "$(json w$window inputs.readers.0.input)" = video ] && [ "$(json w$window inputs.readers.1.input)" = audio ] ||
+        fail "-audio didn't read the inputs as a split stream"
+    [ "$(json w$window inputs.readers.0.packets)" = "$(count v "$video")" ] ||
+        fail "video reader read $(json w$window inputs.readers.0.packets) of $(count v "$video") packets"
+    [ "$(json w$window inputs.readers.1.packets)" = "$(count a "$audio")" ] ||
+        fail "audio reader read $(json w$window inputs.readers.1.packets) of $(count a "$audio") packets"
+    [ "$(json w$window video.frames)" = "$frames" ] ||
+        fail "$(json w$window video.frames) of $frames video frames with a ${window}ms window"
+    [ "$(json w$window audio.frames)" -gt 0 ] || fail "no audio frames from $audio"
+    pass "${window}ms dts window, $(json w$window inputs.readers.0.window_waits) video and" \
+        "$(json w$window inputs.readers.1.window_waits) audio window waits"
+done
+
+[ "$(json w500 input_io_audio.mode)" = mmap ] || fail "the audio input wasn't mapped"
+bench nommap -no-mmap -audio "$audio" "$video"
+[ "$(json nommap input_io_audio.mode)" = file ] || fail "-no-mmap still mapped the audio input"
+[ "$(json nommap audio.frames)" = "$(json w500 audio.frames)" ] || fail "the audio played differently without mmap"
+pass "the audio input is mapped like the video, and read with read() under -no-mmap"
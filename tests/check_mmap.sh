@@ -0,0 +1,28 @@
+#!/bin/sh
+# Local inputs read from a mapping: the packets of the prores/pcm mov point
+# into the mapping instead of being copied and play like the read() path, and
+# a file cut short while it plays ends the run instead of killing it with
+# SIGBUS.
+. tests/lib.sh
+input=bench/prores_1080p25.mov
+
+bench mapped "$input"
+bench plain -no-mmap "$input"
+[ "$(json mapped input_io.mode)" = mmap ] || fail "the input wasn't mapped"
+[ "$(json mapped input_io.zero_copy_packets)" -gt 0 ] || fail "every packet was copied out of the mapping"
+[ "$(json mapped video.frames)" = "$(json plain video.frames)" ] &&
+    [ "$(json mapped audio.frames)" = "$(json plain audio.frames)" ] ||
+    fail "the mapped input played differently from -no-mmap"
+pass "$(json mapped input_io.zero_copy_packets) packets referenced the mapping"
+
+cp "$input" "$TMP/cut.mov"
+"$JPLAY" --bench-realtime "$TMP/cut.mov" > "$TMP/cut" 2> "$TMP/cut.err" &
+pid=$!
+sleep 2
+truncate -s "$(($(wc -c < "$input") / 2))" "$TMP/cut.mov"
+status=0
+wait "$pid" || status=$?
+[ "$status" -lt 128 ] || fail "truncating the input killed jplay with signal $((status - 128))"
+# the report is quiet, the mapping being dropped shows up in it
+[ "$(json cut input_io.unmapped)" = True ] || fail "the truncation went unnoticed: $(cat "$TMP/cut.err")"
+pass "truncated while playing, exited with $status"
@@ -0,0 +1,24 @@
+#!/bin/sh
+# The network cache against a local server that throttles the bandwidth and
+# stalls every few MB. The ring is smaller than the input, so it spills to
+# disk. Every frame of the local run has to come through the cache too.
+. tests/lib.sh
+input=bench/h264_1080p30.mkv
+bench local "$input"
+port=$(start_server "$input" --rate 8192 --stall-every 2048 --stall-ms 300)
+url=http://127.0.0.1:$port/$(basename "$input")
+
+bench net -net-cache 1 "$url"
+for stream in video audio; do
+    [ "$(json net $stream.frames)" = "$(json local $stream.frames)" ] ||
+        fail "$(json net $stream.frames) $stream frames over http, $(json local $stream.frames) from the file"
+done
+[ "$(json net network.stalls)" -gt 0 ] || fail "the reader never waited on the throttled server"
+[ "$(json net network.disk_bytes)" -gt 0 ] || fail "a 1MB ring spilled nothing to disk"
+pass "throttled and stalling http, $(json net network.stalls) stalls, $(json net network.disk_bytes) bytes spilled"
+
+bench nodisk -net-cache 1 -net-disk 0 "$url"
+[ "$(json nodisk video.frames)" = "$(json local video.frames)" ] ||
+    fail "$(json nodisk video.frames) video frames without the spill file, $(json local video.frames) from the file"
+[ "$(json nodisk network.disk_bytes)" -eq 0 ] || fail "spilled with -net-disk 0"
+pass "without the spill file, $(json nodisk network.refetches) refetches"
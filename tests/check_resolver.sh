@@ -0,0 +1,37 @@
+#!/bin/sh
+# YouTube urls through a stub resolver: both urls it returns are opened as a
+# split stream, the result is cached per video and yt-dlp arguments, nothing
+# reaches a shell, and a failing resolver ends the run with its error.
+. tests/lib.sh
+export XDG_CACHE_HOME="$TMP/cache" STUB_RESOLVER_LOG="$TMP/resolver.log"
+resolver="-resolver tests/stub_resolver.sh"
+url=https://www.youtube.com/watch?v=jplaycheck0
+calls() { wc -l < "$STUB_RESOLVER_LOG"; }
+
+bench first $resolver "$url"
+[ "$(calls)" -eq 1 ] || fail "resolver called $(calls) times for one open"
+[ "$(json first inputs.readers.1.input)" = audio ] || fail "the two urls weren't opened as a split stream"
+[ "$(json first inputs.readers.1.packets)" -gt 0 ] || fail "nothing read from the audio url"
+[ "$(json first video.frames)" -gt 0 ] || fail "no video frames"
+pass "resolved to a split stream, $(json first video.frames) video and $(json first audio.frames) audio frames"
+
+bench cached $resolver "$url"
+[ "$(calls)" -eq 1 ] || fail "resolved again although the urls were cached"
+[ "$(json cached video.frames)" = "$(json first video.frames)" ] || fail "the cached urls played differently"
+pass "second open used the cached urls"
+
+bench args $resolver -- -f best "$url"
+[ "$(calls)" -eq 2 ] || fail "other yt-dlp arguments reused the cached urls"
+pass "other yt-dlp arguments resolve again"
+
+bench quoted $resolver -- -o "it's a;b" "https://youtu.be/jplaycheck1;touch $TMP/ran"
+[ ! -e "$TMP/ran" ] || fail "the url was run by a shell"
+tail -n 1 "$STUB_RESOLVER_LOG" | grep -qF -e "-o it's a;b --get-url https://youtu.be/jplaycheck1;touch" ||
+    fail "the resolver got other arguments: $(tail -n 1 "$STUB_RESOLVER_LOG")"
+pass "arguments and url reach the resolver as given"
+
+if "$JPLAY" --bench $resolver https://youtu.be/fail > /dev/null 2> "$TMP/fail.err"; then
+    fail "a failing resolver didn't fail the run"
+fi
+grep -q "failed to retrieve video" "$TMP/fail.err" || fail "unexpected error: $(cat "$TMP/fail.err")"
+pass "a failing resolver ends the run with its error"
@@ -0,0 +1,26 @@
+#!/bin/sh
+# -yuv under Mesa's software renderer (llvmpipe) in a virtual X server. 8-bit
+# 4:2:0 H.264 is drawn through the shader, 10-bit 4:2:2 ProRes falls back to
+# the RGB conversion, and both play to the end. The clock is the system clock
+# since the machine may have no sound card to pace the audio.
+. tests/lib.sh
+command -v xvfb-run > /dev/null || fail "needs xvfb-run"
+
+play() {
+    log=$TMP/$1
+    shift
+    LIBGL_ALWAYS_SOFTWARE=1 timeout 120 xvfb-run -a -s "-screen 0 1280x720x24" \
+        "$JPLAY" -yuv -autoexit -sync external "$@" > "$log" 2>&1 ||
+        fail "jplay -yuv $* exited with $?: $(tail -n 5 "$log")"
+}
+
+play h264 bench/h264_1080p30.mkv
+! grep -q "YUV shader unavailable" "$TMP/h264" || fail "llvmpipe didn't take the shader"
+grep -q "through the YUV shader" "$TMP/h264" || fail "no frame was drawn through the shader"
+! grep -q "^LOG: Converting" "$TMP/h264" || fail "converted $(grep -m1 '^LOG: Converting' "$TMP/h264" | cut -d' ' -f4) to RGB"
+pass "$(grep -m1 'through the YUV shader' "$TMP/h264" | cut -d' ' -f3,4) drawn by the shader on llvmpipe"
+
+play prores bench/prores_1080p25.mov
+grep -q "^LOG: Converting .* yuv422p10" "$TMP/prores" || fail "10-bit ProRes wasn't converted to RGB"
+! grep -q "through the YUV shader" "$TMP/prores" || fail "10-bit frames went to the shader"
+pass "10-bit 4:2:2 falls back to the RGB conversion"
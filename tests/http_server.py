@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+# Serves one file over HTTP with range requests, throttled to a bandwidth and
+# with stalls injected at fixed byte intervals, for checking the network cache.
+# Prints the port once it listens and serves until killed.
+#
+#   tests/http_server.py <file> [--rate KB/s] [--stall-every KB] [--stall-ms ms]
+import argparse
+import http.server
+import os
+import re
+import sys
+import time
+
+CHUNK = 16 * 1024
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, fmt, *args):
+        pass
+
+    def range(self, size):
+        m = re.match(r"bytes=(\d*)-(\d*)$", self.headers.get("Range", ""))
+        if m is None or m.group(1) == "":
+            return 0, size - 1, False
+        start = int(m.group(1))
+        end = int(m.group(2)) if m.group(2) else size - 1
+        return start, min(end, size - 1), True
+
+    def headers_for(self, start, end, size, partial):
+        if start >= size:
+            self.send_response(416)
+            self.send_header("Content-Range", f"bytes */{size}")
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return False
+        self.send_response(206 if partial else 200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Accept-Ranges", "bytes")
+        self.send_header("Content-Length", str(end - start + 1))
+        if partial:
+            self.send_header("Content-Range", f"bytes {start}-{end}/{size}")
+        self.end_headers()
+        return True
+
+    def do_HEAD(self):
+        size = os.path.getsize(self.server.path)
+        start, end, partial = self.range(size)
+        self.headers_for(start, end, size, partial)
+
+    def do_GET(self):
+        opts = self.server.opts
+        size = os.path.getsize(self.server.path)
+        start, end, partial = self.range(size)
+        if not self.headers_for(start, end, size, partial):
+            return
+        with open(self.server.path, "rb") as f:
+            f.seek(start)
+            left = end - start + 1
+            began = time.monotonic()
+            sent = 0
+            while left > 0:
+                data = f.read(min(CHUNK, left))
+                if not data:
+                    break
+                try:
+                    self.wfile.write(data)
+                except (BrokenPipeError, ConnectionResetError):
+                    return
+                sent += len(data)
+                left -= len(data)
+                # the stalls count across connections so a refetch can't dodge them
+                self.server.served += len(data)
+                if opts.stall_every and self.server.served >= self.server.next_stall:
+                    self.server.next_stall += opts.stall_every * 1024
+                    time.sleep(opts.stall_ms / 1000.0)
+                    began += opts.stall_ms / 1000.0
+                if opts.rate:
+                    ahead = began + sent / (opts.rate * 1024.0) - time.monotonic()
+                    if ahead > 0:
+                        time.sleep(ahead)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("file")
+    parser.add_argument("--rate", type=int, default=0, help="KB/s, 0 for unthrottled")
+    parser.add_argument("--stall-every", type=int, default=0, help="KB between stalls")
+    parser.add_argument("--stall-ms", type=int, default=500)
+    opts = parser.parse_args()
+
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", 0), Handler)
+    server.daemon_threads = True
+    server.path = opts.file
+    server.opts = opts
+    server.served = 0
+    server.next_stall = opts.stall_every * 1024
+    print(server.server_address[1], flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    sys.exit(0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,50 @@
+# Sourced by the checks, which make check runs from the repo root after
+# building jplay and the bench inputs. A check prints one line per case and
+# exits non-zero at the first one that fails.
+set -eu
+JPLAY=${JPLAY:-./jplay}
+TMP=$(mktemp -d)
+trap 'for p in $(cat "$TMP/pids" 2>/dev/null); do kill "$p" 2>/dev/null || true; done; rm -rf "$TMP"' EXIT
+NAME=$(basename "$0" .sh)
+
+fail() {
+    echo "FAIL $NAME: $*" >&2
+    exit 1
+}
+
+pass() {
+    echo "ok   $NAME: $*"
+}
+
+# bench <report> <jplay args...>, a headless run as fast as it goes, the json
+# report is kept under the name
+bench() {
+    report=$TMP/$1
+    shift
+    "$JPLAY" --bench "$@" > "$report" 2> "$report.err" || fail "jplay $* exited with $?: $(cat "$report.err")"
+}
+
+# json <report> <path>, a value of a report, the path like video.frames or
+# inputs.readers.1.packets
+json() {
+    python3 - "$TMP/$1" "$2" <<'PY'
+import json, sys
+v = json.load(open(sys.argv[1]))
+for k in sys.argv[2].split("."):
+    v = v[int(k)] if k.isdigit() else v[k]
+print(v)
+PY
+}
+
+# start_server <file> [options], serves the file with tests/http_server.py
+# until the check exits and prints its port
+start_server() {
+    python3 tests/http_server.py "$@" > "$TMP/port" &
+    echo $! >> "$TMP/pids"
+    for _ in $(seq 50); do
+        [ -s "$TMP/port" ] && break
+        sleep 0.1
+    done
+    [ -s "$TMP/port" ] || fail "the http server didn't start"
+    cat "$TMP/port"
+}
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Stands in for yt-dlp with -resolver, called as <args> --get-url <url>. Every
+# call is appended to $STUB_RESOLVER_LOG. A url with "fail" in it fails like
+# an unavailable video, any other one resolves to the split bench inputs, the
+# way YouTube gives separate video and audio urls.
+echo "$*" >> "${STUB_RESOLVER_LOG:-/dev/null}"
+for url; do :; done
+case "$url" in
+*fail*)
+    echo "ERROR: video unavailable" >&2
+    exit 1
+    ;;
+esac
+echo bench/split_video.mkv
+echo bench/split_audio.m4a